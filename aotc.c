@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memset
+
+#include "chip8dis.h"
+#include "chip8flow.h"
+
+// chip8aot: rom to C, for building into a .so that chip8vm-aot -aot runs
+// (see chip8aot.h). Each basic block chip8flow finds becomes a function,
+// split after CALLs (the return address starts a new one) and cut short
+// before anything invalid, which is left to the interpreter. The code is
+// the switch engine's, opcode by opcode, with the operands baked in.
+
+// One compiled block: instructions [start, start + 2 * len)
+typedef struct {
+    int start, len;
+} unit;
+
+static FILE *out;
+
+// Compiled code runs on the plain machine (no -quirks), so opcodes as it
+// has them: 00FF is a 0NNN, left to the interpreter to halt on
+static int plain_class(unsigned short op)
+{
+    return op_class_isa(op, ISA_CHIP8);
+}
+
+// Finish the block after its k'th instruction (0 based), op, with pc
+// already set
+static void leave(int k, unsigned short op)
+{
+    fprintf(out, "    state->opcode = 0x%04x;\n", op);
+    fprintf(out, "    return %i;\n", k + 1);
+}
+
+// A skip: the next instruction, or the one after
+static void skip(const char *cond, int addr, unsigned short op, int k)
+{
+    fprintf(out, "    state->pc = (%s) ? 0x%03x : 0x%03x;\n", cond,
+            (addr + 4) & 0xfff, (addr + 2) & 0xfff);
+    leave(k, op);
+}
+
+// C for the instruction op at addr, the k'th in its block. Block enders
+// return from the function.
+static void emit_op(unsigned short op, int addr, int k)
+{
+    int x = (op & 0xf00) >> 8, y = (op & 0xf0) >> 4;
+    int nn = op & 0xff, nnn = op & 0xfff, n = op & 0xf;
+    int next = (addr + 2) & 0xfff;
+    char cond[64];
+
+    fprintf(out, "    // %03x: %04x\n", addr, op);
+    switch (plain_class(op))
+    {
+        case OP_CLRS:
+            fprintf(out, "    memset(state->gfx, 0, sizeof(state->gfx));\n");
+            fprintf(out, "    state->draw_flag = 1;\n");
+            break;
+        case OP_RET:
+            fprintf(out, "    state->pc = state->stack[state->sp & 0xf] & "
+                    "0xfff;\n");
+            fprintf(out, "    state->sp = (state->sp + 1) & 0xf;\n");
+            leave(k, op);
+            break;
+        case OP_GOTO:
+            fprintf(out, "    state->pc = 0x%03x;\n", nnn);
+            leave(k, op);
+            break;
+        case OP_CALL:
+            fprintf(out, "    state->sp = (state->sp - 1) & 0xf;\n");
+            fprintf(out, "    state->stack[state->sp] = 0x%03x;\n", next);
+            fprintf(out, "    state->pc = 0x%03x;\n", nnn);
+            leave(k, op);
+            break;
+        case OP_TEQ_I:
+            sprintf(cond, "state->v[%i] == 0x%02x", x, nn);
+            skip(cond, addr, op, k);
+            break;
+        case OP_TNE_I:
+            sprintf(cond, "state->v[%i] != 0x%02x", x, nn);
+            skip(cond, addr, op, k);
+            break;
+        case OP_TEQ:
+            sprintf(cond, "state->v[%i] == state->v[%i]", x, y);
+            skip(cond, addr, op, k);
+            break;
+        case OP_TNE:
+            sprintf(cond, "state->v[%i] != state->v[%i]", x, y);
+            skip(cond, addr, op, k);
+            break;
+        case OP_TKEY:
+            sprintf(cond, "state->key[state->v[%i] & 0xf] != 0", x);
+            skip(cond, addr, op, k);
+            break;
+        case OP_TNKEY:
+            sprintf(cond, "state->key[state->v[%i] & 0xf] == 0", x);
+            skip(cond, addr, op, k);
+            break;
+        case OP_MOV_I:
+            fprintf(out, "    state->v[%i] = 0x%02x;\n", x, nn);
+            break;
+        case OP_INC_I:
+            fprintf(out, "    state->v[%i] += 0x%02x;\n", x, nn);
+            break;
+        case OP_MOV_V:
+            fprintf(out, "    state->v[%i] = state->v[%i];\n", x, y);
+            break;
+        case OP_OR:
+            fprintf(out, "    state->v[%i] |= state->v[%i];\n", x, y);
+            break;
+        case OP_AND:
+            fprintf(out, "    state->v[%i] &= state->v[%i];\n", x, y);
+            break;
+        case OP_XOR:
+            fprintf(out, "    state->v[%i] ^= state->v[%i];\n", x, y);
+            break;
+        case OP_INC_V:
+            fprintf(out, "    state->v[%i] += state->v[%i];\n", x, y);
+            break;
+        case OP_SUB:
+            fprintf(out, "    state->v[%i] -= state->v[%i];\n", x, y);
+            break;
+        case OP_LESS:
+            fprintf(out, "    state->v[%i] = state->v[%i] - state->v[%i];\n",
+                    x, y, x);
+            break;
+        case OP_SHR:
+            // VY read once, it may be VF
+            fprintf(out, "    t = state->v[%i];\n", y);
+            fprintf(out, "    state->v[15] = t & 1;\n");
+            fprintf(out, "    state->v[%i] = t >> 1;\n", x);
+            break;
+        case OP_SHL:
+            fprintf(out, "    t = state->v[%i];\n", y);
+            fprintf(out, "    state->v[15] = t >> 7;\n");
+            fprintf(out, "    state->v[%i] = t << 1;\n", x);
+            break;
+        case OP_INDEX:
+            fprintf(out, "    state->index_reg = 0x%03x;\n", nnn);
+            break;
+        case OP_JMPOFF:
+            // Wherever it goes, the dispatcher finds it (or interprets)
+            fprintf(out, "    state->pc = (state->v[0] + 0x%03x) & 0xfff;\n",
+                    nnn);
+            leave(k, op);
+            break;
+        case OP_RAND:
+            fprintf(out, "    state->rng ^= state->rng << 13;\n");
+            fprintf(out, "    state->rng ^= state->rng >> 17;\n");
+            fprintf(out, "    state->rng ^= state->rng << 5;\n");
+            fprintf(out, "    state->v[%i] = (state->rng >> 24) & 0x%02x;\n",
+                    x, nn);
+            break;
+        case OP_DRAW:
+            // Clipped at the right and bottom, like the interpreter
+            fprintf(out, "    draw(state, state->v[%i], state->v[%i], %i);\n",
+                    x, y, n);
+            break;
+        case OP_GETKEY:
+            // No key down: stop here, to run it again next time
+            fprintf(out, "    state->key_flag = 0xff;\n");
+            fprintf(out, "    for (int i = 0; i <= 0xf; i++)\n");
+            fprintf(out, "        if (state->key[i] != 0)\n");
+            fprintf(out, "        {\n");
+            fprintf(out, "            state->v[%i] = i;\n", x);
+            fprintf(out, "            state->key_flag = i;\n");
+            fprintf(out, "            break;\n");
+            fprintf(out, "        }\n");
+            fprintf(out, "    if (state->key_flag == 0xff)\n");
+            fprintf(out, "    {\n");
+            fprintf(out, "        state->pc = 0x%03x;\n", addr);
+            fprintf(out, "        state->opcode = 0x%04x;\n", op);
+            fprintf(out, "        return %i;\n", k + 1);
+            fprintf(out, "    }\n");
+            break;
+        case OP_SET_DT:
+            // FX07 (the names are from VX's side: SET.DT sets it to DT)
+            fprintf(out, "    state->v[%i] = state->delay_timer;\n", x);
+            break;
+        case OP_GET_DT:
+            // FX15
+            fprintf(out, "    state->delay_timer = state->v[%i];\n", x);
+            break;
+        case OP_SET_ST:
+            fprintf(out, "    state->sound_timer = state->v[%i];\n", x);
+            break;
+        case OP_IADD:
+            fprintf(out, "    state->index_reg += state->v[%i];\n", x);
+            fprintf(out, "    state->v[15] = state->index_reg > 0xfff;\n");
+            fprintf(out, "    state->index_reg &= 0xfff;\n");
+            break;
+        case OP_FONT:
+            fprintf(out, "    state->index_reg = 0x50 + 5 * state->v[%i];\n",
+                    x);
+            break;
+        case OP_BCD:
+            fprintf(out, "    t = state->v[%i];\n", x);
+            fprintf(out, "    state->memory[(state->index_reg + 2) & 0xfff] = "
+                    "t %% 10;\n");
+            fprintf(out, "    state->memory[(state->index_reg + 1) & 0xfff] = "
+                    "t / 10 %% 10;\n");
+            fprintf(out, "    state->memory[state->index_reg & 0xfff] = "
+                    "t / 100;\n");
+            fprintf(out, "    if (wrote_code(state->index_reg, 3))\n");
+            fprintf(out, "    {\n");
+            fprintf(out, "        state->pc = 0x%03x;\n", next);
+            fprintf(out, "        state->opcode = 0x%04x;\n", op);
+            fprintf(out, "        return %i | AOT_SMC;\n", k + 1);
+            fprintf(out, "    }\n");
+            break;
+        case OP_STORE:
+            fprintf(out, "    for (int i = 0; i <= %i; i++)\n", x);
+            fprintf(out, "        state->memory[(state->index_reg + i) & "
+                    "0xfff] = state->v[i];\n");
+            fprintf(out, "    if (wrote_code(state->index_reg, %i))\n", x + 1);
+            fprintf(out, "    {\n");
+            fprintf(out, "        state->pc = 0x%03x;\n", next);
+            fprintf(out, "        state->opcode = 0x%04x;\n", op);
+            fprintf(out, "        return %i | AOT_SMC;\n", k + 1);
+            fprintf(out, "    }\n");
+            break;
+        case OP_LOAD:
+            fprintf(out, "    for (int i = 0; i <= %i; i++)\n", x);
+            fprintf(out, "        state->v[i] = state->memory[(state->index_reg"
+                    " + i) & 0xfff];\n");
+            break;
+    }
+}
+
+// Cut the flow's blocks into what gets compiled. Returns how many.
+static int find_units(const chip8_flow *flow, const unsigned char *memory,
+        unit *units)
+{
+    int n = 0;
+    for (int b = 0; b < flow->num_blocks; b++)
+    {
+        int start = flow->blocks[b].start;
+        for (int pc = start; pc < flow->blocks[b].end; pc += 2)
+        {
+            int cls = plain_class(memory[pc] << 8 | memory[pc + 1]);
+            if (cls == OP_INVALID || cls == OP_CALLPROG)
+            {
+                // Leave it to the interpreter (to halt on)
+                if (pc > start)
+                    units[n++] = (unit){start, (pc - start) / 2};
+                start = pc + 2;
+            }
+            else if (cls == OP_CALL)
+            {
+                units[n++] = (unit){start, (pc + 2 - start) / 2};
+                start = pc + 2;
+            }
+        }
+        if (start < flow->blocks[b].end)
+            units[n++] = (unit){start, (flow->blocks[b].end - start) / 2};
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]){
+    if (argc < 2)
+    {
+        printf("Usage: chip8aot <romfile> [out.c (default romfile.aot.c)]\n");
+        exit(1);
+    }
+
+    unsigned char memory[4096];
+    memset(memory, 0, sizeof(memory));
+    FILE *romfile = fopen(argv[1], "r");
+    if (romfile == NULL)
+    {
+        printf("Could not open file: %s\n", argv[1]);
+        exit(1);
+    }
+    int rom_len = fread(memory + 0x200, 1, 0xe00, romfile);
+    fclose(romfile);
+
+    char out_name[1024];
+    snprintf(out_name, sizeof(out_name), "%s.aot.c", argv[1]);
+    out = fopen(argc > 2 ? argv[2] : out_name, "w");
+    if (out == NULL)
+    {
+        printf("Could not create %s\n", argc > 2 ? argv[2] : out_name);
+        exit(1);
+    }
+
+    chip8_flow *flow = flow_analyze(memory, 0x200, 0x200 + rom_len, NULL,
+            ISA_CHIP8);
+    // Splitting only adds one per CALL, which are all in some block
+    unit *units = malloc((flow->num_blocks + flow->num_insns) * sizeof(unit));
+    int num_units = find_units(flow, memory, units);
+
+    fprintf(out, "// Generated by chip8aot from %s, don't edit.\n", argv[1]);
+    fprintf(out, "// gcc -O2 -fPIC -shared <this> -o rom.so, then "
+            "chip8vm-aot -aot rom.so\n\n");
+    fprintf(out, "#include <string.h>\n\n");
+    fprintf(out, "#include \"chip8vm.h\"\n");
+    fprintf(out, "#include \"chip8aot.h\"\n\n");
+
+    fprintf(out, "static const unsigned char rom[%i] = {", rom_len);
+    for (int i = 0; i < rom_len; i++)
+        fprintf(out, "%s0x%02x,", i % 12 ? " " : "\n    ", memory[0x200 + i]);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static const unsigned char code[4096] = {\n");
+    for (int u = 0; u < num_units; u++)
+        fprintf(out, "    [0x%03x ... 0x%03x] = 1,\n", units[u].start,
+                units[u].start + 2 * units[u].len - 1);
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "// Did storing n bytes at I hit compiled code?\n");
+    fprintf(out, "static inline int wrote_code(unsigned short i, int n)\n{\n");
+    fprintf(out, "    int hit = 0;\n");
+    fprintf(out, "    while (n--)\n");
+    fprintf(out, "        hit |= code[(i + n) & 0xfff];\n");
+    fprintf(out, "    return hit;\n}\n\n");
+
+    fprintf(out, "// DXYN, as the switch engine does it\n");
+    fprintf(out, "static inline void draw(chip8_state *state, int vx, int vy, "
+            "int n)\n{\n");
+    fprintf(out, "    vx &= GFX_W - 1;\n");
+    fprintf(out, "    vy &= GFX_H - 1;\n");
+    fprintf(out, "    uint64_t row, hit = 0;\n");
+    fprintf(out, "    for (int i = 0; i < n && vy + i < GFX_H; i++)\n");
+    fprintf(out, "    {\n");
+    fprintf(out, "        row = ((uint64_t)state->memory[(state->index_reg"
+            " + i) & 0xfff] << 56) >> vx;\n");
+    fprintf(out, "        hit |= state->gfx[vy + i] & row;\n");
+    fprintf(out, "        state->gfx[vy + i] ^= row;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    state->v[15] = hit != 0;\n");
+    fprintf(out, "    state->draw_flag = 1;\n}\n");
+
+    for (int u = 0; u < num_units; u++)
+    {
+        int start = units[u].start;
+        fprintf(out, "\nstatic int block_%03x(chip8_state *state, int max)\n"
+                "{\n", start);
+        // Scratch for ops that read a register they then overwrite
+        for (int k = 0; k < units[u].len; k++)
+        {
+            int cls = plain_class(memory[start + 2 * k] << 8 |
+                    memory[start + 2 * k + 1]);
+            if (cls == OP_SHR || cls == OP_SHL || cls == OP_BCD)
+            {
+                fprintf(out, "    unsigned char t;\n");
+                break;
+            }
+        }
+        unsigned short op = 0;
+        int ended = 0;
+        for (int k = 0; k < units[u].len; k++)
+        {
+            int addr = start + 2 * k;
+            if (k > 0)
+            {
+                fprintf(out, "    if (max == %i)\n    {\n", k);
+                fprintf(out, "        state->pc = 0x%03x;\n", addr);
+                fprintf(out, "        state->opcode = 0x%04x;\n", op);
+                fprintf(out, "        return %i;\n    }\n", k);
+            }
+            op = memory[addr] << 8 | memory[addr + 1];
+            int cls = plain_class(op);
+            emit_op(op, addr, k);
+            ended = cls == OP_RET || cls == OP_GOTO || cls == OP_CALL ||
+                cls == OP_JMPOFF || cls == OP_TEQ_I || cls == OP_TNE_I ||
+                cls == OP_TEQ || cls == OP_TNE || cls == OP_TKEY ||
+                cls == OP_TNKEY;
+        }
+        // Falls through into whatever's next
+        if (!ended)
+        {
+            fprintf(out, "    state->pc = 0x%03x;\n",
+                    (start + 2 * units[u].len) & 0xfff);
+            leave(units[u].len - 1, op);
+        }
+        fprintf(out, "}\n");
+    }
+
+    fprintf(out, "\nstatic const aot_block blocks[] = {\n");
+    for (int u = 0; u < num_units; u++)
+        fprintf(out, "    {0x%03x, %i, block_%03x},\n", units[u].start,
+                units[u].len, units[u].start);
+    fprintf(out, "};\n\n");
+    fprintf(out, "const aot_module chip8_aot_module = {\n");
+    fprintf(out, "    AOT_ABI, sizeof(chip8_state), rom, sizeof(rom),\n");
+    fprintf(out, "    blocks, %i, code,\n", num_units);
+    fprintf(out, "};\n");
+    fclose(out);
+
+    printf("%s: %i instructions in %i blocks compiled, %i data bytes",
+            argv[1], flow->num_insns, num_units, flow->data_bytes);
+    if (flow->indirect > 0)
+        printf(", %i BNNN left to the interpreter", flow->indirect);
+    printf("\n");
+    flow_free(flow);
+    free(units);
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strcmp, memcmp
+
+#include "chip8vm.h"
+#include "chip8aot.h"
+#include "chip8asm.h"
+
+// aotcheck: a rom compiled by chip8aot against the switch engine, frame
+// by frame from the same start, stopping at the first frame they differ.
+// make aottest runs it on the rom below, built fresh each time.
+//
+// Usage: aotcheck -rom out.ch8                  write the test rom
+//        aotcheck [-frames N] rom.ch8.so rom.ch8
+
+// A bit of everything the compiled blocks do, forever: draws, calls,
+// skips either way, the ALU ops, BCD and LOAD, timers, keys, a BNNN the
+// blocks hand back to the interpreter, and a STORE into the immediate of
+// the MOV.I at smc, so that block stops matching the rom after the first
+// lap and runs interpreted.
+static const char *test_rom =
+    "        CLRS\n"
+    "        MOV.I V8 $00\n"
+    "main:   RAND V0 $3f\n"
+    "        RAND V1 $1f\n"
+    "        INDEX sprite\n"
+    "        DRAW V0 V1 5\n"
+    "        MOV.V V9 VF\n"
+    "        CALL math\n"
+    "        CALL digits\n"
+    "        RAND V0 $02\n"
+    "        JMPOFF jt\n"
+    "cont:   INC.I V8 $01\n"
+    "        INDEX smcv\n"
+    "        MOV.V V0 V8\n"
+    "        STORE V0\n"
+    "smc:    DB $67\n"
+    "smcv:   DB $00\n"
+    "        TNKEY V2\n"
+    "        INC.I V7 $01\n"
+    "        TKEY V2\n"
+    "        INC.I V7 $10\n"
+    "        GET.DT V8\n"
+    "        SET.DT V4\n"
+    "        GOTO main\n"
+    "jt:     GOTO left\n"
+    "        GOTO right\n"
+    "left:   INC.I VA $01\n"
+    "        GOTO cont\n"
+    "right:  INC.I VB $01\n"
+    "        GOTO cont\n"
+    "math:   MOV.V V2 V0\n"
+    "        INC.V V2 V1\n"
+    "        SUB V2 V1\n"
+    "        SHL V2 V3\n"
+    "        SHR V3 V2\n"
+    "        LESS V3 V1\n"
+    "        XOR V3 V2\n"
+    "        OR V3 V1\n"
+    "        AND V3 V0\n"
+    "        TEQ V2 V3\n"
+    "        IADD V3\n"
+    "        TNE V2 V3\n"
+    "        INC.I V2 $05\n"
+    "        TEQ.I V2 $10\n"
+    "        TNE.I V3 $00\n"
+    "        RET\n"
+    "digits: FONT V2\n"
+    "        INDEX buf\n"
+    "        BCD V3\n"
+    "        LOAD V2\n"
+    "        RET\n"
+    "sprite: DB $f0 $90 $f0 $90 $f0\n"
+    "buf:    DB $00 $00 $00\n";
+
+// What differs between the two, or NULL if nothing does
+static const char * differs(const chip8_state *a, const chip8_state *b)
+{
+    if (a->pc != b->pc)
+        return "pc";
+    if (memcmp(a->v, b->v, sizeof(a->v)) != 0)
+        return "registers";
+    if (a->index_reg != b->index_reg)
+        return "I";
+    if (a->sp != b->sp || memcmp(a->stack, b->stack, sizeof(a->stack)) != 0)
+        return "stack";
+    if (a->delay_timer != b->delay_timer || a->sound_timer != b->sound_timer)
+        return "timers";
+    if (memcmp(a->gfx, b->gfx, sizeof(a->gfx)) != 0)
+        return "screen";
+    if (memcmp(a->memory, b->memory, sizeof(a->memory)) != 0)
+        return "memory";
+    if (a->halted != b->halted || a->rng != b->rng)
+        return "halted or rng";
+    return NULL;
+}
+
+static void write_test_rom(const char *path)
+{
+    chip8_asm a;
+    if (chip8_assemble(test_rom, 0, &a) < 0)
+    {
+        printf("Test rom line %i: %s\n", a.error_line, a.error);
+        exit(1);
+    }
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+    {
+        printf("Could not create %s\n", path);
+        exit(1);
+    }
+    fwrite(a.rom, 1, a.rom_len, out);
+    fclose(out);
+    chip8_asm_free(&a);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "-rom") == 0)
+    {
+        write_test_rom(argv[2]);
+        return 0;
+    }
+    int frames = 600, arg = 1;
+    if (argc >= 3 && strcmp(argv[1], "-frames") == 0)
+    {
+        frames = atoi(argv[2]);
+        arg = 3;
+    }
+    if (argc - arg != 2)
+    {
+        printf("Usage: aotcheck -rom out.ch8\n");
+        printf("       aotcheck [-frames N] rom.ch8.so rom.ch8\n");
+        exit(1);
+    }
+
+    chip8_state *interp = create_state();
+    interp->rng = 0x2545f491;
+    load_rom(argv[arg + 1], interp);
+    if (aot_load(argv[arg], interp) != 0)
+        exit(1);
+    chip8_state *aot = create_state();
+    copy_state(aot, interp);
+
+    long instrs = 0;
+    for (int f = 0; f < frames; f++)
+    {
+        long n = run_cycles(interp, CYCLES_PER_FRAME);
+        long m = aot_engine.run(aot, CYCLES_PER_FRAME);
+        tick_timers(interp);
+        tick_timers(aot);
+        const char *what = n != m ? "instructions run" :
+            differs(interp, aot);
+        if (what != NULL)
+        {
+            printf("%s: frame %i: %s differ (pc %03x interpreted, %03x "
+                    "compiled)\n", argv[arg + 1], f, what, interp->pc,
+                    aot->pc);
+            exit(1);
+        }
+        instrs += n;
+        if (interp->halted)
+            break;
+    }
+    printf("%s: compiled and interpreted agree, %ld instructions%s\n",
+            argv[arg + 1], instrs, interp->halted ? " (halted)" : "");
+    free(interp);
+    free(aot);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strncmp
+
+#include "chip8vm.h" // for CYCLES_PER_FRAME
+
+// Source level profile: an assembler source annotated, line by line,
+// with what a recorded run of its rom did there, like perf annotate.
+//
+//   assembler game.asm game.ch8            (also writes game.ch8.map)
+//   chip8vm-prof -cover game.ch8 cover.csv (or -prof cover.csv, playing)
+//   asmprof game.asm game.ch8.map cover.csv
+//
+// Instruction lines get how many times they ran and their share of the
+// run. The vm does one instruction a cycle (CYCLES_PER_FRAME a frame), so
+// runs are its cycles too. DB/DW lines get how often they were read
+// (FX65, DXYN and so on). The hottest lines are listed first.
+
+#define HOT_LINES 10
+
+// From the profile, by address
+static unsigned long long runs[4096], reads[4096];
+static unsigned long long total;
+
+// From the map, by address order
+typedef struct {
+    int addr;
+    int line;
+} map_entry;
+
+static void load_prof(const char *filename);
+static map_entry * load_map(const char *filename, int *num);
+static char * load_source(const char *filename, int *num_lines,
+        char ***lines);
+static int is_data(const char *line);
+
+int main(int argc, char *argv[]){
+    if (argc < 4)
+    {
+        printf("Usage: asmprof <src.asm> <rom.ch8.map> <profile.csv>\n");
+        printf("  the map is from the assembler, the profile from "
+                "chip8vm-prof -cover or -prof\n");
+        exit(1);
+    }
+    int num_lines, num_map;
+    char **lines;
+    load_source(argv[1], &num_lines, &lines);
+    map_entry *map = load_map(argv[2], &num_map);
+    load_prof(argv[3]);
+
+    // Each source line's runs (or reads, for data) and whether any of
+    // the rom is there at all
+    unsigned long long *count = calloc(num_lines + 1, sizeof(*count));
+    char *mapped = calloc(num_lines + 1, 1);
+    unsigned long long in_rom = 0;
+    for (int i = 0; i < num_map; i++)
+    {
+        int line = map[i].line;
+        if (line < 1 || line > num_lines)
+        {
+            printf("%s doesn't go with %s (line %i)\n", argv[2], argv[1],
+                    line);
+            exit(1);
+        }
+        int addr = map[i].addr & 0xfff;
+        mapped[line] = 1;
+        if (is_data(lines[line - 1]))
+        {
+            int end = i + 1 < num_map ? map[i + 1].addr : addr + 1;
+            for (int a = addr; a < end && a < 4096; a++)
+                count[line] += reads[a];
+        }
+        else
+        {
+            count[line] += runs[addr];
+            in_rom += runs[addr];
+        }
+    }
+
+    printf("%% %s, run from %s: %llu instructions (%.1f frames)",
+            argv[1], argv[3], total, (double)total / CYCLES_PER_FRAME);
+    if (total > 0 && in_rom < total)
+        printf(", %.1f%% outside this source", 100.0 * (total - in_rom) /
+                total);
+    printf("\n");
+
+    // Hottest instruction lines, a simple pick of the top few
+    char *shown = calloc(num_lines + 1, 1);
+    printf("%% hottest:\n");
+    for (int h = 0; h < HOT_LINES; h++)
+    {
+        int best = 0;
+        for (int l = 1; l <= num_lines; l++)
+            if (mapped[l] && !shown[l] && !is_data(lines[l - 1]) &&
+                    count[l] > 0 && (best == 0 || count[l] > count[best]))
+                best = l;
+        if (best == 0)
+            break;
+        shown[best] = 1;
+        printf("%%  %5.1f%%  line %i: %s\n", 100.0 * count[best] / total,
+                best, lines[best - 1]);
+    }
+    printf("\n");
+
+    // The source, annotated
+    printf("      runs       %% | source\n");
+    for (int l = 1; l <= num_lines; l++)
+    {
+        if (!mapped[l])
+            printf("%18s| %s\n", "", lines[l - 1]);
+        else if (is_data(lines[l - 1]))
+            printf("%10llu %6s | %s\n", count[l], "reads", lines[l - 1]);
+        else if (count[l] == 0)
+            printf("%10s %6s | %s\n", "-", "", lines[l - 1]);
+        else
+            printf("%10llu %5.1f%% | %s\n", count[l],
+                    100.0 * count[l] / total, lines[l - 1]);
+    }
+    return 0;
+}
+
+// pc and mem rows of a chip8prof CSV
+static void load_prof(const char *filename)
+{
+    FILE *in = fopen(filename, "r");
+    if (in == NULL)
+    {
+        printf("Could not open file: %s\n", filename);
+        exit(1);
+    }
+    char line[256];
+    unsigned int addr;
+    unsigned long long count, r, w;
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        if (sscanf(line, "pc,%x,%llu", &addr, &count) == 2)
+        {
+            runs[addr & 0xfff] += count;
+            total += count;
+        }
+        else if (sscanf(line, "mem,%x,,%llu,%llu", &addr, &r, &w) == 3)
+            reads[addr & 0xfff] += r;
+    }
+    fclose(in);
+}
+
+// "addr line" a line, as the assembler writes them
+static map_entry * load_map(const char *filename, int *num)
+{
+    FILE *in = fopen(filename, "r");
+    if (in == NULL)
+    {
+        printf("Could not open file: %s\n", filename);
+        exit(1);
+    }
+    int cap = 1024;
+    map_entry *map = malloc(cap * sizeof(map_entry));
+    *num = 0;
+    unsigned int addr;
+    int line;
+    while (fscanf(in, "%x %i", &addr, &line) == 2)
+    {
+        if (*num == cap)
+        {
+            cap *= 2;
+            map = realloc(map, cap * sizeof(map_entry));
+        }
+        map[(*num)++] = (map_entry){addr, line};
+    }
+    fclose(in);
+    return map;
+}
+
+// The whole file, split into 0 terminated lines
+static char * load_source(const char *filename, int *num_lines,
+        char ***lines)
+{
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL)
+    {
+        printf("Could not open file: %s\n", filename);
+        exit(1);
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    char *src = malloc(size + 1);
+    if (fread(src, 1, size, in) != (size_t)size)
+    {
+        printf("Could not read file: %s\n", filename);
+        exit(1);
+    }
+    src[size] = '\0';
+    fclose(in);
+
+    int n = 0;
+    for (long i = 0; i < size; i++)
+        n += src[i] == '\n';
+    *lines = malloc((n + 1) * sizeof(char *));
+    *num_lines = 0;
+    for (char *p = src; *p; )
+    {
+        char *line = p;
+        (*lines)[(*num_lines)++] = line;
+        while (*p && *p != '\n')
+            p++;
+        if (p > line && p[-1] == '\r')
+            p[-1] = '\0';
+        if (*p)
+            *p++ = '\0';
+    }
+    return src;
+}
+
+// Is it a DB/DW line (past any labels)
+static int is_data(const char *line)
+{
+    for (;;)
+    {
+        while (*line == ' ' || *line == '\t')
+            line++;
+        const char *start = line;
+        while (*line && *line != ' ' && *line != '\t')
+            line++;
+        if (line > start && line[-1] == ':')
+            continue;
+        return line - start == 2 && (strncmp(start, "DB", 2) == 0 ||
+                strncmp(start, "DW", 2) == 0);
+    }
+}
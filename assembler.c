@@ -1,276 +1,116 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h> // for memset
+#include <string.h> // for strcmp
 
-void invalid_line(char *line, int line_no);
-int conv_hex_str(char *str, int len);
-void write_op(unsigned short opcode, FILE *outfile);
+#include "chip8asm.h"
+
+// Front end to chip8asm.c: a source file in, out.ch8 and out.ch8.map out
+
+#define ROM_MAX (0x1000 - 0x200) // what fits in memory
+
+static void write_file(const char *name, const void *data, int len);
+static int map_line(char *out, int addr, int line_no);
 
 int main(int argc, char *argv[]){
+    int optimize = argc >= 2 && strcmp(argv[1], "-O") == 0;
+    if (optimize)
+    {
+        argc--;
+        argv++;
+    }
     if (argc < 2)
     {
-        printf("Usage: assembler <codefile>\n");
-        // TODO option to name out file
+        printf("Usage: assembler [-O] <codefile> [out.ch8]\n");
+        printf("  also writes out.ch8.map: address and source line of "
+                "everything assembled\n");
+        printf("  -O: peephole optimize, saying what it saved\n");
         exit(1);
     }
+    const char *outname = argc >= 3 ? argv[2] : "out.ch8";
 
-    // Open an assembly code file
-    FILE *codefile = fopen(argv[1], "r");
+    // The whole source, read at once, since labels point into it
+    FILE *codefile = fopen(argv[1], "rb");
     if (codefile == NULL)
     {
         printf("Could not open file: %s\n", argv[1]);
         exit(1);
     }
-
-    // Open a file for our bytecode:
-    // If creating name change option, be sure to change print text
-    FILE *outfile = fopen("out.ch8", "w");
-    if (outfile == NULL)
+    fseek(codefile, 0, SEEK_END);
+    long size = ftell(codefile);
+    fseek(codefile, 0, SEEK_SET);
+    char *src = malloc(size + 1);
+    if (src == NULL || fread(src, 1, size, codefile) != (size_t)size)
     {
-        printf("Could not create out.ch8\n");
+        printf("Could not read file: %s\n", argv[1]);
+        exit(1);
     }
-    
-    // Line limit 50 is fine, even if we want commenting
-    char line[50]; 
-    // compare first n chars. has to be at least 5 with current mnemonics
-    int line_no = 0; // useful for error reporting
+    src[size] = '\0';
+    fclose(codefile);
 
-    // some declarations for placeholders (val == nn, addr == nnn)
-    int x, y, val, addr;
-    unsigned short opcode;
-
-    while (fgets(line, sizeof(line), codefile) != NULL)
+    chip8_asm a;
+    if (chip8_assemble(src, optimize, &a) < 0)
     {
-        line_no++;
-        // Comments start with %, let's head those off right away
-        if (line[0] == '%')
-            continue;
-        // Can't use a switch with strings, so if-else if-else ladder
-        // Compare strings by their first few characters
-        // Enough to guarantee correct, not enough to get to args
-        else if (strncmp(line, "CALLPROG", 5) == 0)
-        {
-            addr = conv_hex_str(&line[10], 3);
-            opcode = addr;
-        }
-        else if (strncmp(line, "CLRS", 4) == 0)
-            opcode = 0x00e0;
-        else if (strncmp(line, "RET", 3) == 0)
-        {
-            opcode = 0x00ee;
-        }
-        else if (strncmp(line, "GOTO", 4) == 0)
-        {
-            addr = conv_hex_str(&line[6], 3);
-            opcode = 0x1000 + addr;
-        }
-        else if (strncmp(line, "CALL ", 5) == 0)
-        {
-            addr = conv_hex_str(&line[6], 3);
-            opcode = 0x2000 + addr;
-        }
-        else if (strncmp(line, "TEQ.I", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            val = conv_hex_str(&line[10], 2);
-            opcode = 0x3000 + (x * 0x100) + val;
-        }
-        else if (strncmp(line, "TNE.I", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            val = conv_hex_str(&line[10], 2);
-            opcode = 0x4000 + (x * 0x100) + val;
-        }
-        else if (strncmp(line, "TEQ ", 4) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x5000 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "MOV.I", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            val = conv_hex_str(&line[10], 2);
-            opcode = 0x6000 + (x * 0x100) + val;
-        }
-        else if (strncmp(line, "INC.I", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            val = conv_hex_str(&line[10], 2);
-            opcode = 0x7000 + (x * 0x100) + val;
-        }
-        else if (strncmp(line, "MOV.V", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            y = conv_hex_str(&line[10], 1);
-            opcode = 0x8000 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "OR", 2) == 0)
-        {
-            x = conv_hex_str(&line[4], 1);
-            y = conv_hex_str(&line[7], 1);
-            opcode = 0x8001 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "AND", 3) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x8002 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "XOR", 3) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x8003 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "INC.V", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            y = conv_hex_str(&line[10], 1);
-            opcode = 0x8004 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "SUB", 3) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x8005 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "SHR", 3) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x8006 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "LESS", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            y = conv_hex_str(&line[9], 1);
-            opcode = 0x8007 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "SHL", 3) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x800e + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "TNE ", 4) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            y = conv_hex_str(&line[8], 1);
-            opcode = 0x9000 + (x * 0x100) + (y * 0x10);
-        }
-        else if (strncmp(line, "INDEX", 5) == 0)
-        {
-            addr = conv_hex_str(&line[7], 3);
-            opcode = 0xa000 + addr;
-        }
-        else if (strncmp(line, "JMPOFF", 6) == 0)
-        {
-            addr = conv_hex_str(&line[8], 3);
-            opcode = 0xb000 + addr;
-        }
-        else if (strncmp(line, "RAND", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            val = conv_hex_str(&line[9], 2);
-            opcode = 0xc000 + (x * 0x100) + val;
-        }
-        else if (strncmp(line, "DRAW", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            y = conv_hex_str(&line[9], 1);
-            val = conv_hex_str(&line[11], 1);
-            opcode = 0xd000 + (x * 0x100) + (y * 0x10) + val;
-        }
-        else if (strncmp(line, "TKEY", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            opcode = 0xe09e + (x * 0x100);
-        }
-        else if (strncmp(line, "TNKEY", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            opcode = 0xe0a1 + (x * 0x100);
-        }
-        else if (strncmp(line, "SET.DT", 6) == 0)
-        {
-            x = conv_hex_str(&line[8], 1);
-            opcode = 0xf007 + (x * 0x100);
-        }
-        else if (strncmp(line, "GETKEY", 6) == 0)
-        {
-            x = conv_hex_str(&line[8], 1);
-            opcode = 0xf00a + (x * 0x100);
-        }
-        else if (strncmp(line, "GET.DT", 6) == 0)
-        {
-            x = conv_hex_str(&line[8], 1);
-            opcode = 0xf015 + (x * 0x100);
-        }
-        else if (strncmp(line, "SET.ST", 6) == 0)
-        {
-            x = conv_hex_str(&line[8], 1);
-            opcode = 0xf018 + (x * 0x100);
-        }
-        else if (strncmp(line, "IADD", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            opcode = 0xf01e + (x * 0x100);
-        }
-        else if (strncmp(line, "FONT", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            opcode = 0xf029 + (x * 0x100);
-        }
-        else if (strncmp(line, "BCD", 3) == 0)
-        {
-            x = conv_hex_str(&line[5], 1);
-            opcode = 0xf033 + (x * 0x100);
-        }
-        else if (strncmp(line, "STORE", 5) == 0)
-        {
-            x = conv_hex_str(&line[7], 1);
-            opcode = 0xf055 + (x * 0x100);
-        }
-        else if (strncmp(line, "LOAD", 4) == 0)
-        {
-            x = conv_hex_str(&line[6], 1);
-            opcode = 0xf065 + (x * 0x100);
-        }
-        // If it doesnt match anything above, we've got a bad line
-        else
-            invalid_line(line, line_no);
-
-        // Now, we should have an opcode, so write it to the file
-        write_op(opcode, outfile);
+        printf("ERROR at line: %i of %s\n", a.error_line, argv[1]);
+        printf("ERROR: %s\n", a.error);
+        exit(1);
+    }
+    if (optimize && a.not_optimized != NULL)
+        printf("Not optimizing: %s at line %i\n", a.not_optimized,
+                a.not_optimized_line);
+    else if (optimize)
+    {
+        int saved = a.folded + a.gotos + a.indexes + a.pairs;
+        printf("Optimized: %i instructions (%i bytes) removed, %i of them "
+                "in loops", saved, saved * 2, a.in_loops);
+        if (a.in_loops > 0)
+            printf(" (%i deep at most)", a.deepest);
+        printf("\n");
+        printf("  %i MOV.I/INC.I folded, %i GOTO next, %i INDEX repeated, "
+                "%i STORE/LOAD pairs\n", a.folded, a.gotos, a.indexes,
+                a.pairs);
     }
+    if (a.rom_len > ROM_MAX)
+        printf("WARNING: %i bytes, only %i fit in memory\n",
+                a.rom_len, ROM_MAX);
 
-    // We've reached the end of our code file, so close both files
-    fclose(codefile); 
-    fclose(outfile);
-}
+    // The map, "addr line" a statement: at most 5 + 1 + 10 + 1 chars each
+    char *map = malloc(a.map_len * 17 + 1);
+    int map_len = 0;
+    for (int i = 0; i < a.map_len; i++)
+        map_len += map_line(map + map_len, a.map[i].addr, a.map[i].line);
 
-// Handles printing error messages when encountering an invalid mnemonic
-void invalid_line(char *line, int line_no)
-{
-    printf("ERROR at line: %i\n", line_no);
-    printf("ERROR: Invalid mnemonic: %s\n", line);
-    exit(1);
+    // Write the rom and map in one go each
+    char mapname[1024];
+    snprintf(mapname, sizeof(mapname), "%s.map", outname);
+    write_file(outname, a.rom, a.rom_len);
+    write_file(mapname, map, map_len);
+    chip8_asm_free(&a);
 }
 
-int conv_hex_str(char *str, int len)
+static void write_file(const char *name, const void *data, int len)
 {
-    char sub[len];
-    strncpy(sub, str, len);
-    return strtol(sub, NULL, 16);
+    FILE *f = fopen(name, "wb");
+    if (f == NULL || fwrite(data, 1, len, f) != (size_t)len)
+    {
+        printf("Could not write %s\n", name);
+        exit(1);
+    }
+    fclose(f);
 }
 
-void write_op(unsigned short opcode, FILE *outfile)
+// "%03x %i\n" without printf, which was most of the time on big sources
+static int map_line(char *out, int addr, int line_no)
 {
-    // Useful while writing, and for creating file to test with
-    // printf("%04x\n", opcode);
-    unsigned char msb = (opcode & 0xff00) >> 8;
-    unsigned char lsb = opcode & 0xff;
-    fputc(msb, outfile);
-    fputc(lsb, outfile);
+    char tmp[16];
+    int n = 0, len = 0;
+    for (int d = addr > 0xfff ? (addr > 0xffff ? 16 : 12) : 8; d >= 0; d -= 4)
+        out[len++] = "0123456789abcdef"[addr >> d & 0xf];
+    out[len++] = ' ';
+    do
+        tmp[n++] = '0' + line_no % 10;
+    while ((line_no /= 10) > 0);
+    while (n > 0)
+        out[len++] = tmp[--n];
+    out[len++] = '\n';
+    return len;
 }
@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strcmp, strlen
+#include <time.h>
+#include <unistd.h> // for sysconf
+#include <pthread.h>
+
+#include "chip8vm.h"
+#include "chip8verify.h"
+
+// Benchmark: runs small synthetic ROMs, each hammering one family of
+// opcodes (plus a couple shaped like real game loops), on every engine,
+// and reports emulated instructions per second, ns per instruction and
+// frames per second. Each measurement is warmed up, sized to take about
+// -time ms, then repeated -runs times and the median kept.
+//
+// With -scale it instead runs K vms (-vms) on 1, 2, 4.. up to -threads
+// threads, to see where batch throughput stops scaling. The same work is
+// split over more threads, vm i going to thread i % threads so that
+// neighbouring states are always on different threads. Each thread count
+// is tried with the states laid out three ways:
+//   packed  one block, sizeof(chip8_state) apart, so neighbours can share
+//           a cache line (false sharing)
+//   padded  one block, each state on its own cache lines
+//   malloc  each state its own malloc()
+// The last column, max MB/s/vm, isn't measured: it's state size times a
+// vm's frames per second, the most state a vm could touch if every frame
+// went over all of it. Real traffic is far less (a frame mostly reads a
+// few bytes of code). It's there to set against memory bandwidth.
+//
+// Usage: chip8bench [-runs N] [-time ms] [-engine name] [-workload name]
+//                   [-scale [-threads N] [-vms K]] [-o out.csv|out.json]
+
+// A ROM as opcodes from 0x200, data included. Unused words are 0.
+typedef struct {
+    const char *name;
+    const char *about;
+    unsigned short words[48];
+} workload;
+
+static const workload workloads[] = {
+    {"alu", "8XY* arithmetic and logic", {
+        0x6001, 0x6102, 0x6203, 0x6304, // 200: V0-V3 = 1-4
+        0x8014, 0x8125, 0x8236, 0x830e, // 208: loop
+        0x8017, 0x8121, 0x8232, 0x8303,
+        0x7001, 0x8010,
+        0x1208,
+    }},
+    {"branch", "3XNN/4XNN/5XY0/9XY0 skips", {
+        0x6000, 0x6100,                 // 200
+        0x7001,                         // 204: loop
+        0x3000, 0x7101,
+        0x4005, 0x6100,
+        0x5010, 0x7101,
+        0x9010, 0x6000,
+        0x1204,
+    }},
+    {"call", "2NNN/00EE, three deep", {
+        0x2206, 0x1200, 0x0000,         // 200
+        0x220c, 0x00ee, 0x0000,         // 206
+        0x7001, 0x2212, 0x00ee,         // 20c
+        0x7101, 0x00ee,                 // 212
+    }},
+    {"draw", "DXYN, 5 and 15 rows, clearing now and then", {
+        0x6000, 0x6100, 0x6205,         // 200
+        0xf229, 0xd015,                 // 206: loop
+        0x7007, 0x7103,
+        0xa200, 0xd01f,
+        0x7201, 0x7301,
+        0x4300, 0x00e0,
+        0x1206,
+    }},
+    {"mem", "FX33/FX55/FX65", {
+        0xa400, 0x60ff,                 // 200
+        0xf033, 0xff55, 0xff65,         // 204: loop
+        0xa400, 0x7001,
+        0xf555, 0xf565,
+        0x1204,
+    }},
+    {"pong", "game-like: bounce a ball, poll a key, wait on DT", {
+        0x6020, 0x6110, 0x6201, 0x6301, // 200
+        0x6501, 0xa240,
+        0xd011,                         // 20c: loop, erase
+        0x8024, 0x8134,
+        0x4000, 0x6201, 0x403f, 0x62ff, // bounce
+        0x4100, 0x6301, 0x411f, 0x63ff,
+        0xd011,                         // 222: draw
+        0xe5a1, 0x7401,
+        0xc70f,
+        0xf607, 0x3600, 0x122a,         // 22a: wait for DT
+        0x6602, 0xf615,
+        0x120c,
+        [32] = 0x8000,                  // 240: ball sprite
+    }},
+    {"score", "game-like: BCD a score, draw its 3 digits", {
+        0x6a00,                         // 200
+        0xa300, 0xfa33, 0xf265,         // 202: loop
+        0x6b00, 0x6c00,
+        0xf029, 0xdbc5, 0x7b05,
+        0xf129, 0xdbc5, 0x7b05,
+        0xf229, 0xdbc5,
+        0x7a01,
+        0x1202,
+    }},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+typedef struct {
+    const char *engine;
+    const char *workload;
+    long frames;       // per run
+    double ips;        // median instructions per second
+    double ips_min;
+    double ips_max;
+    double fps;        // median frames per second
+} result;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The workload's code at 0x200, and a fixed rng seed: create_state()
+// seeds from the time, and CXNN should roll the same numbers every run
+static void load_workload(chip8_state *state, const workload *w)
+{
+    state->rng = 0x2545f491;
+    for (int i = 0; i < 48; i++)
+    {
+        state->memory[0x200 + 2 * i] = w->words[i] >> 8;
+        state->memory[0x200 + 2 * i + 1] = w->words[i] & 0xff;
+    }
+}
+
+// Run frames frames from a fresh start, the way the frontend does.
+// Returns seconds taken, and instructions run in *instrs.
+static double timed_run(const chip8_engine *e, const workload *w,
+        chip8_state *state, long frames, long *instrs)
+{
+    chip8_state *fresh = create_state();
+    load_workload(fresh, w);
+    // So the verified engine runs unchecked where it can
+    verify_state(fresh, NULL);
+    copy_state(state, fresh);
+    free(fresh);
+
+    long n = 0;
+    double start = now();
+    for (long f = 0; f < frames; f++)
+    {
+        n += e->run(state, CYCLES_PER_FRAME);
+        tick_timers(state);
+    }
+    double secs = now() - start;
+    if (state->halted)
+    {
+        printf("ERROR: %s halted at %03x on %s\n", w->name, state->pc, e->name);
+        exit(1);
+    }
+    *instrs = n;
+    return secs;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static result bench_one(const chip8_engine *e, const workload *w, int runs,
+        double target)
+{
+    chip8_state *state = create_state();
+    long instrs;
+
+    // Warm up, and find how many frames take about target seconds
+    long frames = 1000;
+    double secs;
+    while ((secs = timed_run(e, w, state, frames, &instrs)) < 0.05)
+        frames *= 2;
+    frames = frames * (target / secs);
+    if (frames < 1)
+        frames = 1;
+
+    double ips[runs], fps[runs];
+    for (int r = 0; r < runs; r++)
+    {
+        secs = timed_run(e, w, state, frames, &instrs);
+        ips[r] = instrs / secs;
+        fps[r] = frames / secs;
+    }
+    free(state);
+    qsort(ips, runs, sizeof(double), cmp_double);
+    qsort(fps, runs, sizeof(double), cmp_double);
+
+    result res = {e->name, w->name, frames, ips[runs / 2], ips[0],
+        ips[runs - 1], fps[runs / 2]};
+    return res;
+}
+
+static void save_csv(const result *res, int n, int runs, FILE *out)
+{
+    fprintf(out, "engine,workload,runs,frames,ips,ns_per_instr,fps,"
+            "ips_min,ips_max\n");
+    for (int i = 0; i < n; i++)
+        fprintf(out, "%s,%s,%i,%li,%.0f,%.3f,%.1f,%.0f,%.0f\n",
+                res[i].engine, res[i].workload, runs, res[i].frames,
+                res[i].ips, 1e9 / res[i].ips, res[i].fps, res[i].ips_min,
+                res[i].ips_max);
+}
+
+static void save_json(const result *res, int n, int runs, FILE *out)
+{
+    fprintf(out, "{\"cycles_per_frame\": %i, \"runs\": %i, \"results\": [",
+            CYCLES_PER_FRAME, runs);
+    for (int i = 0; i < n; i++)
+        fprintf(out, "%s\n  {\"engine\": \"%s\", \"workload\": \"%s\", "
+                "\"frames\": %li, \"ips\": %.0f, \"ns_per_instr\": %.3f, "
+                "\"fps\": %.1f, \"ips_min\": %.0f, \"ips_max\": %.0f}",
+                i ? "," : "", res[i].engine, res[i].workload, res[i].frames,
+                res[i].ips, 1e9 / res[i].ips, res[i].fps, res[i].ips_min,
+                res[i].ips_max);
+    fprintf(out, "]}\n");
+}
+
+// -scale
+
+#define LAYOUT_PACKED 0
+#define LAYOUT_PADDED 1
+#define LAYOUT_MALLOC 2
+#define NUM_LAYOUTS 3
+static const char *layout_names[NUM_LAYOUTS] = {"packed", "padded", "malloc"};
+
+typedef struct {
+    const char *layout;
+    int threads;
+    int vms;
+    double ips;         // median, all threads together
+    double efficiency;  // ips / (threads * ips on 1 thread)
+    double max_mb_per_vm; // estimate, not measured: see the top
+} scale_result;
+
+typedef struct {
+    const chip8_engine *e;
+    chip8_state **states;
+    int first;          // this thread runs states first, first + step, ..
+    int step;
+    int count;
+    long rounds;        // frames each of its vms runs
+    pthread_barrier_t *start;
+    long instrs;        // out
+} scale_job;
+
+static void * scale_worker(void *arg)
+{
+    scale_job *job = arg;
+    long n = 0;
+    pthread_barrier_wait(job->start);
+    for (long r = 0; r < job->rounds; r++)
+        for (int i = job->first; i < job->count; i += job->step)
+        {
+            n += job->e->run(job->states[i], CYCLES_PER_FRAME);
+            tick_timers(job->states[i]);
+        }
+    job->instrs = n;
+    return NULL;
+}
+
+// vms states in the given layout, all copies of fresh. *block is what to
+// free afterwards, NULL for the malloc layout.
+static chip8_state ** alloc_states(int layout, int vms,
+        const chip8_state *fresh, unsigned char **block)
+{
+    chip8_state **states = malloc(vms * sizeof(chip8_state *));
+    size_t stride = sizeof(chip8_state);
+    *block = NULL;
+    if (layout == LAYOUT_PADDED)
+    {
+        stride = (stride + 63) & ~(size_t)63;
+        *block = aligned_alloc(64, vms * stride);
+    }
+    else if (layout == LAYOUT_PACKED)
+        *block = malloc(vms * stride);
+    for (int i = 0; i < vms; i++)
+    {
+        if (*block != NULL)
+            states[i] = (chip8_state *)(*block + i * stride);
+        else
+            states[i] = malloc(sizeof(chip8_state));
+        copy_state(states[i], fresh);
+    }
+    return states;
+}
+
+static void free_states(chip8_state **states, int vms, unsigned char *block)
+{
+    if (block != NULL)
+        free(block);
+    else
+        for (int i = 0; i < vms; i++)
+            free(states[i]);
+    free(states);
+}
+
+// One timed run: rounds frames on every vm, split over threads.
+// Returns seconds, instructions in *instrs.
+static double scale_run(const chip8_engine *e, const workload *w, int layout,
+        int vms, int threads, long rounds, long *instrs)
+{
+    chip8_state *fresh = create_state();
+    load_workload(fresh, w);
+    unsigned char *block;
+    chip8_state **states = alloc_states(layout, vms, fresh, &block);
+    free(fresh);
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, threads + 1);
+    pthread_t tids[threads];
+    scale_job jobs[threads];
+    for (int t = 0; t < threads; t++)
+    {
+        scale_job job = {e, states, t, threads, vms, rounds, &start, 0};
+        jobs[t] = job;
+        pthread_create(&tids[t], NULL, scale_worker, &jobs[t]);
+    }
+    pthread_barrier_wait(&start);
+    double begin = now();
+    long n = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        n += jobs[t].instrs;
+    }
+    double secs = now() - begin;
+    pthread_barrier_destroy(&start);
+
+    for (int i = 0; i < vms; i++)
+        if (states[i]->halted)
+        {
+            printf("ERROR: %s halted at %03x on %s\n", w->name,
+                    states[i]->pc, e->name);
+            exit(1);
+        }
+    free_states(states, vms, block);
+    *instrs = n;
+    return secs;
+}
+
+// Every layout on 1, 2, 4.. max_threads threads. Results go in res,
+// returns how many.
+static int scale_bench(const chip8_engine *e, const workload *w, int vms,
+        int max_threads, int runs, double target, scale_result *res)
+{
+    int n = 0;
+    long instrs;
+    long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (cache <= 0)
+        cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    printf("%s on %s, %i vms, %zu byte states, %.1f MB of state; "
+            "last level cache %.1f MB\n", w->name, e->name, vms,
+            sizeof(chip8_state), vms * sizeof(chip8_state) / 1e6,
+            cache > 0 ? cache / 1e6 : 0.0);
+    printf("%-8s %7s %14s %14s %6s %12s\n", "layout", "threads", "instr/s",
+            "instr/s/thr", "eff", "max MB/s/vm");
+
+    for (int layout = 0; layout < NUM_LAYOUTS; layout++)
+    {
+        // Size the run on one thread, that being the slowest
+        long rounds = 16;
+        double secs;
+        while ((secs = scale_run(e, w, layout, vms, 1, rounds, &instrs)) < 0.05)
+            rounds *= 2;
+        rounds = rounds * (target / secs);
+        if (rounds < 1)
+            rounds = 1;
+
+        double single = 0;
+        for (int threads = 1; threads <= max_threads; )
+        {
+            double ips[runs];
+            for (int r = 0; r < runs; r++)
+            {
+                secs = scale_run(e, w, layout, vms, threads, rounds, &instrs);
+                ips[r] = instrs / secs;
+            }
+            qsort(ips, runs, sizeof(double), cmp_double);
+            if (threads == 1)
+                single = ips[runs / 2];
+
+            // A frame can touch all of a vm's state, so this is the most
+            // state traffic a vm could need: state size * its frames/s.
+            // An upper bound worked out, not a measurement.
+            double fps_per_vm = ips[runs / 2] / CYCLES_PER_FRAME / vms;
+            scale_result r = {layout_names[layout], threads, vms,
+                ips[runs / 2], ips[runs / 2] / (threads * single),
+                fps_per_vm * sizeof(chip8_state) / 1e6};
+            printf("%-8s %7i %14.0f %14.0f %5.0f%% %12.1f\n", r.layout,
+                    r.threads, r.ips, r.ips / threads, 100 * r.efficiency,
+                    r.max_mb_per_vm);
+            fflush(stdout);
+            res[n++] = r;
+
+            // Always finish on max_threads itself
+            if (threads < max_threads && threads * 2 > max_threads)
+                threads = max_threads;
+            else
+                threads *= 2;
+        }
+    }
+    return n;
+}
+
+static void save_scale_csv(const scale_result *res, int n, FILE *out)
+{
+    fprintf(out, "layout,threads,vms,ips,efficiency,max_mb_per_vm\n");
+    for (int i = 0; i < n; i++)
+        fprintf(out, "%s,%i,%i,%.0f,%.4f,%.2f\n", res[i].layout,
+                res[i].threads, res[i].vms, res[i].ips, res[i].efficiency,
+                res[i].max_mb_per_vm);
+}
+
+static void save_scale_json(const scale_result *res, int n, int runs,
+        FILE *out)
+{
+    fprintf(out, "{\"state_bytes\": %zu, \"runs\": %i, \"results\": [",
+            sizeof(chip8_state), runs);
+    for (int i = 0; i < n; i++)
+        fprintf(out, "%s\n  {\"layout\": \"%s\", \"threads\": %i, "
+                "\"vms\": %i, \"ips\": %.0f, \"efficiency\": %.4f, "
+                "\"max_mb_per_vm\": %.2f}", i ? "," : "", res[i].layout,
+                res[i].threads, res[i].vms, res[i].ips, res[i].efficiency,
+                res[i].max_mb_per_vm);
+    fprintf(out, "]}\n");
+}
+
+static FILE * open_output(const char *out_file, int *json)
+{
+    FILE *out = fopen(out_file, "w");
+    if (out == NULL)
+    {
+        printf("Could not open file: %s\n", out_file);
+        exit(1);
+    }
+    size_t len = strlen(out_file);
+    *json = len >= 5 && strcmp(out_file + len - 5, ".json") == 0;
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 5;
+    double target = 0.2;
+    const char *engine = NULL, *only = NULL, *out_file = NULL;
+    int scale = 0, vms = 256;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc)
+            target = atoi(argv[++i]) / 1000.0;
+        else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc)
+            engine = argv[++i];
+        else if (strcmp(argv[i], "-workload") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            out_file = argv[++i];
+        else if (strcmp(argv[i], "-scale") == 0)
+            scale = 1;
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            max_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-vms") == 0 && i + 1 < argc)
+            vms = atoi(argv[++i]);
+        else
+        {
+            printf("Usage: chip8bench [-runs N] [-time ms] [-engine name] "
+                    "[-workload name]\n");
+            printf("                  [-scale [-threads N] [-vms K]] "
+                    "[-o out.csv|out.json]\n");
+            printf("Workloads:\n");
+            for (int w = 0; w < NUM_WORKLOADS; w++)
+                printf("  %-8s %s\n", workloads[w].name, workloads[w].about);
+            exit(1);
+        }
+    }
+    if (runs < 1 || target <= 0 || max_threads < 1 || vms < 1)
+    {
+        printf("ERROR: -runs, -time, -threads and -vms must be positive\n");
+        exit(1);
+    }
+    if (engine != NULL && find_engine(engine) == NULL)
+    {
+        printf("ERROR: no engine called %s\n", engine);
+        exit(1);
+    }
+
+    if (scale)
+    {
+        const chip8_engine *e = engine ? find_engine(engine) : chip8_engines;
+        const workload *w = NULL;
+        for (int i = 0; i < NUM_WORKLOADS; i++)
+            if (strcmp(only ? only : "pong", workloads[i].name) == 0)
+                w = &workloads[i];
+        if (w == NULL)
+        {
+            printf("ERROR: no workload called %s\n", only);
+            exit(1);
+        }
+        scale_result *res = malloc(NUM_LAYOUTS * 32 * sizeof(scale_result));
+        int n = scale_bench(e, w, vms, max_threads, runs, target, res);
+        if (out_file != NULL)
+        {
+            int json;
+            FILE *out = open_output(out_file, &json);
+            if (json)
+                save_scale_json(res, n, runs, out);
+            else
+                save_scale_csv(res, n, out);
+            fclose(out);
+        }
+        free(res);
+        return 0;
+    }
+
+    int max = 0;
+    for (const chip8_engine *e = chip8_engines; e->name != NULL; e++)
+        max += NUM_WORKLOADS;
+    result *res = malloc(max * sizeof(result));
+    int n = 0;
+
+    printf("%-10s %-8s %14s %10s %12s %8s\n", "engine", "workload",
+            "instr/s", "ns/instr", "fps", "spread");
+    for (const chip8_engine *e = chip8_engines; e->name != NULL; e++)
+    {
+        if (engine != NULL && strcmp(engine, e->name) != 0)
+            continue;
+        for (int w = 0; w < NUM_WORKLOADS; w++)
+        {
+            if (only != NULL && strcmp(only, workloads[w].name) != 0)
+                continue;
+            result r = bench_one(e, &workloads[w], runs, target);
+            printf("%-10s %-8s %14.0f %10.3f %12.1f %7.1f%%\n", r.engine,
+                    r.workload, r.ips, 1e9 / r.ips, r.fps,
+                    100 * (r.ips_max - r.ips_min) / r.ips);
+            fflush(stdout);
+            res[n++] = r;
+        }
+    }
+
+    if (out_file != NULL)
+    {
+        int json;
+        FILE *out = open_output(out_file, &json);
+        if (json)
+            save_json(res, n, runs, out);
+        else
+            save_csv(res, n, runs, out);
+        fclose(out);
+    }
+    free(res);
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h> // for memset, memcmp
+#include <dlfcn.h>
+
+#include "chip8vm.h"
+#include "chip8aot.h"
+
+// The loaded rom, and its blocks by start address
+static const aot_module *module;
+static const aot_block *by_pc[4096];
+// Set once any vm has written over compiled code, see chip8aot.h
+static int smc;
+
+// Load a .so from chip8aot for the rom in state. Returns -1 (having
+// said why) if it can't be used.
+int aot_load(const char *path, const chip8_state *state)
+{
+    void *so = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (so == NULL)
+    {
+        printf("Could not load %s: %s\n", path, dlerror());
+        return -1;
+    }
+    const aot_module *m = dlsym(so, "chip8_aot_module");
+    if (m == NULL || m->abi != AOT_ABI ||
+            m->state_size != (int)sizeof(chip8_state))
+    {
+        printf("%s wasn't built by this chip8aot (or for this build)\n",
+                path);
+        dlclose(so);
+        return -1;
+    }
+    if (m->rom_len > MEM_SIZE - 0x200 ||
+            memcmp(state->memory + 0x200, m->rom, m->rom_len) != 0)
+    {
+        printf("%s was built from a different rom\n", path);
+        dlclose(so);
+        return -1;
+    }
+    memset(by_pc, 0, sizeof(by_pc));
+    for (int i = 0; i < m->num_blocks; i++)
+        by_pc[m->blocks[i].start] = &m->blocks[i];
+    module = m;
+    __atomic_store_n(&smc, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// After an interpreted step: did it just store over compiled code?
+static void check_store(chip8_state *state)
+{
+    unsigned short op = state->opcode;
+    int n = (op & 0xf0ff) == 0xf055 ? ((op >> 8) & 0xf) + 1 :
+        (op & 0xf0ff) == 0xf033 ? 3 : 0;
+    for (int i = 0; i < n; i++)
+        if (module->code[(state->index_reg + i) & ADDR_MASK])
+            __atomic_store_n(&smc, 1, __ATOMIC_RELAXED);
+}
+
+// Blocks while pc is on one (and it's still the code it was compiled
+// from), the interpreter otherwise
+static long run_aot(chip8_state *state, long cycles)
+{
+    if (module == NULL)
+        return run_cycles(state, cycles);
+    long n = 0;
+    while (n < cycles && !state->halted)
+    {
+        const aot_block *b = by_pc[state->pc & ADDR_MASK];
+        if (b != NULL && (!__atomic_load_n(&smc, __ATOMIC_RELAXED) ||
+                memcmp(state->memory + b->start,
+                    module->rom + b->start - 0x200, b->len * 2) == 0))
+        {
+            int done = b->run(state, cycles - n < b->len ? cycles - n :
+                    b->len);
+            if (done & AOT_SMC)
+                __atomic_store_n(&smc, 1, __ATOMIC_RELAXED);
+            n += done & (AOT_SMC - 1);
+        }
+        else
+        {
+            emulate_cycle(state);
+            check_store(state);
+            n++;
+        }
+    }
+    return n;
+}
+
+const chip8_engine aot_engine = {"aot", run_aot};
@@ -0,0 +1,47 @@
+#ifndef CHIP8AOT_H_INC
+#define CHIP8AOT_H_INC
+
+#include "chip8vm.h"
+
+// Ahead of time compiled roms. chip8aot turns a rom's basic blocks (from
+// chip8flow) into C, one function per block, which gets built into a
+// shared object; chip8vm-aot -aot rom.so loads it and runs the blocks
+// instead of interpreting them. It's the same machine as the switch
+// engine, only faster.
+//
+// Anything that isn't the start of a compiled block is interpreted a
+// step at a time until it gets back to one: BNNN targets the flow
+// analysis couldn't see, invalid opcodes and the like. Writes into
+// compiled code (self modifying roms) are caught; from then on a block
+// only runs compiled if its bytes in the vm still match the rom.
+
+// Bump when aot_module or the generated code changes
+#define AOT_ABI 1
+
+// Set in a block's return value if it stopped after writing to code
+#define AOT_SMC 0x10000
+
+typedef struct {
+    unsigned short start;   // address of its first instruction
+    unsigned short len;     // instructions, at most
+    // Runs the block, at most max (> 0) instructions of it. Returns
+    // how many it did (fewer than len if max ran out, or it stopped at
+    // FX0A with no key or after a write to code), maybe with AOT_SMC.
+    int (*run)(chip8_state *state, int max);
+} aot_block;
+
+// What the generated .so exports, as chip8_aot_module
+typedef struct {
+    int abi;
+    int state_size;             // sizeof(chip8_state) it was built with
+    const unsigned char *rom;   // the rom it was built from, at 0x200
+    int rom_len;
+    const aot_block *blocks;    // by address
+    int num_blocks;
+    const unsigned char *code;  // 4096 bytes, 1 on compiled code
+} aot_module;
+
+int aot_load(const char *path, const chip8_state *state);
+extern const chip8_engine aot_engine;
+
+#endif
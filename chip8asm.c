@@ -0,0 +1,663 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strncmp, strcspn, memset
+
+#include "chip8dis.h"
+#include "chip8asm.h"
+
+// Two passes over the source. The first gives every line its address
+// and every label its value; the second encodes, with all the labels
+// known, so they can be used before they're defined.
+//
+// A line is [label:] [mnemonic operands] [% comment]. Mnemonics and
+// operands are as disasm prints them (CHIP8_OPS in chip8dis.h): VX for
+// registers, $nn / $nnn for values, or a label where an address goes,
+// and a bare digit for DRAW's n, the scrolls' n and PLANE's mask. LONGI
+// (XO-CHIP's F000 NNNN) takes a $nnnn or a label and is 4 bytes. Also
+//   DB $nn ...     bytes
+//   DW $nnnn ...   16 bit words, big endian like opcodes (or labels)
+// A label that's a number (200:) is disasm's address column, and has to
+// be where the line really lands, so its listings go straight back in.
+//
+// optimize runs a peephole pass between the two (see peephole()).
+
+#define ROM_START 0x200
+
+// Most a line can have: label, mnemonic and 8 bytes on a disasm DB line,
+// with plenty spare
+#define MAX_TOKENS 64
+
+// Directives, next to the OP_* from the opcode table
+#define DIR_DB NUM_OP_CLASSES
+#define DIR_DW (NUM_OP_CLASSES + 1)
+
+typedef struct {
+    const char *s;
+    int len;
+} token;
+
+// A line with something on it to assemble
+typedef struct {
+    const char *text;   // start of the line in the source
+    int line;
+    int addr;
+    int len;            // bytes
+    int kind;           // OP_* or DIR_*
+    int value;          // NN to use instead of the source's, -1 for none
+    char labelled;      // has a (named) label, so may be jumped to
+    char deleted;       // by peephole(), takes no space
+} stmt;
+
+// Labels, open addressing on the name (which points into the source)
+typedef struct {
+    const char *name;   // NULL for an empty slot
+    int len;
+    int stmt;           // what it's on, num_stmts for the end
+} symbol;
+
+// Everything for one chip8_assemble(), so it can run on many threads
+typedef struct {
+    symbol *syms;
+    int sym_cap, sym_count;
+    // One past the last is the end, for labels after everything
+    stmt *stmts;
+    int num_stmts;
+    chip8_asm *out;
+} assembly;
+
+// Note why it didn't assemble (the first reason, if there are several).
+// Returns -1 to pass on.
+static int fail(assembly *as, const char *text, int line_no, const char *why)
+{
+    if (as->out->error_line == 0)
+    {
+        as->out->error_line = line_no;
+        snprintf(as->out->error, sizeof(as->out->error), "%s: %.*s", why,
+                (int)strcspn(text, "\r\n"), text);
+    }
+    return -1;
+}
+
+// Split a line into toks, up to a % comment or the end of the line.
+// Returns how many (more than MAX_TOKENS if it didn't fit), with how
+// many of them at the start are label: definitions (the colon dropped)
+// in *labels.
+static int tokenize(const char *p, token *toks, int *labels)
+{
+    int n = 0;
+    *labels = 0;
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '%')
+            return n;
+        const char *start = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' &&
+                *p != '%')
+            p++;
+        if (n == MAX_TOKENS)
+            return n + 1;
+        toks[n] = (token){start, p - start};
+        if (n == *labels && p[-1] == ':' && p - start > 1)
+        {
+            toks[n].len--;
+            (*labels)++;
+        }
+        n++;
+    }
+}
+
+static unsigned int hash_name(const char *name, int len)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619;
+    return h;
+}
+
+// Where name is in syms, or the empty slot it would go in
+static symbol * sym_slot(assembly *as, const char *name, int len)
+{
+    unsigned int i = hash_name(name, len) & (as->sym_cap - 1);
+    while (as->syms[i].name != NULL && (as->syms[i].len != len ||
+                strncmp(as->syms[i].name, name, len) != 0))
+        i = (i + 1) & (as->sym_cap - 1);
+    return &as->syms[i];
+}
+
+static int sym_add(assembly *as, const char *name, int len, int at,
+        const char *text, int line_no)
+{
+    // Kept under half full
+    if ((as->sym_count + 1) * 2 > as->sym_cap)
+    {
+        symbol *old = as->syms;
+        int old_cap = as->sym_cap;
+        as->sym_cap *= 2;
+        as->syms = calloc(as->sym_cap, sizeof(symbol));
+        for (int i = 0; i < old_cap; i++)
+            if (old[i].name != NULL)
+                *sym_slot(as, old[i].name, old[i].len) = old[i];
+        free(old);
+    }
+    symbol *s = sym_slot(as, name, len);
+    if (s->name != NULL)
+        return fail(as, text, line_no, "label already defined");
+    *s = (symbol){name, len, at};
+    as->sym_count++;
+    return 0;
+}
+
+// Value of an operand token like V3 or $2a4: prefix (0 for none) then
+// 1 to digits hex digits. -1 if it isn't one.
+static int operand(token *t, char prefix, int digits)
+{
+    const char *s = t->s;
+    int len = t->len;
+    if (prefix)
+    {
+        if (len == 0 || (*s != prefix && *s != (prefix | 0x20)))
+            return -1;
+        s++;
+        len--;
+    }
+    if (len < 1 || len > digits)
+        return -1;
+    int v = 0;
+    for (int i = 0; i < len; i++)
+    {
+        char c = s[i];
+        if (c >= '0' && c <= '9')
+            v = v * 16 + c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            v = v * 16 + (c | 0x20) - 'a' + 10;
+        else
+            return -1;
+    }
+    return v;
+}
+
+// Is it a label name: a letter, _ or . then those or digits
+static int identifier(token *t)
+{
+    for (int i = 0; i < t->len; i++)
+    {
+        char c = t->s[i];
+        int alpha = (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+        if (!(alpha || c == '_' || c == '.' || (i > 0 && c >= '0' && c <= '9')))
+            return 0;
+    }
+    return t->len > 0;
+}
+
+// A label used as a value, at most max
+static int address(assembly *as, token *t, int max, const char *text,
+        int line_no)
+{
+    symbol *s = sym_slot(as, t->s, t->len);
+    if (s->name == NULL)
+        return fail(as, text, line_no, "undefined label");
+    if (as->stmts[s->stmt].addr > max)
+        return fail(as, text, line_no, "label's address is too big for here");
+    return as->stmts[s->stmt].addr;
+}
+
+// Give every statement its address, the end included; deleted ones take
+// no space. Returns the end.
+static int layout(assembly *as)
+{
+    int addr = ROM_START;
+    for (int s = 0; s < as->num_stmts; s++)
+    {
+        as->stmts[s].addr = addr;
+        if (!as->stmts[s].deleted)
+            addr += as->stmts[s].len;
+    }
+    as->stmts[as->num_stmts].addr = addr;
+    return addr;
+}
+
+// The statement's operands, and how many
+static int stmt_args(assembly *as, int s, token *toks, token **args)
+{
+    int labels;
+    int n = tokenize(as->stmts[s].text, toks, &labels);
+    *args = &toks[labels + 1];
+    return n - labels - 1;
+}
+
+// Next statement still there after s, or num_stmts
+static int next_stmt(assembly *as, int s)
+{
+    do
+        s++;
+    while (s < as->num_stmts && as->stmts[s].deleted);
+    return s;
+}
+
+static int is_skip(int kind)
+{
+    return kind == OP_TEQ_I || kind == OP_TNE_I || kind == OP_TEQ ||
+        kind == OP_TNE || kind == OP_TKEY || kind == OP_TNKEY;
+}
+
+// VX and NN of a MOV.I or INC.I, -1s if NN isn't a plain number
+static void reg_value(assembly *as, int s, int *x, int *v)
+{
+    token toks[MAX_TOKENS], *a;
+    if (stmt_args(as, s, toks, &a) != 2)
+    {
+        *x = *v = -1;
+        return;
+    }
+    *x = operand(&a[0], 'V', 1);
+    *v = as->stmts[s].value >= 0 ? as->stmts[s].value :
+        operand(&a[1], '$', 2);
+}
+
+// Cuts instructions that can't make a difference, going by what
+// emulate_opcode() does:
+//   MOV.I/INC.I VX then INC.I VX          one MOV.I/INC.I of the sum
+//   GOTO to the next instruction          gone
+//   INDEX of what I already is            gone
+//   STORE VX then LOAD VY, Y <= X         the LOAD goes
+//   LOAD VX then STORE VY, Y <= X         the STORE goes
+// Nothing that's jumped to (labelled) is removed, and nothing straight
+// after a skip is touched, since the skip would then skip something
+// else. Labels follow what they were on, so addresses are all worked
+// out again afterwards; that means it's off if anything jumps to a
+// fixed address in the rom (or uses BNNN, which jumps into tables by
+// offset). It takes code not to be read or written as data.
+static void peephole(assembly *as)
+{
+    stmt *stmts = as->stmts;
+    int num_stmts = as->num_stmts;
+    chip8_asm *out = as->out;
+    int end = layout(as);
+    token toks[MAX_TOKENS], *a;
+    for (int s = 0; s < num_stmts; s++)
+    {
+        int k = stmts[s].kind;
+        if (k == OP_JMPOFF)
+        {
+            out->not_optimized = "BNNN";
+            out->not_optimized_line = stmts[s].line;
+            return;
+        }
+        if ((k == OP_GOTO || k == OP_CALL || k == OP_INDEX ||
+                    k == OP_LONGI) &&
+                stmt_args(as, s, toks, &a) == 1 && !identifier(&a[0]))
+        {
+            int v = operand(&a[0], '$', k == OP_LONGI ? 4 : 3);
+            if (v >= ROM_START && v < end)
+            {
+                out->not_optimized = "fixed address in the rom";
+                out->not_optimized_line = stmts[s].line;
+                return;
+            }
+        }
+    }
+
+    int changed = 1;
+    while (changed)
+    {
+        changed = 0;
+        int prev = -1;
+        for (int s = next_stmt(as, -1); s < num_stmts;
+                prev = s, s = next_stmt(as, s))
+        {
+            if (prev >= 0 && is_skip(stmts[prev].kind))
+                continue;
+            int k = stmts[s].kind;
+            int n = next_stmt(as, s);
+
+            if (k == OP_MOV_I || k == OP_INC_I)
+            {
+                int x, v, x2, v2;
+                reg_value(as, s, &x, &v);
+                while (n < num_stmts && !stmts[n].labelled &&
+                        stmts[n].kind == OP_INC_I && x >= 0 && v >= 0)
+                {
+                    reg_value(as, n, &x2, &v2);
+                    if (x2 != x || v2 < 0)
+                        break;
+                    v = (v + v2) & 0xff;
+                    stmts[s].value = v;
+                    stmts[n].deleted = 1;
+                    n = next_stmt(as, n);
+                    out->folded++;
+                    changed = 1;
+                }
+            }
+            else if (k == OP_GOTO && stmt_args(as, s, toks, &a) == 1 &&
+                    identifier(&a[0]))
+            {
+                symbol *sym = sym_slot(as, a[0].s, a[0].len);
+                int to = sym->name ? sym->stmt : -1;
+                if (to >= 0 && to < num_stmts && stmts[to].deleted)
+                    to = next_stmt(as, to);
+                if (to == n)
+                {
+                    // Its labels now mean the next one
+                    stmts[s].deleted = 1;
+                    out->gotos++;
+                    changed = 1;
+                }
+            }
+            else if (k == OP_INDEX && stmt_args(as, s, toks, &a) == 1)
+            {
+                token i = a[0];
+                // Same I until something changes it, jumps in or out, or
+                // is skipped
+                for (int j = n; j < num_stmts && !stmts[j].labelled;
+                        j = next_stmt(as, j))
+                {
+                    int kj = stmts[j].kind;
+                    token tj[MAX_TOKENS], *aj;
+                    if (kj == OP_INDEX)
+                    {
+                        if (stmt_args(as, j, tj, &aj) != 1 ||
+                                aj[0].len != i.len ||
+                                strncmp(aj[0].s, i.s, i.len) != 0)
+                            break;
+                        stmts[j].deleted = 1;
+                        out->indexes++;
+                        changed = 1;
+                        continue;
+                    }
+                    if (is_skip(kj) || kj == OP_GOTO || kj == OP_CALL ||
+                            kj == OP_RET || kj == OP_JMPOFF ||
+                            kj == OP_CALLPROG || kj == OP_IADD ||
+                            kj == OP_FONT || kj == OP_STORE ||
+                            kj == OP_LOAD || kj == OP_LONGI ||
+                            kj == OP_BIGFONT || kj == OP_EXIT ||
+                            kj >= OP_INVALID)
+                        break;
+                }
+            }
+            else if ((k == OP_STORE || k == OP_LOAD) && n < num_stmts &&
+                    !stmts[n].labelled && stmts[n].kind ==
+                    (k == OP_STORE ? OP_LOAD : OP_STORE))
+            {
+                token tn[MAX_TOKENS], *an;
+                if (stmt_args(as, s, toks, &a) == 1 &&
+                        stmt_args(as, n, tn, &an) == 1)
+                {
+                    int x = operand(&a[0], 'V', 1);
+                    int y = operand(&an[0], 'V', 1);
+                    if (x >= 0 && y >= 0 && y <= x)
+                    {
+                        stmts[n].deleted = 1;
+                        out->pairs++;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// How often what peephole() removed would have run, roughly: each
+// removed instruction's loop depth, from the GOTOs that jump back over
+// it (a GOTO at or after it to a label at or before it). Straight-line
+// code runs once, a loop body many times, so that's where it counts.
+// Only static, so calls from inside a loop and loops made of skips
+// aren't seen; a run under chip8vm-prof -cover says for sure.
+static void loop_depths(assembly *as)
+{
+    stmt *stmts = as->stmts;
+    chip8_asm *out = as->out;
+    token toks[MAX_TOKENS], *a;
+    for (int s = 0; s < as->num_stmts; s++)
+    {
+        if (!stmts[s].deleted)
+            continue;
+        int depth = 0;
+        for (int g = s; g < as->num_stmts; g++)
+        {
+            if (stmts[g].kind != OP_GOTO || stmts[g].deleted ||
+                    stmt_args(as, g, toks, &a) != 1 || !identifier(&a[0]))
+                continue;
+            symbol *sym = sym_slot(as, a[0].s, a[0].len);
+            if (sym->name != NULL && sym->stmt <= s)
+                depth++;
+        }
+        if (depth > 0)
+            out->in_loops++;
+        if (depth > out->deepest)
+            out->deepest = depth;
+    }
+}
+
+// Pass 1: statements and labels
+static int statements(assembly *as, const char *src)
+{
+    int max_stmts = 1024;
+    as->stmts = malloc((max_stmts + 1) * sizeof(stmt));
+    as->sym_cap = 1024;
+    as->syms = calloc(as->sym_cap, sizeof(symbol));
+    token toks[MAX_TOKENS];
+    int addr = ROM_START;
+    int line_no = 0;
+    int labelled = 0;
+    for (const char *p = src; *p; )
+    {
+        const char *text = p;
+        line_no++;
+        int labels;
+        int n = tokenize(p, toks, &labels);
+        if (n > MAX_TOKENS)
+            return fail(as, text, line_no, "too many operands");
+        while (*p && *p != '\n')
+            p++;
+        if (*p)
+            p++;
+
+        for (int i = 0; i < labels; i++)
+        {
+            token *t = &toks[i];
+            if (t->s[0] >= '0' && t->s[0] <= '9')
+            {
+                // disasm's address column
+                if (operand(t, 0, 4) != addr)
+                    return fail(as, text, line_no,
+                            "not at the address it says");
+            }
+            else if (!identifier(t))
+                return fail(as, text, line_no, "bad label");
+            else if (sym_add(as, t->s, t->len, as->num_stmts, text,
+                        line_no) < 0)
+                return -1;
+            else
+                labelled = 1;
+        }
+        if (n == labels)
+            continue;
+
+        token *m = &toks[labels];
+        int args = n - labels - 1;
+        int len = 2, kind;
+        if (m->len == 2 && strncmp(m->s, "DB", 2) == 0)
+        {
+            kind = DIR_DB;
+            len = args;
+        }
+        else if (m->len == 2 && strncmp(m->s, "DW", 2) == 0)
+        {
+            kind = DIR_DW;
+            len = args * 2;
+        }
+        else if ((kind = op_class_by_mnemonic(m->s, m->len)) == OP_INVALID)
+            return fail(as, text, line_no, "invalid mnemonic");
+        else
+            len = op_class_len(kind);
+
+        if (as->num_stmts == max_stmts)
+        {
+            max_stmts *= 2;
+            as->stmts = realloc(as->stmts, (max_stmts + 1) * sizeof(stmt));
+        }
+        as->stmts[as->num_stmts++] = (stmt){text, line_no, addr, len, kind,
+            -1, labelled, 0};
+        labelled = 0;
+        addr += len;
+    }
+    return 0;
+}
+
+// Pass 2: encode, and the map
+static int encode(assembly *as)
+{
+    chip8_asm *out = as->out;
+    out->rom_len = layout(as) - ROM_START;
+    out->rom = malloc(out->rom_len + 1);
+    out->map = malloc((as->num_stmts + 1) * sizeof(asm_line));
+    token toks[MAX_TOKENS];
+    for (int s = 0; s < as->num_stmts; s++)
+    {
+        stmt *st = &as->stmts[s];
+        if (st->deleted)
+            continue;
+        const char *text = st->text;
+        int line_no = st->line;
+        int labels;
+        int n = tokenize(text, toks, &labels);
+        token *a = &toks[labels + 1];
+        int args = n - labels - 1;
+        unsigned char *rom = out->rom + st->addr - ROM_START;
+        out->map[out->map_len++] = (asm_line){st->addr, line_no};
+
+        if (st->kind == DIR_DB)
+        {
+            for (int i = 0; i < args; i++)
+            {
+                int v = operand(&a[i], '$', 2);
+                if (v < 0)
+                    return fail(as, text, line_no, "bad byte");
+                rom[i] = v;
+            }
+            continue;
+        }
+        if (st->kind == DIR_DW)
+        {
+            for (int i = 0; i < args; i++)
+            {
+                int v = identifier(&a[i]) ?
+                    address(as, &a[i], 0xffff, text, line_no) :
+                    operand(&a[i], '$', 4);
+                if (v < 0)
+                    return fail(as, text, line_no, "bad word");
+                rom[i * 2] = v >> 8;
+                rom[i * 2 + 1] = v & 0xff;
+            }
+            continue;
+        }
+
+        int cls = st->kind;
+        int x = 0, y = 0, v = 0; // v is whichever of nnn/nn/n it has
+        int want = 0; // how many operands it takes
+        switch (op_class_args(cls))
+        {
+            case ARG_NNN:
+                want = 1;
+                if (args >= 1 && identifier(&a[0]))
+                    v = address(as, &a[0], 0xfff, text, line_no);
+                else
+                    v = args >= 1 ? operand(&a[0], '$', 3) : -1;
+                break;
+            case ARG_XNN:
+                want = 2;
+                if (args >= 2)
+                {
+                    x = operand(&a[0], 'V', 1);
+                    v = st->value >= 0 ? st->value :
+                        identifier(&a[1]) ?
+                        address(as, &a[1], 0xff, text, line_no) :
+                        operand(&a[1], '$', 2);
+                }
+                break;
+            case ARG_XY:
+                want = 2;
+                if (args >= 2)
+                {
+                    x = operand(&a[0], 'V', 1);
+                    y = operand(&a[1], 'V', 1);
+                }
+                break;
+            case ARG_XYN:
+                want = 3;
+                if (args >= 3)
+                {
+                    x = operand(&a[0], 'V', 1);
+                    y = operand(&a[1], 'V', 1);
+                    v = a[2].s[0] == '$' ? operand(&a[2], '$', 1) :
+                        operand(&a[2], 0, 1);
+                }
+                break;
+            case ARG_X:
+                want = 1;
+                if (args >= 1)
+                    x = operand(&a[0], 'V', 1);
+                break;
+            case ARG_N:
+            case ARG_P:
+                want = 1;
+                if (args >= 1)
+                {
+                    int n = a[0].s[0] == '$' ? operand(&a[0], '$', 1) :
+                        operand(&a[0], 0, 1);
+                    if (op_class_args(cls) == ARG_N)
+                        v = n;
+                    else
+                        x = n;
+                }
+                break;
+            case ARG_NNNN:
+                want = 1;
+                if (args >= 1)
+                {
+                    int w = identifier(&a[0]) ?
+                        address(as, &a[0], 0xffff, text, line_no) :
+                        operand(&a[0], '$', 4);
+                    if (w < 0)
+                        return fail(as, text, line_no, "bad operands");
+                    rom[2] = w >> 8;
+                    rom[3] = w & 0xff;
+                }
+                break;
+        }
+        if (args != want || x < 0 || y < 0 || v < 0)
+            return fail(as, text, line_no, "bad operands");
+        unsigned short opcode = op_class_match(cls) | x << 8 | y << 4 | v;
+        rom[0] = opcode >> 8;
+        rom[1] = opcode & 0xff;
+    }
+    return 0;
+}
+
+int chip8_assemble(const char *src, int optimize, chip8_asm *out)
+{
+    memset(out, 0, sizeof(*out));
+    assembly as = {0};
+    as.out = out;
+    int ret = statements(&as, src);
+    if (ret == 0 && optimize)
+    {
+        peephole(&as);
+        loop_depths(&as);
+    }
+    if (ret == 0)
+        ret = encode(&as);
+    free(as.stmts);
+    free(as.syms);
+    return ret;
+}
+
+void chip8_asm_free(chip8_asm *out)
+{
+    free(out->rom);
+    free(out->map);
+    out->rom = NULL;
+    out->map = NULL;
+}
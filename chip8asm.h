@@ -0,0 +1,40 @@
+#ifndef CHIP8ASM_H_INC
+#define CHIP8ASM_H_INC
+
+// The assembler, as a library: source text in, rom bytes out, no files.
+// The assembler binary is a front end to it; tests and fuzzers can
+// assemble into memory and load_rom_buffer() the result straight into
+// a vm. See chip8asm.c for the source format.
+
+// A statement's address and the line it's on
+typedef struct {
+    int addr;
+    int line;
+} asm_line;
+
+typedef struct {
+    unsigned char *rom;     // to load at 0x200
+    int rom_len;
+    asm_line *map;          // everything assembled, in address order
+    int map_len;
+    // Why it didn't assemble: the line (0 if it did), the reason and
+    // the line's text
+    int error_line;
+    char error[128];
+    // What optimize did: instructions removed by each pattern, or why
+    // it didn't (NULL if it ran) and the line that stopped it
+    int folded, gotos, indexes, pairs;
+    // How many of those were inside a loop (a GOTO back over them), and
+    // the most loops any was inside
+    int in_loops, deepest;
+    const char *not_optimized;
+    int not_optimized_line;
+} chip8_asm;
+
+// Assemble src (a whole file's text, 0 terminated) into out, optimizing
+// first if optimize is set (the assembler's -O). Returns 0, or -1 with
+// the error filled in. Either way chip8_asm_free(out) after.
+int chip8_assemble(const char *src, int optimize, chip8_asm *out);
+void chip8_asm_free(chip8_asm *out);
+
+#endif
@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h> // for offsetof
+#include <string.h> // for memset, memcpy, memmove, strcmp
+#include <time.h> // for seeding rand
+
+#include "chip8vm.h"
+#include "chip8prof.h"
+#include "chip8hostperf.h"
+#include "chip8trace.h"
+
+// The emulation core: everything that doesn't need SDL lives here, so
+// headless users (the batch environment, tests) can link without it.
+
+chip8_state * create_state(void)
+{
+    srand(time(0));
+    //  Create a pointer to a state, so we can modify it in functions
+    chip8_state *state = malloc(sizeof(chip8_state));
+    // Initialize important fields
+    // It's not important for say, registers to be cleared
+    memset(state->memory, 0, sizeof(state->memory));
+    // hardcode memory values:
+    unsigned char font_set[] = {
+        0xf0, 0x90, 0x90, 0x90, 0xf0, // 0 @ 0x050
+        0x20, 0x60, 0x20, 0x20, 0x70, // 1 @ 0x055
+        0xf0, 0x10, 0xf0, 0x80, 0xf0, // 2 @ 0x05a
+        0xf0, 0x10, 0xf0, 0x10, 0xf0, // 3 @ 0x05f
+        0x90, 0x90, 0xf0, 0x10, 0x10, // 4 @ 0x064
+        0xf0, 0x80, 0xf0, 0x10, 0xf0, // 5 @ 0x069
+        0xf0, 0x80, 0xf0, 0x10, 0xf0, // 6 @ 0x06e
+        0xf0, 0x10, 0x20, 0x20, 0x40, // 7 @ 0x073
+        0xf0, 0x90, 0xf0, 0x90, 0xf0, // 8 @ 0x078
+        0xf0, 0x90, 0xf0, 0x10, 0xf0, // 9 @ 0x07d
+        0xf0, 0x90, 0xf0, 0x90, 0x90, // a @ 0x082
+        0xe0, 0x90, 0xe0, 0x90, 0xe0, // b @ 0x087
+        0xf0, 0x80, 0x80, 0x80, 0xf0, // c @ 0x08c
+        0xe0, 0x90, 0x90, 0x90, 0xe0, // d @ 0x087
+        0xf0, 0x80, 0xf0, 0x80, 0xf0, // e @ 0x096
+        0xf0, 0x80, 0xf0, 0x80, 0x80, // f @ 0x09b
+    };
+    // 5 bytes each for 16 hexadecimal chars
+    memcpy(&state->memory[0x50], &font_set, 5 * 16);
+    // SUPER-CHIP 8x10 digits for FX30, right after
+    unsigned char big_font_set[] = {
+        0x3c, 0x7e, 0xe7, 0xc3, 0xc3, 0xc3, 0xc3, 0xe7, 0x7e, 0x3c, // 0 @ 0x0a0
+        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3c, // 1
+        0x3e, 0x7f, 0xc3, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xff, 0xff, // 2
+        0x3c, 0x7e, 0xc3, 0x03, 0x0e, 0x0e, 0x03, 0xc3, 0x7e, 0x3c, // 3
+        0x06, 0x0e, 0x1e, 0x36, 0x66, 0xc6, 0xff, 0xff, 0x06, 0x06, // 4
+        0xff, 0xff, 0xc0, 0xc0, 0xfc, 0xfe, 0x03, 0xc3, 0x7e, 0x3c, // 5
+        0x3e, 0x7c, 0xc0, 0xc0, 0xfc, 0xfe, 0xc3, 0xc3, 0x7e, 0x3c, // 6
+        0xff, 0xff, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+        0x3c, 0x7e, 0xc3, 0xc3, 0x7e, 0x7e, 0xc3, 0xc3, 0x7e, 0x3c, // 8
+        0x3c, 0x7e, 0xc3, 0xc3, 0x7f, 0x3f, 0x03, 0x03, 0x3e, 0x7c, // 9
+        0x18, 0x3c, 0x66, 0xc3, 0xc3, 0xff, 0xff, 0xc3, 0xc3, 0xc3, // a
+        0xfc, 0xfe, 0xc3, 0xc3, 0xfe, 0xfe, 0xc3, 0xc3, 0xfe, 0xfc, // b
+        0x3c, 0x7e, 0xc3, 0xc0, 0xc0, 0xc0, 0xc0, 0xc3, 0x7e, 0x3c, // c
+        0xfc, 0xfe, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xc3, 0xfe, 0xfc, // d
+        0xff, 0xff, 0xc0, 0xc0, 0xfc, 0xfc, 0xc0, 0xc0, 0xff, 0xff, // e
+        0xff, 0xff, 0xc0, 0xc0, 0xfc, 0xfc, 0xc0, 0xc0, 0xc0, 0xc0, // f
+    };
+    memcpy(&state->memory[0xa0], &big_font_set, 10 * 16);
+    memset(state->gfx, 0, sizeof(state->gfx));
+    state->pc = 0x200;
+    state->sp = 0xf;
+    // Set all keys to "up" state
+    memset(state->key, 0, sizeof(state->key));
+    // Set draw and key flags
+    state->draw_flag = 1;
+    state->key_flag = 0xff;
+    state->halted = HALT_NONE;
+    state->verified = 0;
+    // xorshift must never be seeded with 0
+    state->rng = rand() | 1;
+    state->prof = NULL;
+    state->trace = NULL;
+    state->hires = 0;
+    memset(state->rpl, 0, sizeof(state->rpl));
+#ifdef CHIP8_XO
+    state->planes = 1;
+    state->pitch = 64;
+    memset(state->pattern, 0, sizeof(state->pattern));
+    memset(state->gfx2, 0, sizeof(state->gfx2));
+#endif
+    return state;
+}
+
+// Copy a whole vm, eg to reset from a template or to snapshot.
+// hgfx only matters in hires (going hires clears it), so lores vms don't
+// pay for copying it.
+void copy_state(chip8_state *dst, const chip8_state *src)
+{
+    memcpy(dst, src, src->hires ? sizeof(chip8_state) :
+            offsetof(chip8_state, hgfx));
+}
+
+// Load a rom into vm memory
+void load_rom(char *romfilename, chip8_state *state)
+{
+    // Open a romfile
+    FILE *romfile = fopen(romfilename, "r");
+    if (romfile == NULL)
+    {
+        printf("Could not open file: %s\n", romfilename);
+        exit(1);
+    }
+
+    // Fill our memory with program data, starting at 0x200
+    // 0x1000 total memory - 0x200 reserved = 0xe00 for rom 
+    // (or up to 0xfe00 in an XO-CHIP build)
+    fread(state->memory + 0x200, 1, MEM_SIZE - 0x200, romfile);
+    fclose(romfile);
+    // A new rom needs verifying again
+    state->verified = 0;
+}
+
+// Same, from a rom already in memory (eg chip8_assemble()'s), so test
+// loops don't have to go through a file. Returns -1 if it was cut short
+// to fit.
+int load_rom_buffer(chip8_state *state, const unsigned char *rom, int len)
+{
+    int fits = len < MEM_SIZE - 0x200 ? len : MEM_SIZE - 0x200;
+    memcpy(state->memory + 0x200, rom, fits);
+    state->verified = 0;
+    return fits == len ? 0 : -1;
+}
+
+// Temporary while still adding.
+// No plan to add 0x0NNN (Call RCA program) but when that's the only
+// one left, this error handling will move there, since it won't be
+// (at that point) repeated any longer.
+void unimplemented_opcode_err(unsigned short pc, unsigned short opcode)
+{
+    printf("ERROR!\nUnimplemented Opcode: %04x\n", opcode);
+    printf("Opcode at 0x%04x (in memory)\n", pc);
+    exit(1);
+}
+
+// Handles any opcodes that aren't valid by reporting them & their address
+void invalid_opcode(unsigned short pc, unsigned short opcode)
+{
+    printf("Invalid opcode at 0x%04x (in memory)\n", pc);
+    printf("Opcode: %04x\n", opcode);
+    exit(1);
+}
+
+// Stop the vm on a bad opcode, leaving pc on it for reporting
+static void halt_vm(chip8_state *state, unsigned short pc, unsigned char why)
+{
+    state->halted = why;
+    state->pc = pc;
+}
+
+
+// SUPER-CHIP and XO-CHIP display ops, for the profiles that have them
+// (QUIRK_SCHIP/QUIRK_XO in chip8ops.h). Out here so plain CHIP-8 copies
+// don't carry them.
+
+// Planes drawn to: XO-CHIP picks them with FN01, SUPER-CHIP only has 1
+#ifdef CHIP8_XO
+#define PLANES(state) ((state)->planes)
+#else
+#define PLANES(state) 1
+#endif
+
+// Plane p's lores and hires screens
+static uint64_t * lores_plane(chip8_state *state, int p)
+{
+#ifdef CHIP8_XO
+    if (p)
+        return state->gfx2;
+#endif
+    return state->gfx;
+}
+
+static uint64_t (*hires_plane(chip8_state *state, int p))[2]
+{
+#ifdef CHIP8_XO
+    if (p)
+        return state->hgfx2;
+#endif
+    return state->hgfx;
+}
+
+// 00CN, 00DN, 00FB-00FF: scrolls, exit and mode switches. Scrolls move
+// whole words, a hires row being two of them, on the selected planes.
+// In lores they move lores pixels.
+static void ext_system(chip8_state *state, unsigned short pc,
+        unsigned short opcode)
+{
+    int n = opcode & 0xf;
+
+    if (opcode == 0x00fd)
+    {
+        // 00FD: exit the interpreter
+        halt_vm(state, pc, HALT_EXIT);
+        return;
+    }
+    if (opcode == 0x00fe || opcode == 0x00ff)
+    {
+        // 00FE/00FF: lores/hires, starting from a blank screen
+        state->hires = opcode & 1;
+        for (int p = 0; p < 2; p++)
+        {
+            memset(lores_plane(state, p), 0, sizeof(state->gfx));
+            memset(hires_plane(state, p), 0, sizeof(state->hgfx));
+        }
+        state->draw_flag = 1;
+        return;
+    }
+
+    for (int p = 0; p < 2; p++)
+    {
+        if (!(PLANES(state) & (1 << p)))
+            continue;
+        uint64_t (*hg)[2] = hires_plane(state, p);
+        uint64_t *g = lores_plane(state, p);
+        int h = state->hires ? HGFX_H : GFX_H;
+
+        if ((opcode & 0xfff0) == 0x00c0)
+        {
+            // 00CN: down N rows, blank ones in at the top
+            if (state->hires)
+            {
+                memmove(hg[n], hg[0], (h - n) * sizeof(hg[0]));
+                memset(hg[0], 0, n * sizeof(hg[0]));
+            }
+            else
+            {
+                memmove(&g[n], &g[0], (h - n) * sizeof(g[0]));
+                memset(&g[0], 0, n * sizeof(g[0]));
+            }
+        }
+        else if ((opcode & 0xfff0) == 0x00d0)
+        {
+            // 00DN: up N rows (XO-CHIP)
+            if (state->hires)
+            {
+                memmove(hg[0], hg[n], (h - n) * sizeof(hg[0]));
+                memset(hg[h - n], 0, n * sizeof(hg[0]));
+            }
+            else
+            {
+                memmove(&g[0], &g[n], (h - n) * sizeof(g[0]));
+                memset(&g[h - n], 0, n * sizeof(g[0]));
+            }
+        }
+        else if (opcode == 0x00fb)
+        {
+            // 00FB: right 4 pixels
+            if (state->hires)
+                for (int y = 0; y < h; y++)
+                {
+                    hg[y][1] = hg[y][1] >> 4 | hg[y][0] << 60;
+                    hg[y][0] >>= 4;
+                }
+            else
+                for (int y = 0; y < h; y++)
+                    g[y] >>= 4;
+        }
+        else
+        {
+            // 00FC: left 4 pixels
+            if (state->hires)
+                for (int y = 0; y < h; y++)
+                {
+                    hg[y][0] = hg[y][0] << 4 | hg[y][1] >> 60;
+                    hg[y][1] <<= 4;
+                }
+            else
+                for (int y = 0; y < h; y++)
+                    g[y] <<= 4;
+        }
+    }
+    state->draw_flag = 1;
+}
+
+#ifdef CHIP8_XO
+// 00E0 on XO-CHIP: only the selected planes
+static void ext_clear(chip8_state *state)
+{
+    for (int p = 0; p < 2; p++)
+        if (PLANES(state) & (1 << p))
+        {
+            memset(lores_plane(state, p), 0, sizeof(state->gfx));
+            if (state->hires)
+                memset(hires_plane(state, p), 0, sizeof(state->hgfx));
+        }
+    state->draw_flag = 1;
+}
+#endif
+
+// DXYN in hires, DXY0 (16x16, two bytes a row) in either mode, and all
+// XO-CHIP drawing. Each selected plane takes the next N rows of sprite
+// from I. The start wraps; the sprite clips, or wraps if wrap is set.
+// mask is the engine's address mask. Returns VF, which is 1 on any
+// collision (not SCHIP 1.1's count of rows).
+static int ext_draw(chip8_state *state, int vx, int vy, int n, int wrap,
+        unsigned short mask)
+{
+    int wide = n == 0, rows = wide ? 16 : n, width = wide ? 16 : 8;
+    int w = state->hires ? HGFX_W : GFX_W;
+    int h = state->hires ? HGFX_H : GFX_H;
+    unsigned short addr = state->index_reg;
+    uint64_t bits, left, right, hit = 0;
+
+    vx &= w - 1;
+    vy &= h - 1;
+    for (int p = 0; p < 2; p++)
+    {
+        if (!(PLANES(state) & (1 << p)))
+            continue;
+        uint64_t (*hg)[2] = hires_plane(state, p);
+        uint64_t *g = lores_plane(state, p);
+        for (int r = 0; r < rows; r++)
+        {
+            // The sprite row at the top of a word, then shifted over to x
+            bits = (uint64_t)state->memory[addr++ & mask] << 56;
+            if (wide)
+                bits |= (uint64_t)state->memory[addr++ & mask] << 48;
+            int y = vy + r;
+            if (y >= h && !wrap)
+                continue;
+            y &= h - 1;
+            // Split over the two words of a hires row (lores only has the
+            // left one), and bring anything off the right back round
+            left = vx < 64 ? bits >> vx : 0;
+            right = vx >= 64 ? bits >> (vx - 64) : vx ? bits << (64 - vx) : 0;
+            if (wrap && vx + width > w)
+                left |= bits << (w - vx);
+            if (state->hires)
+            {
+                hit |= (hg[y][0] & left) | (hg[y][1] & right);
+                hg[y][0] ^= left;
+                hg[y][1] ^= right;
+            }
+            else
+            {
+                hit |= g[y] & left;
+                g[y] ^= left;
+            }
+        }
+    }
+    PROF_SPRITE(state, state->index_reg, addr - state->index_reg);
+    return hit != 0;
+}
+
+
+// This vm's own behaviour: emulate_opcode(), emulate_cycle() and
+// run_cycles(). Shifts take VY (like the VIP), FX55/FX65 leave I alone
+// (like the SCHIP), BNNN uses V0, sprites clip.
+#include "chip8ops.h"
+
+// Quirk profiles, each its own copy of the interpreter (see chip8ops.h)
+//            shift VX  FX55/65 I  BXNN  VF reset  wrap sprites
+// vip           -        +X+1      -       +          -
+// chip48        +        +X        +       -          -
+// schip         +        -         +       -          -
+// xochip        -        +X+1      -       -          +
+// schip also gets the SUPER-CHIP opcodes: hires, scrolling, 16x16
+// sprites, FX30 and the RPL flags. In XO-CHIP builds (CHIP8_XO) xochip
+// gets those and the XO-CHIP ones: 64K, planes, audio, 5XY2/5XY3.
+#define PROFILE vip
+#define QUIRK_LOADSTORE 2
+#define QUIRK_VF_RESET 1
+#include "chip8ops.h"
+
+#define PROFILE chip48
+#define QUIRK_SHIFT_VX 1
+#define QUIRK_LOADSTORE 1
+#define QUIRK_JUMP_VX 1
+#include "chip8ops.h"
+
+#define PROFILE schip
+#define QUIRK_SHIFT_VX 1
+#define QUIRK_JUMP_VX 1
+#define QUIRK_SCHIP 1
+#include "chip8ops.h"
+
+#define PROFILE xochip
+#define QUIRK_LOADSTORE 2
+#define QUIRK_WRAP_SPRITES 1
+#ifdef CHIP8_XO
+#define QUIRK_SCHIP 1
+#define QUIRK_XO 1
+#endif
+#include "chip8ops.h"
+
+// The plain machine again without the masks, for roms verify_state() has
+// shown never need them
+#define PROFILE unchecked
+#define UNCHECKED 1
+#include "chip8ops.h"
+
+// Unchecked while the state's rom is verified, the checked one otherwise
+static long run_cycles_verified(chip8_state *state, long cycles)
+{
+    if (state->verified)
+        return run_cycles_unchecked(state, cycles);
+    return run_cycles(state, cycles);
+}
+
+// "switch" is the plain emulate_cycle() loop above, "verified" is the
+// same machine, and the rest are it with a quirk profile's behaviour
+const chip8_engine chip8_engines[] = {
+    {"switch", run_cycles},
+    {"verified", run_cycles_verified},
+    {"vip", run_cycles_vip},
+    {"chip48", run_cycles_chip48},
+    {"schip", run_cycles_schip},
+    {"xochip", run_cycles_xochip},
+    {NULL, NULL},
+};
+
+// Engine by name, or NULL if there's no such engine
+const chip8_engine * find_engine(const char *name)
+{
+    for (const chip8_engine *e = chip8_engines; e->name != NULL; e++)
+        if (strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+// Count both timers down by one, meant to be called at 60Hz
+void tick_timers(chip8_state *state)
+{
+    if (state->delay_timer > 0)
+        state->delay_timer--;
+    if (state->sound_timer > 0)
+        state->sound_timer--;
+}
+
+// 1 if pixel (x, y) is on, else 0. In hires x and y go up to 128x64.
+// XO-CHIP builds add 2 if it's on in plane 2.
+unsigned char get_pixel(chip8_state *state, int x, int y)
+{
+    unsigned char on;
+    if (state->hires)
+    {
+        on = (state->hgfx[y][x >> 6] >> (63 - (x & 63))) & 1;
+#ifdef CHIP8_XO
+        on |= ((state->hgfx2[y][x >> 6] >> (63 - (x & 63))) & 1) << 1;
+#endif
+        return on;
+    }
+    on = (state->gfx[y] >> (GFX_W - 1 - x)) & 1;
+#ifdef CHIP8_XO
+    on |= ((state->gfx2[y] >> (GFX_W - 1 - x)) & 1) << 1;
+#endif
+    return on;
+}
+
+
+// Dump memory contents to console.
+// Useful now as a display of results, later as debugging tool
+void dump_memory(chip8_state *state)
+{
+    // For each 16 byte "block"
+    for (int i = 0; i < 256; i++)
+    {
+        // Print the address of the first byte for this row
+        printf("%03x: ", i * 16);
+        // Possibility: check against previous line, if same, then
+        // do *** for one line, and pick back up when memory is different
+        for (int j = 0; j < 16; j++)
+        {
+            // Print the jth byte in this ith 16 byte block
+            printf("%02x ", state->memory[i * 16 + j]);
+        }
+        printf("\n");
+    }
+    printf("Memory dumped\n");
+}
+
+
+// Dump most of the state variables
+// excludes: memory, gfx, key
+// key could be in this, it's short.
+void dump_state(chip8_state *state)
+{
+    printf("Curr Opcode: %04x\n", state->opcode);
+    printf("Registers:\n");
+    for (int i = 0; i < 16; i++)
+    {
+        printf("    V%i: %02x\n", i, state->v[i]);
+    }
+    printf("Index register: %04x\n", state->index_reg);
+    printf("PC: %04x\n", state->pc);
+    printf("Timers: Delay: %02x\n", state->delay_timer);
+    printf("        Sound: %02x\n", state->sound_timer);
+    printf("Stack:\n");
+    for (int i = 0; i < 16; i++)
+    {
+        printf("    %02i:  %04x\n", i, state->stack[i]);
+    }
+    printf("SP: %i\n", state->sp);
+}
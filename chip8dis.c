@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h> // for strncmp, strlen, memset
+
+#include "chip8dis.h"
+
+// Indexed by OP_*, from CHIP8_OPS
+static const struct {
+    const char *pattern;
+    const char *mnemonic;
+    unsigned short mask, match;
+    char args;
+    char isa;       // ISA_* bits of the sets it's in
+} ops[NUM_OP_CLASSES] = {
+#define OP_ROW(name, pattern, mask, match, mnemonic, args, isa) \
+    {pattern, mnemonic, mask, match, args, isa},
+    CHIP8_OPS(OP_ROW)
+#undef OP_ROW
+    {"????", "INVALID", 0, 0, ARG_NONE, IN_ALL},
+};
+
+// Every opcode's OP_*, made from ops[] before main runs
+static unsigned char decode[0x10000];
+
+// op_class_by_mnemonic's perfect hash: OP_* + 1 (0 for none) by the hash
+// of its mnemonic, with a seed that gives every one its own slot, also
+// found before main runs
+#define MNEMONIC_SLOTS 512
+static unsigned char by_mnemonic[MNEMONIC_SLOTS];
+static unsigned int mnemonic_seed;
+
+static unsigned int mnemonic_hash(const char *m, int len, unsigned int seed)
+{
+    unsigned int h = seed;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)m[i]) * 16777619;
+    return (h ^ h >> 16) & (MNEMONIC_SLOTS - 1);
+}
+
+__attribute__((constructor)) static void build_decode(void)
+{
+    memset(decode, OP_INVALID, sizeof(decode));
+    // Backwards, so where two match the earlier one is left
+    for (int cls = OP_INVALID - 1; cls >= 0; cls--)
+    {
+        // Each setting of the bits the mask leaves free
+        unsigned short free = ~ops[cls].mask;
+        for (unsigned short s = free;; s = (s - 1) & free)
+        {
+            decode[ops[cls].match | s] = cls;
+            if (s == 0)
+                break;
+        }
+    }
+
+    // A few dozen tries at most with this many slots
+    for (mnemonic_seed = 2166136261u;; mnemonic_seed++)
+    {
+        memset(by_mnemonic, 0, sizeof(by_mnemonic));
+        int cls;
+        for (cls = 0; cls < OP_INVALID; cls++)
+        {
+            unsigned int h = mnemonic_hash(ops[cls].mnemonic,
+                    strlen(ops[cls].mnemonic), mnemonic_seed);
+            if (by_mnemonic[h])
+                break;
+            by_mnemonic[h] = cls + 1;
+        }
+        if (cls == OP_INVALID)
+            break;
+    }
+}
+
+// Which instruction an opcode is, in whichever set has it
+int op_class(unsigned short opcode)
+{
+    return decode[opcode];
+}
+
+// Which instruction an opcode is to an engine running isa (ISA_*): the
+// first row that matches and that isa has
+int op_class_isa(unsigned short opcode, int isa)
+{
+    int cls = decode[opcode];
+    while (!(ops[cls].isa & isa))
+        do
+            cls++;
+        while ((opcode & ops[cls].mask) != ops[cls].match);
+    return cls;
+}
+
+// ISA_* bits of the sets that have it
+int op_class_isas(int cls)
+{
+    return ops[cls].isa;
+}
+
+// Bytes it takes: 4 for F000 NNNN, 2 for the rest
+int op_class_len(int cls)
+{
+    return ops[cls].args == ARG_NNNN ? 4 : 2;
+}
+
+// eg "8XY4" for OP_INC_V
+const char * op_class_pattern(int cls)
+{
+    return ops[cls].pattern;
+}
+
+// eg "INC.V" for OP_INC_V
+const char * op_class_mnemonic(int cls)
+{
+    return ops[cls].mnemonic;
+}
+
+// ARG_* for its operands
+int op_class_args(int cls)
+{
+    return ops[cls].args;
+}
+
+// The opcode with all its operands 0, eg 0x8004 for OP_INC_V
+unsigned short op_class_match(int cls)
+{
+    return ops[cls].match;
+}
+
+// The OP_* with this mnemonic (the first len chars of it, exactly), or
+// OP_INVALID. One hash and one compare.
+int op_class_by_mnemonic(const char *mnemonic, int len)
+{
+    int cls = by_mnemonic[mnemonic_hash(mnemonic, len, mnemonic_seed)] - 1;
+    if (cls < 0 || strncmp(ops[cls].mnemonic, mnemonic, len) != 0 ||
+            ops[cls].mnemonic[len] != '\0')
+        return OP_INVALID;
+    return cls;
+}
+
+// Text for opcode as cls, and next if it's F000's NNNN
+static int format_class(int cls, unsigned short opcode, unsigned short next,
+        char *buf)
+{
+    const char *m = ops[cls].mnemonic;
+    int x = (opcode & 0xf00) >> 8;
+    int y = (opcode & 0xf0) >> 4;
+
+    switch (ops[cls].args)
+    {
+        case ARG_NNN:
+            snprintf(buf, MNEMONIC_LEN, "%s $%03x", m, opcode & 0xfff);
+            break;
+        case ARG_XNN:
+            snprintf(buf, MNEMONIC_LEN, "%s V%x $%02x", m, x, opcode & 0xff);
+            break;
+        case ARG_XY:
+            snprintf(buf, MNEMONIC_LEN, "%s V%x V%x", m, x, y);
+            break;
+        case ARG_XYN:
+            snprintf(buf, MNEMONIC_LEN, "%s V%x V%x %x", m, x, y, opcode & 0xf);
+            break;
+        case ARG_X:
+            snprintf(buf, MNEMONIC_LEN, "%s V%x", m, x);
+            break;
+        case ARG_N:
+            snprintf(buf, MNEMONIC_LEN, "%s %x", m, opcode & 0xf);
+            break;
+        case ARG_P:
+            snprintf(buf, MNEMONIC_LEN, "%s %x", m, x);
+            break;
+        case ARG_NNNN:
+            snprintf(buf, MNEMONIC_LEN, "%s $%04x", m, next);
+            break;
+        default:
+            snprintf(buf, MNEMONIC_LEN, "%s", m);
+    }
+    return cls == OP_INVALID ? -1 : 0;
+}
+
+// Write the disassembly of opcode into buf (MNEMONIC_LEN bytes), eg
+// "DRAW V1 V2 5", decoded as op_class() does. Returns 0, or -1 if it
+// isn't a valid opcode. F000's NNNN is in the next word, which this
+// doesn't have, so that's just "LONGI": format_insn() has it.
+int format_opcode(unsigned short opcode, char *buf)
+{
+    int cls = op_class(opcode);
+    if (ops[cls].args == ARG_NNNN)
+    {
+        snprintf(buf, MNEMONIC_LEN, "%s", ops[cls].mnemonic);
+        return 0;
+    }
+    return format_class(cls, opcode, 0, buf);
+}
+
+// Same for the instruction at code as isa (ISA_*) has it. code has to
+// have op_class_len() bytes: "LONGI $nnnn" for F000 NNNN.
+int format_insn(const unsigned char *code, int isa, char *buf)
+{
+    unsigned short opcode = code[0] << 8 | code[1];
+    int cls = op_class_isa(opcode, isa);
+    return format_class(cls, opcode, ops[cls].args == ARG_NNNN ?
+            code[2] << 8 | code[3] : 0, buf);
+}
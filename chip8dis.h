@@ -0,0 +1,117 @@
+#ifndef CHIP8DIS_H_INC
+#define CHIP8DIS_H_INC
+
+// Decoding opcodes to text, shared by the disassembler and anything in
+// the emulator that wants to show what it ran (profiler, tracer), and
+// encoding them from text for the assembler
+
+// Operand layouts
+#define ARG_NONE 0
+#define ARG_NNN 1 // $nnn
+#define ARG_XNN 2 // VX $nn
+#define ARG_XY 3  // VX VY
+#define ARG_XYN 4 // VX VY n
+#define ARG_X 5   // VX
+#define ARG_N 6   // n, the low nibble (scrolls)
+#define ARG_NNNN 7 // $nnnn, the word after: a double width instruction
+#define ARG_P 8   // n in X's place (XO-CHIP's plane mask)
+
+// Instruction sets, as op_class_isa() takes them
+#define ISA_CHIP8 1 // the plain machine: switch, verified, vip, chip48
+#define ISA_SCHIP 2 // the schip engine
+#define ISA_XO 4    // the xochip engine (CHIP8_XO builds)
+// ... and which a row is in. XO-CHIP has all of SUPER-CHIP.
+#define IN_ALL (ISA_CHIP8 | ISA_SCHIP | ISA_XO)
+#define IN_SCHIP (ISA_SCHIP | ISA_XO)
+#define IN_XO ISA_XO
+
+// Every instruction, once. An opcode is the first one it matches, with
+// (opcode & mask) == match, so exact ones come before the catch-alls
+// they'd also match. The decoder, the disassembler's text and the
+// assembler's lookup are all made from this; the interpreter's switch
+// is checked against it (chip8vm -t), for each engine's set.
+//
+// op_class() goes by the first match in any set, so it knows the
+// SUPER-CHIP and XO-CHIP ones; op_class_isa() skips rows not in the set
+// asked for, so on the plain machine 00FF is still 0NNN and DXY0 a DXYN.
+//
+//  X(name,     pattern, mask,   match,  mnemonic,   operands, sets)
+#define CHIP8_OPS(X) \
+    X(CLRS,     "00E0", 0xffff, 0x00e0, "CLRS",     ARG_NONE, IN_ALL) \
+    X(RET,      "00EE", 0xffff, 0x00ee, "RET",      ARG_NONE, IN_ALL) \
+    X(SCRD,     "00CN", 0xfff0, 0x00c0, "SCRD",     ARG_N,    IN_SCHIP) \
+    X(SCRU,     "00DN", 0xfff0, 0x00d0, "SCRU",     ARG_N,    IN_XO) \
+    X(SCRR,     "00FB", 0xffff, 0x00fb, "SCRR",     ARG_NONE, IN_SCHIP) \
+    X(SCRL,     "00FC", 0xffff, 0x00fc, "SCRL",     ARG_NONE, IN_SCHIP) \
+    X(EXIT,     "00FD", 0xffff, 0x00fd, "EXIT",     ARG_NONE, IN_SCHIP) \
+    X(LORES,    "00FE", 0xffff, 0x00fe, "LORES",    ARG_NONE, IN_SCHIP) \
+    X(HIRES,    "00FF", 0xffff, 0x00ff, "HIRES",    ARG_NONE, IN_SCHIP) \
+    X(CALLPROG, "0NNN", 0xf000, 0x0000, "CALLPROG", ARG_NNN,  IN_ALL) \
+    X(GOTO,     "1NNN", 0xf000, 0x1000, "GOTO",     ARG_NNN,  IN_ALL) \
+    X(CALL,     "2NNN", 0xf000, 0x2000, "CALL",     ARG_NNN,  IN_ALL) \
+    X(TEQ_I,    "3XNN", 0xf000, 0x3000, "TEQ.I",    ARG_XNN,  IN_ALL) \
+    X(TNE_I,    "4XNN", 0xf000, 0x4000, "TNE.I",    ARG_XNN,  IN_ALL) \
+    X(TEQ,      "5XY0", 0xf00f, 0x5000, "TEQ",      ARG_XY,   IN_ALL) \
+    X(SAVE,     "5XY2", 0xf00f, 0x5002, "SAVE",     ARG_XY,   IN_XO) \
+    X(RESTORE,  "5XY3", 0xf00f, 0x5003, "RESTORE",  ARG_XY,   IN_XO) \
+    X(MOV_I,    "6XNN", 0xf000, 0x6000, "MOV.I",    ARG_XNN,  IN_ALL) \
+    X(INC_I,    "7XNN", 0xf000, 0x7000, "INC.I",    ARG_XNN,  IN_ALL) \
+    X(MOV_V,    "8XY0", 0xf00f, 0x8000, "MOV.V",    ARG_XY,   IN_ALL) \
+    X(OR,       "8XY1", 0xf00f, 0x8001, "OR",       ARG_XY,   IN_ALL) \
+    X(AND,      "8XY2", 0xf00f, 0x8002, "AND",      ARG_XY,   IN_ALL) \
+    X(XOR,      "8XY3", 0xf00f, 0x8003, "XOR",      ARG_XY,   IN_ALL) \
+    X(INC_V,    "8XY4", 0xf00f, 0x8004, "INC.V",    ARG_XY,   IN_ALL) \
+    X(SUB,      "8XY5", 0xf00f, 0x8005, "SUB",      ARG_XY,   IN_ALL) \
+    X(SHR,      "8XY6", 0xf00f, 0x8006, "SHR",      ARG_XY,   IN_ALL) \
+    X(LESS,     "8XY7", 0xf00f, 0x8007, "LESS",     ARG_XY,   IN_ALL) \
+    X(SHL,      "8XYE", 0xf00f, 0x800e, "SHL",      ARG_XY,   IN_ALL) \
+    X(TNE,      "9XY0", 0xf00f, 0x9000, "TNE",      ARG_XY,   IN_ALL) \
+    X(INDEX,    "ANNN", 0xf000, 0xa000, "INDEX",    ARG_NNN,  IN_ALL) \
+    X(JMPOFF,   "BNNN", 0xf000, 0xb000, "JMPOFF",   ARG_NNN,  IN_ALL) \
+    X(RAND,     "CXNN", 0xf000, 0xc000, "RAND",     ARG_XNN,  IN_ALL) \
+    X(DRAW16,   "DXY0", 0xf00f, 0xd000, "DRAW16",   ARG_XY,   IN_SCHIP) \
+    X(DRAW,     "DXYN", 0xf000, 0xd000, "DRAW",     ARG_XYN,  IN_ALL) \
+    X(TKEY,     "EX9E", 0xf0ff, 0xe09e, "TKEY",     ARG_X,    IN_ALL) \
+    X(TNKEY,    "EXA1", 0xf0ff, 0xe0a1, "TNKEY",    ARG_X,    IN_ALL) \
+    X(LONGI,    "F000", 0xffff, 0xf000, "LONGI",    ARG_NNNN, IN_XO) \
+    X(PLANE,    "FN01", 0xf0ff, 0xf001, "PLANE",    ARG_P,    IN_XO) \
+    X(AUDIO,    "F002", 0xffff, 0xf002, "AUDIO",    ARG_NONE, IN_XO) \
+    X(SET_DT,   "FX07", 0xf0ff, 0xf007, "SET.DT",   ARG_X,    IN_ALL) \
+    X(GETKEY,   "FX0A", 0xf0ff, 0xf00a, "GETKEY",   ARG_X,    IN_ALL) \
+    X(GET_DT,   "FX15", 0xf0ff, 0xf015, "GET.DT",   ARG_X,    IN_ALL) \
+    X(SET_ST,   "FX18", 0xf0ff, 0xf018, "SET.ST",   ARG_X,    IN_ALL) \
+    X(IADD,     "FX1E", 0xf0ff, 0xf01e, "IADD",     ARG_X,    IN_ALL) \
+    X(FONT,     "FX29", 0xf0ff, 0xf029, "FONT",     ARG_X,    IN_ALL) \
+    X(BIGFONT,  "FX30", 0xf0ff, 0xf030, "BIGFONT",  ARG_X,    IN_SCHIP) \
+    X(BCD,      "FX33", 0xf0ff, 0xf033, "BCD",      ARG_X,    IN_ALL) \
+    X(PITCH,    "FX3A", 0xf0ff, 0xf03a, "PITCH",    ARG_X,    IN_XO) \
+    X(STORE,    "FX55", 0xf0ff, 0xf055, "STORE",    ARG_X,    IN_ALL) \
+    X(LOAD,     "FX65", 0xf0ff, 0xf065, "LOAD",     ARG_X,    IN_ALL) \
+    X(SAVERPL,  "FX75", 0xf0ff, 0xf075, "SAVERPL",  ARG_X,    IN_SCHIP) \
+    X(LOADRPL,  "FX85", 0xf0ff, 0xf085, "LOADRPL",  ARG_X,    IN_SCHIP)
+
+// One per distinct instruction, plus one for anything invalid
+enum {
+#define OP_ENUM(name, pattern, mask, match, mnemonic, args, isa) OP_##name,
+    CHIP8_OPS(OP_ENUM)
+#undef OP_ENUM
+    OP_INVALID,
+    NUM_OP_CLASSES
+};
+
+// Longest line format_opcode can write, with the terminator
+#define MNEMONIC_LEN 24
+
+int op_class(unsigned short opcode);
+int op_class_isa(unsigned short opcode, int isa);
+int op_class_isas(int cls);
+int op_class_len(int cls);
+const char * op_class_pattern(int cls);
+const char * op_class_mnemonic(int cls);
+int op_class_args(int cls);
+unsigned short op_class_match(int cls);
+int op_class_by_mnemonic(const char *mnemonic, int len);
+int format_opcode(unsigned short opcode, char *buf);
+int format_insn(const unsigned char *code, int isa, char *buf);
+
+#endif
@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memcpy
+#include <pthread.h>
+
+#include "chip8env.h"
+#include "chip8obs.h"
+
+// Most addresses a built-in reward can watch (score digits and such)
+#define MAX_REWARD_ADDRS 16
+
+struct chip8_env {
+    int num_envs;
+    // States sit in one block, each padded out to its own cache lines so
+    // workers on neighbouring envs don't fight over a line
+    size_t stride;
+    unsigned char *states;
+    chip8_state template_state;
+
+    int frame_skip;
+    long max_frames;   // 0 for no limit
+    long *frames;      // frames into the current episode, per env
+
+    chip8_reward_fn reward_fn;
+    void *reward_ctx;
+    int num_reward_addrs;
+    unsigned short reward_addrs[MAX_REWARD_ADDRS];
+    float reward_scales[MAX_REWARD_ADDRS];
+    chip8_done_fn done_fn;
+    void *done_ctx;
+
+    unsigned char *byte_obs; // NULL unless turned on
+    int flicker_max;         // byte obs is the max of the last 2 frames
+
+    // Arguments of the step in flight, read by the workers
+    const unsigned short *actions;
+    float *rewards;
+    unsigned char *dones;
+
+    // Worker pool. The calling thread does slice 0 itself.
+    int num_threads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    unsigned long generation;
+    int pending;
+    int quit;
+};
+
+typedef struct {
+    chip8_env *env;
+    int slice;
+} worker_arg;
+
+static chip8_state * state_at(chip8_env *env, int i)
+{
+    return (chip8_state *)(env->states + i * env->stride);
+}
+
+// Put env i back at the start of an episode. Its rng carries on, or every
+// episode would roll the same numbers.
+static void reset_one(chip8_env *env, int i)
+{
+    chip8_state *state = state_at(env, i);
+    uint32_t rng = state->rng;
+    copy_state(state, &env->template_state);
+    state->rng = rng;
+    env->frames[i] = 0;
+}
+
+static void unpack_obs(chip8_env *env, int i, const uint64_t *gfx)
+{
+    obs_unpack(gfx, GFX_H, env->byte_obs + (size_t)i * GFX_H * GFX_W);
+}
+
+static void step_one(chip8_env *env, int i)
+{
+    chip8_state *state = state_at(env, i);
+    unsigned short action = env->actions[i];
+    unsigned char before[MAX_REWARD_ADDRS];
+    uint64_t pooled[GFX_H];
+
+    for (int k = 0; k < 16; k++)
+        state->key[k] = (action >> k) & 1;
+    for (int a = 0; a < env->num_reward_addrs; a++)
+        before[a] = state->memory[env->reward_addrs[a]];
+
+    for (int f = 0; f < env->frame_skip && !state->halted; f++)
+    {
+        if (env->flicker_max)
+            memcpy(pooled, state->gfx, sizeof(pooled));
+        run_cycles(state, CYCLES_PER_FRAME);
+        tick_timers(state);
+        env->frames[i]++;
+    }
+
+    float reward = 0;
+    if (env->reward_fn != NULL)
+        reward = env->reward_fn(state, i, env->reward_ctx);
+    else
+        for (int a = 0; a < env->num_reward_addrs; a++)
+            reward += env->reward_scales[a] *
+                ((int)state->memory[env->reward_addrs[a]] - (int)before[a]);
+
+    unsigned char done = state->halted != HALT_NONE;
+    if (!done && env->done_fn != NULL)
+        done = env->done_fn(state, i, env->done_ctx) != 0;
+    if (!done && env->max_frames > 0 && env->frames[i] >= env->max_frames)
+        done = 1;
+
+    // Max of two bitpacked frames is just an or
+    if (env->flicker_max)
+        for (int y = 0; y < GFX_H; y++)
+            pooled[y] |= state->gfx[y];
+
+    if (done)
+        reset_one(env, i);
+    if (env->byte_obs != NULL)
+        unpack_obs(env, i, env->flicker_max && !done ? pooled : state->gfx);
+    if (env->rewards != NULL)
+        env->rewards[i] = reward;
+    if (env->dones != NULL)
+        env->dones[i] = done;
+}
+
+static void run_slice(chip8_env *env, int slice)
+{
+    int lo = (long)env->num_envs * slice / env->num_threads;
+    int hi = (long)env->num_envs * (slice + 1) / env->num_threads;
+    for (int i = lo; i < hi; i++)
+        step_one(env, i);
+}
+
+static void * worker(void *p)
+{
+    worker_arg *arg = p;
+    chip8_env *env = arg->env;
+    int slice = arg->slice;
+    unsigned long seen = 0;
+    free(arg);
+
+    pthread_mutex_lock(&env->lock);
+    for (;;)
+    {
+        while (env->generation == seen && !env->quit)
+            pthread_cond_wait(&env->start, &env->lock);
+        if (env->quit)
+            break;
+        seen = env->generation;
+        pthread_mutex_unlock(&env->lock);
+
+        run_slice(env, slice);
+
+        pthread_mutex_lock(&env->lock);
+        if (--env->pending == 0)
+            pthread_cond_signal(&env->finished);
+    }
+    pthread_mutex_unlock(&env->lock);
+    return NULL;
+}
+
+// Make num_envs copies of template_state, stepped on num_threads threads
+// (counting the caller). seed picks each env's rng, so a batch is
+// reproducible. Returns NULL on failure.
+chip8_env * env_create(const chip8_state *template_state,
+        int num_envs, int num_threads, unsigned int seed)
+{
+    if (num_envs < 1)
+        return NULL;
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > num_envs)
+        num_threads = num_envs;
+
+    chip8_env *env = calloc(1, sizeof(chip8_env));
+    if (env == NULL)
+        return NULL;
+    env->num_envs = num_envs;
+    env->stride = (sizeof(chip8_state) + 63) & ~(size_t)63;
+    env->states = aligned_alloc(64, env->stride * num_envs);
+    env->frames = calloc(num_envs, sizeof(long));
+    if (env->states == NULL || env->frames == NULL)
+    {
+        free(env->states);
+        free(env->frames);
+        free(env);
+        return NULL;
+    }
+    copy_state(&env->template_state, template_state);
+    env->frame_skip = 1;
+
+    for (int i = 0; i < num_envs; i++)
+    {
+        copy_state(state_at(env, i), template_state);
+        // splitmix-ish spread of the seed, xorshift can't start at 0
+        uint32_t z = seed + 0x9e3779b9u * (i + 1);
+        z = (z ^ (z >> 16)) * 0x85ebca6bu;
+        z = (z ^ (z >> 13)) * 0xc2b2ae35u;
+        state_at(env, i)->rng = (z ^ (z >> 16)) | 1;
+    }
+
+    pthread_mutex_init(&env->lock, NULL);
+    pthread_cond_init(&env->start, NULL);
+    pthread_cond_init(&env->finished, NULL);
+    env->num_threads = 1;
+    env->threads = calloc(num_threads, sizeof(pthread_t));
+    for (int t = 1; env->threads != NULL && t < num_threads; t++)
+    {
+        worker_arg *arg = malloc(sizeof(worker_arg));
+        if (arg == NULL)
+            break;
+        arg->env = env;
+        arg->slice = t;
+        if (pthread_create(&env->threads[t], NULL, worker, arg) != 0)
+        {
+            free(arg);
+            break;
+        }
+        env->num_threads++;
+    }
+    // If some threads couldn't start, the rest split the work between them
+    return env;
+}
+
+void env_destroy(chip8_env *env)
+{
+    if (env == NULL)
+        return;
+    pthread_mutex_lock(&env->lock);
+    env->quit = 1;
+    pthread_cond_broadcast(&env->start);
+    pthread_mutex_unlock(&env->lock);
+    for (int t = 1; t < env->num_threads; t++)
+        pthread_join(env->threads[t], NULL);
+    pthread_cond_destroy(&env->finished);
+    pthread_cond_destroy(&env->start);
+    pthread_mutex_destroy(&env->lock);
+    free(env->threads);
+    free(env->byte_obs);
+    free(env->frames);
+    free(env->states);
+    free(env);
+}
+
+// Frames run per step with the same keys held (default 1)
+void env_set_frame_skip(chip8_env *env, int frame_skip)
+{
+    env->frame_skip = frame_skip < 1 ? 1 : frame_skip;
+}
+
+// Episodes end after this many frames, 0 (default) for never
+void env_set_max_frames(chip8_env *env, long max_frames)
+{
+    env->max_frames = max_frames;
+}
+
+// Custom reward, replaces any addresses from env_add_reward_addr
+void env_set_reward_fn(chip8_env *env, chip8_reward_fn fn, void *ctx)
+{
+    env->reward_fn = fn;
+    env->reward_ctx = ctx;
+}
+
+// Reward scale * (change in memory[addr]) each step, summed over all
+// added addresses. Returns 0, or -1 if full or addr is out of memory.
+int env_add_reward_addr(chip8_env *env, unsigned short addr, float scale)
+{
+    if (env->num_reward_addrs == MAX_REWARD_ADDRS || addr >= MEM_SIZE)
+        return -1;
+    env->reward_addrs[env->num_reward_addrs] = addr;
+    env->reward_scales[env->num_reward_addrs] = scale;
+    env->num_reward_addrs++;
+    return 0;
+}
+
+// Extra end of episode test, on top of halting and max_frames
+void env_set_done_fn(chip8_env *env, chip8_done_fn fn, void *ctx)
+{
+    env->done_fn = fn;
+    env->done_ctx = ctx;
+}
+
+// Turn the unpacked byte observation buffer on or off
+void env_set_byte_obs(chip8_env *env, int on)
+{
+    if (on && env->byte_obs == NULL)
+    {
+        env->byte_obs = malloc((size_t)env->num_envs * GFX_H * GFX_W);
+        for (int i = 0; env->byte_obs != NULL && i < env->num_envs; i++)
+            unpack_obs(env, i, state_at(env, i)->gfx);
+    }
+    else if (!on)
+    {
+        free(env->byte_obs);
+        env->byte_obs = NULL;
+    }
+}
+
+// Make the byte obs the max of each step's last two frames, so sprites
+// a game flickers on alternate frames don't vanish
+void env_set_flicker_max(chip8_env *env, int on)
+{
+    env->flicker_max = on;
+}
+
+// Start every env over from the template
+void env_reset(chip8_env *env)
+{
+    for (int i = 0; i < env->num_envs; i++)
+    {
+        reset_one(env, i);
+        if (env->byte_obs != NULL)
+            unpack_obs(env, i, state_at(env, i)->gfx);
+    }
+}
+
+// Step every env once. actions holds num_envs keypad masks, rewards and
+// dones get num_envs results each (either may be NULL).
+void env_step(chip8_env *env, const unsigned short *actions,
+        float *rewards, unsigned char *dones)
+{
+    env->actions = actions;
+    env->rewards = rewards;
+    env->dones = dones;
+
+    if (env->num_threads == 1)
+    {
+        run_slice(env, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&env->lock);
+    env->pending = env->num_threads - 1;
+    env->generation++;
+    pthread_cond_broadcast(&env->start);
+    pthread_mutex_unlock(&env->lock);
+
+    run_slice(env, 0);
+
+    pthread_mutex_lock(&env->lock);
+    while (env->pending > 0)
+        pthread_cond_wait(&env->finished, &env->lock);
+    pthread_mutex_unlock(&env->lock);
+}
+
+int env_count(chip8_env *env)
+{
+    return env->num_envs;
+}
+
+chip8_state * env_state(chip8_env *env, int i)
+{
+    return state_at(env, i);
+}
+
+// Env i's screen, GFX_H rows of 64 bits. Valid until the next step.
+const uint64_t * env_gfx(chip8_env *env, int i)
+{
+    return state_at(env, i)->gfx;
+}
+
+// Env 0's screen; env i's is stride bytes further along per i
+const uint64_t * env_gfx_batch(chip8_env *env, size_t *stride)
+{
+    if (stride != NULL)
+        *stride = env->stride;
+    return state_at(env, 0)->gfx;
+}
+
+// num_envs * GFX_H * GFX_W bytes, or NULL if not turned on
+const unsigned char * env_byte_obs(chip8_env *env)
+{
+    return env->byte_obs;
+}
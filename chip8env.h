@@ -0,0 +1,53 @@
+#ifndef CHIP8ENV_H_INC
+#define CHIP8ENV_H_INC
+
+#include <stddef.h>
+
+#include "chip8vm.h"
+
+// Batched, headless vms for training agents: step N of them in one call,
+// spread over a pool of worker threads.
+//
+// Each step takes one action per env, a 16 bit keypad mask (bit k set
+// means key k is held), runs frame_skip frames of CYCLES_PER_FRAME
+// instructions with those keys held, and reports a reward and a done flag.
+// Envs that finish are reset from the template state right away, so the
+// caller never has to reset them itself.
+//
+// Observations are zero-copy: the states live in one array, so env_gfx()
+// points straight into each vm's bitpacked gfx, env_gfx_batch() gives the
+// whole batch as base pointer + stride, and with env_set_byte_obs() on
+// every step also unpacks all screens into one contiguous
+// num_envs * GFX_H * GFX_W byte buffer (0 or 0xff per pixel), which the
+// transforms in chip8obs.h take as is.
+
+typedef struct chip8_env chip8_env;
+
+// Reward for env i after a step, called from a worker thread
+typedef float (*chip8_reward_fn)(const chip8_state *state, int i, void *ctx);
+// Nonzero if env i's episode is over, called from a worker thread
+typedef int (*chip8_done_fn)(const chip8_state *state, int i, void *ctx);
+
+chip8_env * env_create(const chip8_state *template_state,
+        int num_envs, int num_threads, unsigned int seed);
+void env_destroy(chip8_env *env);
+
+void env_set_frame_skip(chip8_env *env, int frame_skip);
+void env_set_max_frames(chip8_env *env, long max_frames);
+void env_set_reward_fn(chip8_env *env, chip8_reward_fn fn, void *ctx);
+int env_add_reward_addr(chip8_env *env, unsigned short addr, float scale);
+void env_set_done_fn(chip8_env *env, chip8_done_fn fn, void *ctx);
+void env_set_byte_obs(chip8_env *env, int on);
+void env_set_flicker_max(chip8_env *env, int on);
+
+void env_reset(chip8_env *env);
+void env_step(chip8_env *env, const unsigned short *actions,
+        float *rewards, unsigned char *dones);
+
+int env_count(chip8_env *env);
+chip8_state * env_state(chip8_env *env, int i);
+const uint64_t * env_gfx(chip8_env *env, int i);
+const uint64_t * env_gfx_batch(chip8_env *env, size_t *stride);
+const unsigned char * env_byte_obs(chip8_env *env);
+
+#endif
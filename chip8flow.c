@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h> // for memset
+
+#include "chip8dis.h"
+#include "chip8flow.h"
+
+// Addresses still to follow. Each push sets a new flag on its address
+// (BLOCK, JUMP or SUB), so three per address at most.
+typedef struct {
+    unsigned short addr[3 * 4096];
+    int n;
+} worklist;
+
+static int is_skip(int cls)
+{
+    return cls == OP_TEQ_I || cls == OP_TNE_I || cls == OP_TEQ ||
+        cls == OP_TNE || cls == OP_TKEY || cls == OP_TNKEY;
+}
+
+// Does the block end after this instruction?
+static int ends_block(int cls)
+{
+    return cls == OP_GOTO || cls == OP_RET || cls == OP_JMPOFF ||
+        cls == OP_CALLPROG || cls == OP_INVALID || cls == OP_EXIT ||
+        is_skip(cls);
+}
+
+// Mark addr with flag and queue it, if it's in the rom
+static void target(chip8_flow *f, worklist *w, int addr, int flag)
+{
+    if (addr < f->start || addr + 1 >= f->end)
+    {
+        f->outside++;
+        return;
+    }
+    if ((f->flags[addr] & (flag | FLOW_BLOCK)) == (flag | FLOW_BLOCK))
+        return;
+    f->flags[addr] |= flag | FLOW_BLOCK;
+    w->addr[w->n++] = addr;
+}
+
+static unsigned short opcode_at(const unsigned char *memory, int addr)
+{
+    return memory[addr] << 8 | memory[addr + 1];
+}
+
+// OP_* of the instruction at addr, as flow->isa has it
+int flow_class(const chip8_flow *flow, const unsigned char *memory,
+        int addr)
+{
+    return op_class_isa(opcode_at(memory, addr), flow->isa);
+}
+
+// Bytes in the instruction at addr, 2 if it runs off the end
+static int insn_len(const chip8_flow *f, const unsigned char *memory,
+        int addr)
+{
+    if (addr + 3 >= f->end)
+        return 2;
+    return op_class_len(flow_class(f, memory, addr));
+}
+
+// Follow everything reachable from the queued addresses
+static void explore(chip8_flow *f, worklist *w, const unsigned char *memory)
+{
+    while (w->n > 0)
+    {
+        int pc = w->addr[--w->n];
+        // Straight line code until something ends it
+        while (pc >= f->start && pc + 1 < f->end &&
+                !(f->flags[pc] & FLOW_INSN))
+        {
+            unsigned short op = opcode_at(memory, pc);
+            int cls = flow_class(f, memory, pc);
+            int len = insn_len(f, memory, pc);
+            f->flags[pc] |= FLOW_INSN | (len == 4 ? FLOW_LONG : 0);
+            f->num_insns++;
+
+            if (cls == OP_GOTO)
+                target(f, w, op & 0xfff, FLOW_JUMP);
+            else if (cls == OP_CALL)
+                target(f, w, op & 0xfff, FLOW_SUB);
+            else if (is_skip(cls))
+            {
+                target(f, w, pc + 2, FLOW_BLOCK);
+                target(f, w, pc + 2 + insn_len(f, memory, pc + 2),
+                        FLOW_BLOCK);
+            }
+            else if (cls == OP_JMPOFF)
+            {
+                // NNN itself (V0 = 0), then a jump table of GOTOs there
+                f->indirect++;
+                int t = op & 0xfff;
+                target(f, w, t, FLOW_JUMP);
+                for (t += 2; t + 1 < f->end &&
+                        flow_class(f, memory, t) == OP_GOTO; t += 2)
+                    target(f, w, t, FLOW_JUMP);
+            }
+            else if (cls == OP_CALLPROG || cls == OP_INVALID)
+                f->flags[pc] |= FLOW_BAD;
+            else if (cls == OP_INDEX && (op & 0xfff) < 4096)
+                f->flags[op & 0xfff] |= FLOW_DATA;
+            else if (cls == OP_LONGI && len == 4 &&
+                    opcode_at(memory, pc + 2) < 4096)
+                f->flags[opcode_at(memory, pc + 2)] |= FLOW_DATA;
+
+            if (ends_block(cls))
+                break;
+            pc += len;
+        }
+        if (pc < f->start || pc + 1 >= f->end)
+            f->outside++;
+    }
+}
+
+// Split the code into blocks, in address order
+static void find_blocks(chip8_flow *f, const unsigned char *memory)
+{
+    int cap = 64;
+    f->blocks = malloc(cap * sizeof(flow_block));
+    for (int a = f->start; a < f->end; a++)
+    {
+        if ((f->flags[a] & (FLOW_INSN | FLOW_BLOCK)) !=
+                (FLOW_INSN | FLOW_BLOCK))
+            continue;
+        flow_block b = {a, a, {0, 0}, 0, 0};
+        int pc = a, cls;
+        do
+        {
+            cls = flow_class(f, memory, pc);
+            pc += insn_len(f, memory, pc);
+        } while (!ends_block(cls) && pc + 1 < f->end &&
+                (f->flags[pc] & FLOW_INSN) && !(f->flags[pc] & FLOW_BLOCK));
+        b.end = pc;
+        b.last_class = cls;
+
+        unsigned short op = opcode_at(memory, b.end - (cls == OP_LONGI ?
+                    4 : 2));
+        // BNNN only gets NNN, the rest of a jump table isn't an edge here
+        if (cls == OP_GOTO || cls == OP_JMPOFF)
+            b.succ[b.num_succ++] = op & 0xfff;
+        else if (is_skip(cls))
+        {
+            b.succ[b.num_succ++] = pc;
+            b.succ[b.num_succ++] = pc + insn_len(f, memory, pc);
+        }
+        else if (!ends_block(cls) && (f->flags[pc] & FLOW_INSN))
+            b.succ[b.num_succ++] = pc;
+
+        if (f->num_blocks == cap)
+        {
+            cap *= 2;
+            f->blocks = realloc(f->blocks, cap * sizeof(flow_block));
+        }
+        f->blocks[f->num_blocks++] = b;
+    }
+}
+
+// Walk each subroutine's blocks (not into what it calls) for its calls
+static void find_calls(chip8_flow *f, const unsigned char *memory)
+{
+    int cap = 16;
+    f->calls = malloc(cap * sizeof(flow_call));
+    unsigned char *seen = malloc(f->num_blocks > 0 ? f->num_blocks : 1);
+    int *stack = malloc((f->num_blocks + 1) * sizeof(int));
+
+    for (int s = 0; s < f->num_subs; s++)
+    {
+        memset(seen, 0, f->num_blocks);
+        int n = 0, first = f->num_calls;
+        int b = flow_block_at(f, f->subs[s]);
+        if (b >= 0)
+        {
+            seen[b] = 1;
+            stack[n++] = b;
+        }
+        while (n > 0)
+        {
+            flow_block *blk = &f->blocks[stack[--n]];
+            for (int pc = blk->start; pc < blk->end;
+                    pc += insn_len(f, memory, pc))
+            {
+                unsigned short op = opcode_at(memory, pc);
+                if (flow_class(f, memory, pc) != OP_CALL)
+                    continue;
+                int dup = 0;
+                for (int c = first; c < f->num_calls; c++)
+                    dup |= f->calls[c].to == (op & 0xfff);
+                if (dup)
+                    continue;
+                if (f->num_calls == cap)
+                {
+                    cap *= 2;
+                    f->calls = realloc(f->calls, cap * sizeof(flow_call));
+                }
+                f->calls[f->num_calls].from = f->subs[s];
+                f->calls[f->num_calls++].to = op & 0xfff;
+            }
+            for (int i = 0; i < blk->num_succ; i++)
+            {
+                int next = flow_block_at(f, blk->succ[i]);
+                // Jumping to another subroutine's entry is a tail call,
+                // not part of this one
+                if (next >= 0 && !seen[next] &&
+                        !(f->flags[blk->succ[i]] & FLOW_SUB))
+                {
+                    seen[next] = 1;
+                    stack[n++] = next;
+                }
+            }
+        }
+    }
+    free(seen);
+    free(stack);
+}
+
+// Analyse the rom in memory[start, end), entered at start, read as isa
+// (ISA_*). ran, if not NULL, is 4096 flags of pcs seen running, which
+// are followed as well. Returns NULL if out of memory.
+chip8_flow * flow_analyze(const unsigned char *memory, int start, int end,
+        const unsigned char *ran, int isa)
+{
+    chip8_flow *f = calloc(1, sizeof(chip8_flow));
+    worklist *w = malloc(sizeof(worklist));
+    if (f == NULL || w == NULL)
+    {
+        free(f);
+        free(w);
+        return NULL;
+    }
+    f->start = start;
+    f->end = end < 4096 ? end : 4096;
+    f->isa = isa;
+    w->n = 0;
+
+    target(f, w, start, FLOW_SUB);
+    explore(f, w, memory);
+    // Then whatever ran that the above didn't get to (BNNN targets, most
+    // likely), each as a jump target
+    for (int a = f->start; ran != NULL && a + 1 < f->end; a++)
+        if (ran[a] && !(f->flags[a] & FLOW_INSN))
+        {
+            f->seeded++;
+            target(f, w, a, FLOW_JUMP);
+            explore(f, w, memory);
+        }
+    free(w);
+
+    // Subroutines: the entry first, then the rest by address
+    f->subs = malloc((f->num_insns + 1) * sizeof(unsigned short));
+    if (f->flags[start] & FLOW_INSN)
+        f->subs[f->num_subs++] = start;
+    for (int a = f->start; a < f->end; a++)
+        if (a != start && (f->flags[a] & FLOW_SUB) &&
+                (f->flags[a] & FLOW_INSN))
+            f->subs[f->num_subs++] = a;
+
+    find_blocks(f, memory);
+    find_calls(f, memory);
+
+    for (int a = f->start; a < f->end; a++)
+        if (!flow_is_code(f, a))
+            f->data_bytes++;
+    return f;
+}
+
+// Index of the block starting at addr, or -1
+int flow_block_at(const chip8_flow *flow, int addr)
+{
+    int lo = 0, hi = flow->num_blocks - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (flow->blocks[mid].start == addr)
+            return mid;
+        if (flow->blocks[mid].start < addr)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+// 1 if addr is any byte of a reachable instruction
+int flow_is_code(const chip8_flow *flow, int addr)
+{
+    return (addr >= 0 && addr < 4096 && (flow->flags[addr] & FLOW_INSN)) ||
+        (addr >= 1 && addr <= 4096 && (flow->flags[addr - 1] & FLOW_INSN)) ||
+        (addr >= 2 && addr <= 4097 && (flow->flags[addr - 2] & FLOW_LONG)) ||
+        (addr >= 3 && addr <= 4098 && (flow->flags[addr - 3] & FLOW_LONG));
+}
+
+void flow_free(chip8_flow *flow)
+{
+    if (flow == NULL)
+        return;
+    free(flow->blocks);
+    free(flow->subs);
+    free(flow->calls);
+    free(flow);
+}
@@ -0,0 +1,67 @@
+#ifndef CHIP8FLOW_H_INC
+#define CHIP8FLOW_H_INC
+
+// Control flow recovery: follows a rom from its entry through jumps,
+// calls, skips and returns to find which bytes are code, splits the code
+// into basic blocks and works out the call graph. Whatever isn't reached
+// is data. Used by disasm, and by anything that wants to know what a
+// rom can run before running it.
+//
+// It can't see through BNNN (jumps to NNN + V0): NNN and any run of GOTOs
+// there (a jump table) are followed, and the jump is counted in indirect
+// so callers know the picture may be incomplete. Self modifying code
+// isn't followed either. Where a run of the rom has been recorded (disasm
+// -prof), every pc it ran is followed too, which fills those gaps in.
+//
+// Opcodes are read as the instruction set (ISA_* in chip8dis.h) given
+// says: the plain machine's for anything that runs on it, SUPER-CHIP's
+// or XO-CHIP's otherwise. With XO-CHIP, F000 NNNN is 4 bytes, and skips
+// hop over all of it.
+
+// Per address flags
+#define FLOW_INSN 0x01  // an instruction starts here
+#define FLOW_BLOCK 0x02 // ... and so does a basic block
+#define FLOW_JUMP 0x04  // GOTO or BNNN target, gets a label
+#define FLOW_SUB 0x08   // CALL target (or the entry): a subroutine
+#define FLOW_DATA 0x10  // INDEX points here
+#define FLOW_BAD 0x20   // an invalid opcode (or 0NNN) is reached here
+#define FLOW_LONG 0x40  // ... the instruction here is 4 bytes (F000 NNNN)
+
+typedef struct {
+    unsigned short start, end;  // instructions in [start, end)
+    unsigned short succ[2];     // where control goes next (BNNN: NNN)
+    unsigned char num_succ;
+    unsigned char last_class;   // OP_* of the last instruction
+} flow_block;
+
+// Call graph edge, between subroutine entries
+typedef struct {
+    unsigned short from, to;
+} flow_call;
+
+typedef struct {
+    int start, end;             // rom bytes looked at, [start, end)
+    int isa;                    // ISA_* it was read as
+    unsigned char flags[4096];  // FLOW_*, by address
+    flow_block *blocks;         // in address order
+    int num_blocks;
+    unsigned short *subs;       // entries, start first
+    int num_subs;
+    flow_call *calls;           // each edge once, by caller
+    int num_calls;
+    int num_insns;
+    int data_bytes;             // in [start, end), not code
+    int indirect;               // BNNNs reached
+    int outside;                // jumps and calls out of [start, end)
+    int seeded;                 // ran pcs only found by running
+} chip8_flow;
+
+chip8_flow * flow_analyze(const unsigned char *memory, int start, int end,
+        const unsigned char *ran, int isa);
+int flow_class(const chip8_flow *flow, const unsigned char *memory,
+        int addr);
+int flow_block_at(const chip8_flow *flow, int addr);
+int flow_is_code(const chip8_flow *flow, int addr);
+void flow_free(chip8_flow *flow);
+
+#endif
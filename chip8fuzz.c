@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memcpy, memcmp, memset, strcmp
+#include <time.h>
+#include <unistd.h> // for sysconf, sleep
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "chip8vm.h"
+#include "chip8ref.h"
+#include "chip8dis.h"
+#include "chip8verify.h"
+
+// Coverage guided differential fuzzer. Mutates ROMs and keypad schedules,
+// runs each input on two engines in lockstep, and reports the first
+// instruction after which their states differ. Inputs that reach new
+// coverage (AFL style edges between (pc, opcode class) pairs, with
+// bucketed hit counts) go into the corpus and get mutated further.
+//
+// Usage: chip8fuzz [-a engine] [-b engine] [-threads N] [-time secs]
+//                  [-frames N] [-seeds dir] [-out dir] [-seed N]
+//        chip8fuzz [-a engine] [-b engine] -replay file
+//
+// Engines are "ref" (chip8ref.c) or any in chip8_engines. With -out, new
+// corpus entries go in dir/corpus and divergent inputs in dir/diffs.
+// Inputs are saved as "C8FZ", u16 frames, a u16 key mask per frame
+// (little endian), then the rom. Seeds can be those or plain roms.
+//
+// If either engine is "verified", each input's rom goes through
+// verify_state() first, as chip8vm does, so the ones that pass run
+// unchecked and those that don't run checked. Coverage counts the two
+// apart, so roms that get through the verifier are kept and mutated
+// further; the status line says how many inputs passed.
+
+#define FUZZ_MAP (1 << 16)
+#define FUZZ_FRAMES_MAX 256
+#define ROM_MAX 0xe00
+#define MAX_DIFF_KINDS 256
+// Past this, new finds replace random old ones
+#define CORPUS_MAX 16384
+
+typedef struct {
+    int len;            // rom bytes
+    int frames;
+    unsigned short keys[FUZZ_FRAMES_MAX];   // keypad mask per frame
+    unsigned char rom[ROM_MAX];
+} fuzz_input;
+
+typedef struct {
+    long cycle;         // instructions in, counting from 0
+    int frame;
+    unsigned short pc;  // where the divergent instruction ran
+    unsigned short opcode;
+    char what[REF_DIFF_LEN]; // first field that differs, and both values
+} divergence;
+
+// Shared by all workers, under lock
+static struct {
+    pthread_mutex_t lock;
+    fuzz_input **corpus;
+    int corpus_len;
+    int corpus_cap;
+    // bucket bits never seen yet, scanned a word at a time
+    unsigned char virgin[FUZZ_MAP] __attribute__((aligned(8)));
+    int edges;
+    unsigned long long execs;
+    int diffs;
+    char diff_kinds[MAX_DIFF_KINDS][48];
+    int num_diff_kinds;
+    unsigned long long verified;   // inputs that passed verify_state()
+} shared = {PTHREAD_MUTEX_INITIALIZER};
+
+static const chip8_engine *eng_a, *eng_b;
+static int verifying = 0;  // either engine is "verified"
+static int frames = 60;
+static const char *out_dir = NULL;
+static int stop = 0;
+
+static const chip8_engine * engine_named(const char *name)
+{
+    if (strcmp(name, ref_engine.name) == 0)
+        return &ref_engine;
+    return find_engine(name);
+}
+
+static uint64_t next_rand(uint64_t *r)
+{
+    *r ^= *r << 13;
+    *r ^= *r >> 7;
+    *r ^= *r << 17;
+    return *r;
+}
+
+// A mostly valid opcode, jumps and calls landing inside a rom of len
+static unsigned short random_opcode(uint64_t *r, int len)
+{
+    static const unsigned short fixed[] = {
+        0x00e0, 0x00ee, 0x8000, 0x8001, 0x8002, 0x8003, 0x8004, 0x8005,
+        0x8006, 0x8007, 0x800e, 0xe09e, 0xe0a1, 0xf007, 0xf00a, 0xf015,
+        0xf018, 0xf01e, 0xf029, 0xf033, 0xf055, 0xf065,
+    };
+    uint64_t n = next_rand(r);
+    unsigned short target = 0x200 + ((n >> 16) % (len > 1 ? len : 2) & ~1);
+    switch (n % 6)
+    {
+        case 0:
+        {
+            // Fill in X, and Y for 8XYN
+            unsigned short op = fixed[(n >> 8) % (sizeof(fixed) / 2)];
+            if (op >= 0xe000)
+                op |= (n >> 16) & 0xf00;
+            else if (op >= 0x8000)
+                op |= (n >> 16) & 0xff0;
+            return op;
+        }
+        case 1:
+            return ((n >> 8) % 2 ? 0x1000 : 0x2000) | target;
+        case 2:
+            // Skips, loads, adds, I, rand, draw: any operands will do
+            return (0x3000 + 0x1000 * ((n >> 8) % 4)) | ((n >> 16) & 0xfff);
+        case 3:
+            return ((n >> 8) % 2 ? 0x7000 : 0xc000) | ((n >> 16) & 0xfff);
+        case 4:
+            return ((n >> 8) % 2 ? 0xa000 : 0xd000) | ((n >> 16) & 0xfff);
+        default:
+            return n >> 16;
+    }
+}
+
+static void mutate(fuzz_input *in, uint64_t *r, const fuzz_input *other)
+{
+    int count = 1 << (next_rand(r) % 5);
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t n = next_rand(r);
+        int at = (n >> 8) % in->len;
+        int word = at & ~1;
+        switch (n % 8)
+        {
+            case 0:
+                in->rom[at] ^= 1 << ((n >> 32) % 8);
+                break;
+            case 1:
+                in->rom[at] = n >> 32;
+                break;
+            case 2:
+            case 3:
+                if (word + 1 < in->len)
+                {
+                    unsigned short op = random_opcode(r, in->len);
+                    in->rom[word] = op >> 8;
+                    in->rom[word + 1] = op & 0xff;
+                }
+                break;
+            case 4:
+            {
+                // Copy a chunk from this or another input
+                const fuzz_input *src = (n >> 40) % 2 ? other : in;
+                int from = (n >> 32) % src->len;
+                int len = 1 + (n >> 48) % 32;
+                if (len > src->len - from)
+                    len = src->len - from;
+                if (len > in->len - at)
+                    len = in->len - at;
+                memmove(in->rom + at, src->rom + from, len);
+                break;
+            }
+            case 5:
+                in->keys[(n >> 32) % in->frames] ^= 1 << ((n >> 48) % 16);
+                break;
+            case 6:
+            {
+                // Hold one mask over a run of frames
+                int f = (n >> 32) % in->frames;
+                int len = 1 + (n >> 44) % 16;
+                for (int k = f; k < f + len && k < in->frames; k++)
+                    in->keys[k] = in->keys[f];
+                break;
+            }
+            default:
+            {
+                // Grow (with random opcodes) or cut the rom
+                int len = in->len + ((n >> 32) % 2 ? 32 : -32);
+                if (len < 2 || len > ROM_MAX)
+                    break;
+                for (int k = in->len; k + 1 < len; k += 2)
+                {
+                    unsigned short op = random_opcode(r, len);
+                    in->rom[k] = op >> 8;
+                    in->rom[k + 1] = op & 0xff;
+                }
+                in->len = len;
+            }
+        }
+    }
+}
+
+// Per worker scratch
+typedef struct {
+    chip8_state *a, *b;
+    chip8_state *frame_a, *frame_b;  // both at the start of the frame
+    const chip8_state *fresh;
+    unsigned char map[FUZZ_MAP] __attribute__((aligned(8)));
+} fuzz_vms;
+
+// One instruction on both. Returns 1 if they now differ.
+static int step_both(fuzz_vms *vm, int full, unsigned char *map,
+        unsigned short *prev, divergence *d)
+{
+    unsigned short pc = vm->a->pc;
+    unsigned short op = vm->a->memory[pc & 0xfff] << 8 |
+        vm->a->memory[(pc + 1) & 0xfff];
+    if (map != NULL)
+    {
+        // Unchecked is a different path through the engine from checked
+        unsigned short cur = ((pc & 0xfff) * 0x9e37 ^ op_class(op) * 0x85eb ^
+                vm->a->verified * 0x5a3c) & (FUZZ_MAP - 1);
+        map[cur ^ *prev]++;
+        *prev = cur >> 1;
+    }
+    eng_a->run(vm->a, 1);
+    eng_b->run(vm->b, 1);
+    if (!ref_diff(vm->a, vm->b, full, d->what))
+        return 0;
+    d->pc = pc;
+    d->opcode = op;
+    return 1;
+}
+
+// Run an input on both engines. Fills vm->map with its coverage.
+// Returns 1 and fills d if they diverged.
+static int run_input(fuzz_vms *vm, const fuzz_input *in, divergence *d)
+{
+    memset(vm->map, 0, FUZZ_MAP);
+    copy_state(vm->a, vm->fresh);
+    memcpy(vm->a->memory + 0x200, in->rom, in->len);
+    if (verifying)
+        verify_state(vm->a, NULL);
+    copy_state(vm->b, vm->a);
+
+    unsigned short prev = 0;
+    long cycle = 0;
+    for (int f = 0; f < in->frames; f++)
+    {
+        for (int k = 0; k < 16; k++)
+            vm->a->key[k] = vm->b->key[k] = (in->keys[f] >> k) & 1;
+        copy_state(vm->frame_a, vm->a);
+        copy_state(vm->frame_b, vm->b);
+
+        // Registers are checked after every instruction, memory and
+        // the screen only once a frame as they're big
+        int c, diverged = 0;
+        for (c = 0; c < CYCLES_PER_FRAME && !vm->a->halted; c++)
+            if ((diverged = step_both(vm, 0, vm->map, &prev, d)))
+                break;
+        if (diverged || ref_diff(vm->a, vm->b, 1, d->what))
+        {
+            // Go back over the frame checking everything, so memory that
+            // went wrong before the registers did is caught first
+            copy_state(vm->a, vm->frame_a);
+            copy_state(vm->b, vm->frame_b);
+            for (c = 0; c < CYCLES_PER_FRAME; c++)
+                if (step_both(vm, 1, NULL, NULL, d))
+                    break;
+            d->cycle = cycle + c;
+            d->frame = f;
+            return 1;
+        }
+        cycle += c;
+        if (vm->a->halted)
+            break;
+        tick_timers(vm->a);
+        tick_timers(vm->b);
+    }
+    return 0;
+}
+
+// AFL's hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static void classify(unsigned char *map)
+{
+    static unsigned char bucket[256];
+    if (bucket[1] == 0)
+        for (int i = 1; i < 256; i++)
+            bucket[i] = i == 1 ? 1 : i == 2 ? 2 : i == 3 ? 4 : i < 8 ? 8 :
+                i < 16 ? 16 : i < 32 ? 32 : i < 128 ? 64 : 128;
+    uint64_t *words = (uint64_t *)map;
+    for (int i = 0; i < FUZZ_MAP / 8; i++)
+    {
+        if (words[i] == 0)
+            continue;
+        for (int j = 0; j < 8; j++)
+            map[i * 8 + j] = bucket[map[i * 8 + j]];
+    }
+}
+
+static void save_input(const fuzz_input *in, const char *sub, int id)
+{
+    if (out_dir == NULL)
+        return;
+    char name[512];
+    snprintf(name, sizeof(name), "%s/%s/%06i.c8fz", out_dir, sub, id);
+    FILE *out = fopen(name, "wb");
+    if (out == NULL)
+        return;
+    unsigned char head[6] = {'C', '8', 'F', 'Z', in->frames & 0xff,
+        in->frames >> 8};
+    fwrite(head, 1, 6, out);
+    for (int f = 0; f < in->frames; f++)
+    {
+        unsigned char k[2] = {in->keys[f] & 0xff, in->keys[f] >> 8};
+        fwrite(k, 1, 2, out);
+    }
+    fwrite(in->rom, 1, in->len, out);
+    fclose(out);
+}
+
+// Read an input saved by save_input(), or a plain rom. NULL if unreadable.
+static fuzz_input * load_input(const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return NULL;
+    static unsigned char buf[6 + 2 * FUZZ_FRAMES_MAX + ROM_MAX];
+    int len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    fuzz_input *in = calloc(1, sizeof(fuzz_input));
+    in->frames = frames;
+    const unsigned char *rom = buf;
+    if (len >= 6 && memcmp(buf, "C8FZ", 4) == 0)
+    {
+        in->frames = buf[4] | buf[5] << 8;
+        if (in->frames < 1 || in->frames > FUZZ_FRAMES_MAX ||
+                len < 6 + 2 * in->frames)
+        {
+            free(in);
+            return NULL;
+        }
+        for (int k = 0; k < in->frames; k++)
+            in->keys[k] = buf[6 + 2 * k] | buf[7 + 2 * k] << 8;
+        rom = buf + 6 + 2 * in->frames;
+        len -= rom - buf;
+    }
+    if (len > ROM_MAX)
+        len = ROM_MAX;
+    if (len < 2)
+    {
+        free(in);
+        return NULL;
+    }
+    memcpy(in->rom, rom, len);
+    in->len = len;
+    return in;
+}
+
+static void print_divergence(const divergence *d)
+{
+    char text[MNEMONIC_LEN];
+    if (format_opcode(d->opcode, text) < 0)
+        snprintf(text, sizeof(text), "(invalid)");
+    printf("DIVERGED: %s vs %s after instruction %li (frame %i): "
+            "%03x: %04x %s: %s\n", eng_a->name, eng_b->name, d->cycle,
+            d->frame, d->pc, d->opcode, text, d->what);
+}
+
+// Add to the corpus if it hit anything new. Call with the lock held.
+static void maybe_keep(const fuzz_input *in, const unsigned char *map,
+        uint64_t *r)
+{
+    int new_edges = 0, new_bits = 0;
+    const uint64_t *words = (const uint64_t *)map;
+    const uint64_t *virgin = (const uint64_t *)shared.virgin;
+    for (int i = 0; i < FUZZ_MAP; i++)
+    {
+        if (i % 8 == 0 && !(words[i / 8] & virgin[i / 8]))
+        {
+            i += 7;
+            continue;
+        }
+        if (!(map[i] & shared.virgin[i]))
+            continue;
+        if (shared.virgin[i] == 0xff)
+            new_edges++;
+        shared.virgin[i] &= ~map[i];
+        new_bits = 1;
+    }
+    if (!new_bits)
+        return;
+    shared.edges += new_edges;
+    if (shared.corpus_len >= CORPUS_MAX)
+    {
+        int old = next_rand(r) % shared.corpus_len;
+        memcpy(shared.corpus[old], in, sizeof(fuzz_input));
+        save_input(in, "corpus", old);
+        return;
+    }
+    if (shared.corpus_len == shared.corpus_cap)
+    {
+        shared.corpus_cap = shared.corpus_cap ? 2 * shared.corpus_cap : 64;
+        shared.corpus = realloc(shared.corpus,
+                shared.corpus_cap * sizeof(fuzz_input *));
+    }
+    fuzz_input *keep = malloc(sizeof(fuzz_input));
+    memcpy(keep, in, sizeof(fuzz_input));
+    shared.corpus[shared.corpus_len] = keep;
+    save_input(keep, "corpus", shared.corpus_len);
+    shared.corpus_len++;
+}
+
+// A divergence is new if no earlier one had the same opcode class and
+// differing field. Call with the lock held.
+static int new_diff_kind(const divergence *d)
+{
+    char kind[48];
+    int field = strcspn(d->what, " [");
+    snprintf(kind, sizeof(kind), "%s %.*s", op_class_pattern(op_class(d->opcode)),
+            field, d->what);
+    for (int i = 0; i < shared.num_diff_kinds; i++)
+        if (strcmp(shared.diff_kinds[i], kind) == 0)
+            return 0;
+    if (shared.num_diff_kinds < MAX_DIFF_KINDS)
+        strcpy(shared.diff_kinds[shared.num_diff_kinds++], kind);
+    return 1;
+}
+
+static fuzz_vms * vms_create(const chip8_state *fresh)
+{
+    fuzz_vms *vm = malloc(sizeof(fuzz_vms));
+    vm->a = malloc(sizeof(chip8_state));
+    vm->b = malloc(sizeof(chip8_state));
+    vm->frame_a = malloc(sizeof(chip8_state));
+    vm->frame_b = malloc(sizeof(chip8_state));
+    vm->fresh = fresh;
+    return vm;
+}
+
+static void vms_free(fuzz_vms *vm)
+{
+    free(vm->a);
+    free(vm->b);
+    free(vm->frame_a);
+    free(vm->frame_b);
+    free(vm);
+}
+
+typedef struct {
+    const chip8_state *fresh;
+    uint64_t seed;
+} worker_args;
+
+static void * worker(void *arg)
+{
+    worker_args *args = arg;
+    uint64_t r = args->seed;
+    fuzz_vms *vm = vms_create(args->fresh);
+    fuzz_input in, other;
+    divergence d;
+    unsigned long long execs = 0;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        pthread_mutex_lock(&shared.lock);
+        memcpy(&in, shared.corpus[next_rand(&r) % shared.corpus_len],
+                sizeof(fuzz_input));
+        memcpy(&other, shared.corpus[next_rand(&r) % shared.corpus_len],
+                sizeof(fuzz_input));
+        pthread_mutex_unlock(&shared.lock);
+
+        // A few dozen children per parent
+        for (int i = 0; i < 32; i++)
+        {
+            fuzz_input child = in;
+            mutate(&child, &r, &other);
+            int diverged = run_input(vm, &child, &d);
+            classify(vm->map);
+            execs++;
+
+            pthread_mutex_lock(&shared.lock);
+            shared.verified += vm->a->verified;
+            if (diverged)
+            {
+                shared.diffs++;
+                if (new_diff_kind(&d))
+                {
+                    print_divergence(&d);
+                    save_input(&child, "diffs", shared.diffs);
+                }
+            }
+            else
+                maybe_keep(&child, vm->map, &r);
+            shared.execs += execs;
+            execs = 0;
+            pthread_mutex_unlock(&shared.lock);
+        }
+    }
+    vms_free(vm);
+    return NULL;
+}
+
+static void add_seeds(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        printf("Could not open directory: %s\n", dir);
+        exit(1);
+    }
+    struct dirent *ent;
+    char name[1024];
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(name, sizeof(name), "%s/%s", dir, ent->d_name);
+        fuzz_input *in = load_input(name);
+        if (in == NULL)
+            continue;
+        shared.corpus_len++;
+        shared.corpus = realloc(shared.corpus,
+                shared.corpus_len * sizeof(fuzz_input *));
+        shared.corpus[shared.corpus_len - 1] = in;
+    }
+    closedir(d);
+    shared.corpus_cap = shared.corpus_len;
+}
+
+static int replay(const char *filename, const chip8_state *fresh)
+{
+    fuzz_input *in = load_input(filename);
+    if (in == NULL)
+    {
+        printf("Could not read input: %s\n", filename);
+        exit(1);
+    }
+    fuzz_vms *vm = vms_create(fresh);
+    divergence d;
+    int diverged = run_input(vm, in, &d);
+    if (verifying)
+    {
+        chip8_verify v;
+        copy_state(vm->a, fresh);
+        memcpy(vm->a->memory + 0x200, in->rom, in->len);
+        if (verify_state(vm->a, &v) == 0)
+            printf("Verified: ran unchecked\n");
+        else if (v.addr >= 0)
+            printf("Not verified, ran checked: %s at %03x\n", v.why, v.addr);
+        else
+            printf("Not verified, ran checked: %s\n", v.why);
+    }
+    if (diverged)
+        print_divergence(&d);
+    else
+        printf("No divergence: %s and %s agree over %i frames\n",
+                eng_a->name, eng_b->name, in->frames);
+    vms_free(vm);
+    free(in);
+    return diverged;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *a_name = "ref", *b_name = "switch";
+    const char *seeds = NULL, *replay_file = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), seconds = 60;
+    uint64_t seed = time(0);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+            a_name = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            b_name = argv[++i];
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc)
+            seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+            frames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-seeds") == 0 && i + 1 < argc)
+            seeds = argv[++i];
+        else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc)
+            out_dir = argv[++i];
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc)
+            replay_file = argv[++i];
+        else
+        {
+            printf("Usage: chip8fuzz [-a engine] [-b engine] [-threads N] "
+                    "[-time secs]\n");
+            printf("                 [-frames N] [-seeds dir] [-out dir] "
+                    "[-seed N]\n");
+            printf("       chip8fuzz [-a engine] [-b engine] -replay file\n");
+            exit(1);
+        }
+    }
+    eng_a = engine_named(a_name);
+    eng_b = engine_named(b_name);
+    if (eng_a == NULL || eng_b == NULL)
+    {
+        printf("ERROR: no engine called %s\n", eng_a ? b_name : a_name);
+        exit(1);
+    }
+    verifying = strcmp(eng_a->name, "verified") == 0 ||
+        strcmp(eng_b->name, "verified") == 0;
+    if (threads < 1 || frames < 1 || frames > FUZZ_FRAMES_MAX)
+    {
+        printf("ERROR: need -threads >= 1 and -frames 1-%i\n",
+                FUZZ_FRAMES_MAX);
+        exit(1);
+    }
+
+    // Every run starts from this, so both engines see the same rng seed
+    chip8_state *fresh = create_state();
+    fresh->rng = 0x2545f491;
+    if (replay_file != NULL)
+        return replay(replay_file, fresh);
+
+    if (out_dir != NULL)
+    {
+        char name[512];
+        mkdir(out_dir, 0755);
+        snprintf(name, sizeof(name), "%s/corpus", out_dir);
+        mkdir(name, 0755);
+        snprintf(name, sizeof(name), "%s/diffs", out_dir);
+        mkdir(name, 0755);
+    }
+    memset(shared.virgin, 0xff, FUZZ_MAP);
+    if (seeds != NULL)
+        add_seeds(seeds);
+    if (shared.corpus_len == 0)
+    {
+        // Nothing given: start from a short rom of random opcodes
+        fuzz_input *in = calloc(1, sizeof(fuzz_input));
+        uint64_t r = seed | 1;
+        in->frames = frames;
+        in->len = 64;
+        for (int k = 0; k < in->len; k += 2)
+        {
+            unsigned short op = random_opcode(&r, in->len);
+            in->rom[k] = op >> 8;
+            in->rom[k + 1] = op & 0xff;
+        }
+        shared.corpus = malloc(sizeof(fuzz_input *));
+        shared.corpus[0] = in;
+        shared.corpus_len = shared.corpus_cap = 1;
+    }
+
+    printf("Fuzzing %s against %s on %i threads, %i frames per input, "
+            "seed %llu\n", eng_a->name, eng_b->name, threads, frames,
+            (unsigned long long)seed);
+    pthread_t tids[threads];
+    worker_args args[threads];
+    for (int t = 0; t < threads; t++)
+    {
+        args[t].fresh = fresh;
+        args[t].seed = (seed + t + 1) * 0x9e3779b97f4a7c15ULL | 1;
+        pthread_create(&tids[t], NULL, worker, &args[t]);
+    }
+
+    unsigned long long last = 0;
+    for (int s = 1; seconds == 0 || s <= seconds; s++)
+    {
+        sleep(1);
+        pthread_mutex_lock(&shared.lock);
+        printf("%5is  execs %llu (%llu/s)  corpus %i  edges %i  diffs %i "
+                "(%i kinds)", s, shared.execs, shared.execs - last,
+                shared.corpus_len, shared.edges, shared.diffs,
+                shared.num_diff_kinds);
+        if (verifying)
+            printf("  verified %llu", shared.verified);
+        printf("\n");
+        last = shared.execs;
+        pthread_mutex_unlock(&shared.lock);
+        fflush(stdout);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+
+    for (int i = 0; i < shared.corpus_len; i++)
+        free(shared.corpus[i]);
+    free(shared.corpus);
+    free(fresh);
+    return shared.diffs != 0;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <string.h> // for memset
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "chip8hostperf.h"
+
+int hostperf_mode = HP_OFF;
+
+// perf event fds and their mmapped pages, cycles then instructions
+static int fds[2] = {-1, -1};
+static struct perf_event_mmap_page *pages[2];
+
+static struct {
+    unsigned long long calls;
+    unsigned long long cycles;
+    unsigned long long instrs;
+} buckets[NUM_HP_BUCKETS];
+
+// What a back to back begin/end costs, taken off every call
+static hp_sample overhead;
+// Begin/end pairs left out because a counter couldn't be read
+static unsigned long long dropped;
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint64_t rdpmc(uint32_t counter)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+    return (uint64_t)hi << 32 | lo;
+}
+#else
+#include <time.h>
+// No tsc: nanoseconds will have to do
+static inline uint64_t rdtsc(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+// Read a counter from userspace, following the seqlock protocol in
+// linux/perf_event.h. Returns 0 if the kernel won't let us.
+static int read_counter(struct perf_event_mmap_page *pc, uint64_t *value)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t seq, idx;
+    uint64_t count;
+    do
+    {
+        seq = pc->lock;
+        __asm__ volatile("" ::: "memory");
+        idx = pc->index;
+        count = pc->offset;
+        if (!pc->cap_user_rdpmc || idx == 0)
+            return 0;
+        int64_t pmc = rdpmc(idx - 1);
+        // Sign extend from the counter's real width
+        pmc <<= 64 - pc->pmc_width;
+        pmc >>= 64 - pc->pmc_width;
+        count += pmc;
+        __asm__ volatile("" ::: "memory");
+    } while (pc->lock != seq);
+    *value = count;
+    return 1;
+#else
+    (void)pc;
+    (void)value;
+    return 0;
+#endif
+}
+
+static int open_counter(uint64_t config, int slot)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fds[slot] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fds[slot] < 0)
+        return 0;
+    pages[slot] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+            fds[slot], 0);
+    if (pages[slot] == MAP_FAILED)
+    {
+        pages[slot] = NULL;
+        return 0;
+    }
+    uint64_t v;
+    return read_counter(pages[slot], &v);
+}
+
+void hostperf_read(hp_sample *s)
+{
+    if (hostperf_mode == HP_PERF)
+    {
+        // Either can fail while the kernel has the counter off the pmu
+        // (idx 0), which leaves that value unset
+        s->valid = read_counter(pages[0], &s->cycles);
+        s->valid &= read_counter(pages[1], &s->instrs);
+    }
+    else
+    {
+        s->cycles = rdtsc();
+        s->instrs = 0;
+        s->valid = 1;
+    }
+}
+
+void hostperf_add(int bucket, const hp_sample *begin, const hp_sample *end)
+{
+    if (!begin->valid || !end->valid)
+    {
+        dropped++;
+        return;
+    }
+    buckets[bucket].calls++;
+    buckets[bucket].cycles += end->cycles - begin->cycles;
+    buckets[bucket].instrs += end->instrs - begin->instrs;
+}
+
+// Open the counters, falling back to rdtsc. Returns the HP_* mode.
+int hostperf_start(void)
+{
+    if (open_counter(PERF_COUNT_HW_CPU_CYCLES, 0) &&
+            open_counter(PERF_COUNT_HW_INSTRUCTIONS, 1))
+        hostperf_mode = HP_PERF;
+    else
+    {
+        hostperf_stop();
+        hostperf_mode = HP_RDTSC;
+    }
+
+    // Smallest cost of an empty begin/end pair
+    hp_sample a, b;
+    overhead.cycles = overhead.instrs = ~0ULL;
+    for (int i = 0; i < 1000; i++)
+    {
+        hostperf_read(&a);
+        hostperf_read(&b);
+        if (!a.valid || !b.valid)
+            continue;
+        if (b.cycles - a.cycles < overhead.cycles)
+            overhead.cycles = b.cycles - a.cycles;
+        if (b.instrs - a.instrs < overhead.instrs)
+            overhead.instrs = b.instrs - a.instrs;
+    }
+    if (overhead.cycles == ~0ULL)
+        overhead.cycles = overhead.instrs = 0;
+    memset(buckets, 0, sizeof(buckets));
+    dropped = 0;
+    return hostperf_mode;
+}
+
+void hostperf_stop(void)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (pages[i] != NULL)
+            munmap(pages[i], sysconf(_SC_PAGESIZE));
+        if (fds[i] >= 0)
+            close(fds[i]);
+        pages[i] = NULL;
+        fds[i] = -1;
+    }
+    hostperf_mode = HP_OFF;
+}
+
+static const char * bucket_name(int b)
+{
+    switch (b)
+    {
+        case HP_KEYS: return "update_keys";
+        case HP_EVENTS: return "events";
+        case HP_RENDER: return "render";
+    }
+    return op_class_pattern(b);
+}
+
+// Net of the measuring overhead, never below 0
+static unsigned long long net(unsigned long long total,
+        unsigned long long calls, uint64_t each)
+{
+    unsigned long long cost = calls * each;
+    return total > cost ? total - cost : 0;
+}
+
+// Table of every bucket that was hit, biggest first
+void hostperf_report(FILE *out)
+{
+    int order[NUM_HP_BUCKETS];
+    unsigned long long cyc[NUM_HP_BUCKETS];
+    unsigned long long all = 0;
+    int n = 0;
+
+    for (int b = 0; b < NUM_HP_BUCKETS; b++)
+    {
+        cyc[b] = net(buckets[b].cycles, buckets[b].calls, overhead.cycles);
+        all += cyc[b];
+        if (buckets[b].calls != 0)
+            order[n++] = b;
+    }
+    // Few buckets, insertion sort is plenty
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && cyc[order[j]] > cyc[order[j - 1]]; j--)
+        {
+            int t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+
+    fprintf(out, "Host cost (%s, less %llu cycles measuring overhead each)\n",
+            hostperf_mode == HP_PERF ? "perf cycles/instructions" : "rdtsc",
+            (unsigned long long)overhead.cycles);
+    fprintf(out, "%-12s %12s %14s %9s %9s %6s\n",
+            "bucket", "calls", "cycles", "cyc/call", "ins/call", "%");
+    for (int i = 0; i < n; i++)
+    {
+        int b = order[i];
+        unsigned long long calls = buckets[b].calls;
+        unsigned long long ins = net(buckets[b].instrs, calls, overhead.instrs);
+        char ins_text[16] = "-";
+        if (hostperf_mode == HP_PERF)
+            snprintf(ins_text, sizeof(ins_text), "%.1f", (double)ins / calls);
+        fprintf(out, "%-12s %12llu %14llu %9.1f %9s %6.2f\n",
+                bucket_name(b), calls, cyc[b], (double)cyc[b] / calls,
+                ins_text, all ? 100.0 * cyc[b] / all : 0.0);
+    }
+    if (dropped > 0)
+        fprintf(out, "(%llu calls left out: a counter couldn't be read)\n",
+                dropped);
+}
@@ -0,0 +1,56 @@
+#ifndef CHIP8HOSTPERF_H_INC
+#define CHIP8HOSTPERF_H_INC
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "chip8dis.h"
+
+// Host cost accounting: what each opcode handler, update_keys() and the
+// frontend's render block cost on the real cpu. Reads the hardware cycle
+// and instruction counters through perf_event_open (with rdpmc, so no
+// syscall per read), or falls back to rdtsc, with no instruction counts,
+// when perf events aren't allowed.
+//
+// Like the guest profiler, the hooks only exist with CHIP8_HOSTPERF
+// defined (make chip8vm-hostperf) and do nothing until hostperf_start().
+
+// Buckets: one per opcode class, then the frontend's own
+enum {
+    HP_KEYS = NUM_OP_CLASSES,   // update_keys()
+    HP_EVENTS,                  // SDL event polling
+    HP_RENDER,                  // drawing the screen
+    NUM_HP_BUCKETS
+};
+
+// Counter sources
+#define HP_OFF 0
+#define HP_PERF 1   // cycles + instructions
+#define HP_RDTSC 2  // reference cycles only
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t instrs;
+    int valid;      // 0 if a perf counter couldn't be read (multiplexed)
+} hp_sample;
+
+extern int hostperf_mode;
+
+int hostperf_start(void);
+void hostperf_stop(void);
+void hostperf_read(hp_sample *s);
+void hostperf_add(int bucket, const hp_sample *begin, const hp_sample *end);
+void hostperf_report(FILE *out);
+
+#ifdef CHIP8_HOSTPERF
+#define HOSTPERF_BEGIN(t) \
+    hp_sample t; if (hostperf_mode) hostperf_read(&t)
+#define HOSTPERF_END(t, bucket) \
+    do { if (hostperf_mode) { hp_sample end_; hostperf_read(&end_); \
+        hostperf_add(bucket, &t, &end_); } } while (0)
+#else
+#define HOSTPERF_BEGIN(t) ((void)0)
+#define HOSTPERF_END(t, bucket) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+#include <string.h> // for memcpy, memset
+
+#include "chip8obs.h"
+
+// AVX2 versions are built with the target attribute so the rest of the
+// file (and the library) still runs on cpus without it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OBS_HAVE_AVX2 1
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+// -1 until checked, then 0 or 1
+static int use_avx2 = -1;
+
+static int have_avx2(void)
+{
+#ifdef OBS_HAVE_AVX2
+    if (use_avx2 < 0)
+    {
+        __builtin_cpu_init();
+        use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return use_avx2;
+#else
+    return 0;
+#endif
+}
+
+int obs_set_avx2(int on)
+{
+    use_avx2 = on ? -1 : 0;
+    return have_avx2();
+}
+
+
+#ifdef OBS_HAVE_AVX2
+// 64 px row -> 64 bytes: spread each byte of the word over 8 lanes, then
+// test one bit per lane
+AVX2 static void unpack_avx2(const uint64_t *gfx, int rows, unsigned char *out)
+{
+    // Leftmost px is the MSB, so lane 0 wants byte 7 of the word
+    const __m256i spread = _mm256_setr_epi8(
+            7, 7, 7, 7, 7, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6,
+            5, 5, 5, 5, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4);
+    const __m256i bits = _mm256_setr_epi8(
+            -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1,
+            -128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+    for (int y = 0; y < rows; y++)
+    {
+        // High half of the row (px 0-31) then the low half (px 32-63)
+        __m256i hi = _mm256_set1_epi64x(gfx[y]);
+        __m256i lo = _mm256_set1_epi64x(gfx[y] << 32);
+        hi = _mm256_and_si256(_mm256_shuffle_epi8(hi, spread), bits);
+        lo = _mm256_and_si256(_mm256_shuffle_epi8(lo, spread), bits);
+        _mm256_storeu_si256((__m256i *)(out + y * 64),
+                _mm256_cmpeq_epi8(hi, bits));
+        _mm256_storeu_si256((__m256i *)(out + y * 64 + 32),
+                _mm256_cmpeq_epi8(lo, bits));
+    }
+}
+
+AVX2 static size_t maxpool2_avx2(const unsigned char *a,
+        const unsigned char *b, unsigned char *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_max_epu8(va, vb));
+    }
+    return i;
+}
+
+AVX2 static size_t diff_avx2(const unsigned char *a,
+        const unsigned char *b, unsigned char *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        // One of the two saturating subs is always 0
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb),
+                _mm256_subs_epu8(vb, va));
+        _mm256_storeu_si256((__m256i *)(out + i), d);
+    }
+    return i;
+}
+
+// 2x2 average of a pair of rows, 64 px in -> 32 px out per step.
+// Returns the number of input columns done.
+AVX2 static int downsample2_avx2(const unsigned char *r0,
+        const unsigned char *r1, int w, unsigned char *out)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    int x;
+    for (x = 0; x + 64 <= w; x += 64)
+    {
+        // Rows are summed as 16 bit pairs, so nothing rounds until the end
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(r0 + x));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(r0 + x + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(r1 + x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(r1 + x + 32));
+        __m256i s0 = _mm256_add_epi16(_mm256_maddubs_epi16(a0, ones),
+                _mm256_maddubs_epi16(b0, ones));
+        __m256i s1 = _mm256_add_epi16(_mm256_maddubs_epi16(a1, ones),
+                _mm256_maddubs_epi16(b1, ones));
+        // maddubs treats the second operand as signed, but it's all 1s
+        // and the first is unsigned, so sums are exact (max 4 * 255)
+        s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, _mm256_set1_epi16(2)), 2);
+        s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, _mm256_set1_epi16(2)), 2);
+        // packus interleaves 128 bit lanes, permute puts them back
+        __m256i packed = _mm256_permute4x64_epi64(
+                _mm256_packus_epi16(s0, s1), 0xd8);
+        _mm256_storeu_si256((__m256i *)(out + x / 2), packed);
+    }
+    return x;
+}
+#endif
+
+
+void obs_unpack(const uint64_t *gfx, int rows, unsigned char *out)
+{
+#ifdef OBS_HAVE_AVX2
+    if (have_avx2())
+    {
+        unpack_avx2(gfx, rows, out);
+        return;
+    }
+#endif
+    for (int y = 0; y < rows; y++)
+        for (int x = 0; x < 64; x++)
+            out[y * 64 + x] = ((gfx[y] >> (63 - x)) & 1) ? 0xff : 0;
+}
+
+void obs_maxpool2(const unsigned char *a, const unsigned char *b,
+        unsigned char *out, size_t n)
+{
+    size_t i = 0;
+#ifdef OBS_HAVE_AVX2
+    if (have_avx2())
+        i = maxpool2_avx2(a, b, out, n);
+#endif
+    for (; i < n; i++)
+        out[i] = a[i] > b[i] ? a[i] : b[i];
+}
+
+void obs_diff(const unsigned char *a, const unsigned char *b,
+        unsigned char *out, size_t n)
+{
+    size_t i = 0;
+#ifdef OBS_HAVE_AVX2
+    if (have_avx2())
+        i = diff_avx2(a, b, out, n);
+#endif
+    for (; i < n; i++)
+        out[i] = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+}
+
+// Leftover columns (and other factors than 2) go the slow way.
+// Rounds to nearest, same as the vector version.
+void obs_downsample(const unsigned char *in, int w, int h, int factor,
+        unsigned char *out)
+{
+    int ow = w / factor;
+    int oh = h / factor;
+    int area = factor * factor;
+    for (int oy = 0; oy < oh; oy++)
+    {
+        const unsigned char *rows = in + (size_t)oy * factor * w;
+        unsigned char *orow = out + (size_t)oy * ow;
+        int x = 0;
+#ifdef OBS_HAVE_AVX2
+        if (factor == 2 && have_avx2())
+            x = downsample2_avx2(rows, rows + w, w, orow);
+#endif
+        for (int ox = x / factor; ox < ow; ox++)
+        {
+            unsigned int sum = 0;
+            for (int dy = 0; dy < factor; dy++)
+                for (int dx = 0; dx < factor; dx++)
+                    sum += rows[dy * w + ox * factor + dx];
+            orow[ox] = (sum + area / 2) / area;
+        }
+    }
+}
+
+
+void obs_stack_init(obs_stack *stack, unsigned char *buf,
+        size_t frame_size, int k)
+{
+    stack->buf = buf;
+    stack->frame_size = frame_size;
+    stack->k = k;
+    stack->head = 0;
+    memset(buf, 0, frame_size * k);
+}
+
+void obs_stack_push(obs_stack *stack, const unsigned char *frame)
+{
+    memcpy(stack->buf + stack->head * stack->frame_size, frame,
+            stack->frame_size);
+    stack->head = (stack->head + 1) % stack->k;
+}
+
+void obs_stack_read(const obs_stack *stack, unsigned char *out)
+{
+    // head is the oldest slot: copy head..end, then 0..head
+    size_t older = (size_t)(stack->k - stack->head) * stack->frame_size;
+    memcpy(out, stack->buf + stack->head * stack->frame_size, older);
+    memcpy(out + older, stack->buf, stack->head * stack->frame_size);
+}
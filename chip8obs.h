@@ -0,0 +1,42 @@
+#ifndef CHIP8OBS_H_INC
+#define CHIP8OBS_H_INC
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Observation transforms for training loops. Frames are bytes, one per
+// pixel, 0 for off and 0xff for on (gray levels after downsampling).
+// Nothing here allocates: every output is a buffer the caller owns.
+// Kernels use AVX2 when the cpu has it, checked once at first use.
+
+// Unpack a bitpacked screen (rows words of 64 px) into rows * 64 bytes
+void obs_unpack(const uint64_t *gfx, int rows, unsigned char *out);
+// out = max(a, b) per pixel, to get rid of flicker between frames
+void obs_maxpool2(const unsigned char *a, const unsigned char *b,
+        unsigned char *out, size_t n);
+// out = |a - b| per pixel
+void obs_diff(const unsigned char *a, const unsigned char *b,
+        unsigned char *out, size_t n);
+// Average factor x factor blocks of a w x h frame into (w/f) x (h/f)
+void obs_downsample(const unsigned char *in, int w, int h, int factor,
+        unsigned char *out);
+
+// Last K frames. buf is caller owned, k * frame_size bytes.
+typedef struct {
+    unsigned char *buf;
+    size_t frame_size;
+    int k;
+    int head;   // slot the next frame goes in
+} obs_stack;
+
+void obs_stack_init(obs_stack *stack, unsigned char *buf,
+        size_t frame_size, int k);
+void obs_stack_push(obs_stack *stack, const unsigned char *frame);
+// Copy the K frames out oldest first, k * frame_size bytes
+void obs_stack_read(const obs_stack *stack, unsigned char *out);
+
+// For tests: 0 makes every kernel the plain C one, 1 (or -1) goes back to
+// AVX2 when the cpu has it. Returns 1 if AVX2 is in use now.
+int obs_set_avx2(int on);
+
+#endif
@@ -0,0 +1,580 @@
+// The interpreter, as a template. Not a normal header: chip8core.c
+// includes it once per quirk profile, with these set first:
+//
+//   PROFILE             name suffix (emulate_opcode_vip etc, all static).
+//                       Left undefined for this vm's own behaviour, which
+//                       gives the public emulate_opcode(), emulate_cycle()
+//                       and run_cycles().
+//   QUIRK_SHIFT_VX      8XY6/8XYE shift VX in place, not VY into VX
+//   QUIRK_LOADSTORE     FX55/FX65 leave I alone (0), add X (1), add X+1 (2)
+//   QUIRK_JUMP_VX       BNNN is BXNN, jumping to XNN + VX
+//   QUIRK_VF_RESET      8XY1/8XY2/8XY3 clear VF
+//   QUIRK_WRAP_SPRITES  sprites wrap at the edges instead of clipping
+//   QUIRK_SCHIP         SUPER-CHIP opcodes: 00CN, 00FB-00FF, DXY0,
+//                       hires DXYN, FX30, FX75/FX85
+//   QUIRK_XO            XO-CHIP (CHIP8_XO builds only): 64K addresses,
+//                       F000 NNNN, FN01 planes, 00DN, 5XY2/5XY3, F002 and
+//                       FX3A audio. Needs QUIRK_SCHIP too.
+//   UNCHECKED           none of the masks below, for roms chip8verify.c
+//                       has proven stay in bounds (the "verified"
+//                       engine). The plain machine only, no quirks.
+//
+// Quirks are all #if or constant, so each copy only has its own code in
+// it. Everything is #undef'd at the end, ready for the next one.
+//
+// Every address is masked to the 4K (64K for XO-CHIP) on the way in
+// (MEM, pc, stack, key numbers), so whatever a rom does it can't touch
+// anything outside its own chip8_state. Past the end of memory wraps
+// round to 0, like I does.
+
+#ifndef QUIRK_SHIFT_VX
+#define QUIRK_SHIFT_VX 0
+#endif
+#ifndef QUIRK_LOADSTORE
+#define QUIRK_LOADSTORE 0
+#endif
+#ifndef QUIRK_JUMP_VX
+#define QUIRK_JUMP_VX 0
+#endif
+#ifndef QUIRK_VF_RESET
+#define QUIRK_VF_RESET 0
+#endif
+#ifndef QUIRK_WRAP_SPRITES
+#define QUIRK_WRAP_SPRITES 0
+#endif
+#ifndef QUIRK_SCHIP
+#define QUIRK_SCHIP 0
+#endif
+#ifndef QUIRK_XO
+#define QUIRK_XO 0
+#endif
+#ifndef UNCHECKED
+#define UNCHECKED 0
+#endif
+
+#ifdef PROFILE
+#define OPS_CAT2(a, b) a##_##b
+#define OPS_CAT(a, b) OPS_CAT2(a, b)
+#define OPCODE_FN OPS_CAT(emulate_opcode, PROFILE)
+#define CYCLE_FN OPS_CAT(emulate_cycle, PROFILE)
+#define RUN_FN OPS_CAT(run_cycles, PROFILE)
+#define OPS_LINKAGE static
+#else
+#define OPCODE_FN emulate_opcode
+#define CYCLE_FN emulate_cycle
+#define RUN_FN run_cycles
+#define OPS_LINKAGE
+#endif
+
+#define OPS_MASK (QUIRK_XO ? XO_ADDR_MASK : ADDR_MASK)
+#if UNCHECKED
+// Verified: pc, I and sp can't leave memory or the stack, so no masking
+#define MASKED(a, mask) (a)
+#else
+#define MASKED(a, mask) ((a) & (mask))
+#endif
+#define MEM(a) state->memory[MASKED(a, OPS_MASK)]
+#if QUIRK_XO
+// Skips hop over all of a double width F000 NNNN
+#define SKIP(state) ((state)->pc = ((state)->pc + \
+    (MEM((state)->pc) == 0xf0 && MEM((state)->pc + 1) == 0x00 ? 4 : 2)) & \
+    OPS_MASK)
+#else
+#define SKIP(state) ((state)->pc = MASKED((state)->pc + 2, OPS_MASK))
+#endif
+#define SHIFT_SRC (QUIRK_SHIFT_VX ? x : y)
+#define JUMP_REG (QUIRK_JUMP_VX ? x : 0)
+#if QUIRK_VF_RESET
+#define VF_RESET(state) ((state)->v[0xf] = 0)
+#else
+#define VF_RESET(state) ((void)0)
+#endif
+#if QUIRK_LOADSTORE
+#define LOADSTORE_STEP(state, x) \
+    ((state)->index_reg = ((state)->index_reg + (x) + QUIRK_LOADSTORE - 1) & \
+    OPS_MASK)
+#else
+#define LOADSTORE_STEP(state, x) ((void)0)
+#endif
+
+// Decode & emulate opcode. Mainly grouped by first nibble.
+// Expects state->pc to already point past the opcode (see emulate_cycle)
+// so jumps set it directly. Bad opcodes don't exit from here: they set
+// state->halted instead, and it's up to the caller (frontend, batch env)
+// what to do about it.
+OPS_LINKAGE void OPCODE_FN(chip8_state *state)
+{
+    unsigned short pc = (state->pc - 2) & OPS_MASK;
+    unsigned short opcode = state->opcode;
+
+    // Getting X & Y from opcodes is tricky and having a var to hold them
+    // is very nice, so we declare those up here.
+    // vx & vy are the values, set vx = 7 if register vx is holding 7.
+    // x & y are the indices. set x = 7 to mean register 7
+    unsigned char vx, vy;
+    unsigned char x = (opcode & 0xf00) >> 8;
+    unsigned char y = (opcode & 0x0f0) >> 4;
+
+    // NN & NNN are just masks w/o shifts so having vars isnt needed.
+
+    // Get just first nibble and switch on that.
+    // Shifts are 4 * nibbles moved bc 4 bits to a nibble
+    // (ie, this first shifts 0xa000 to 0xa by shifting 3*4 = 12)
+    switch ((opcode & 0xf000) >> 12)
+    {
+        case 0x0:
+            if (opcode == 0x00e0)
+            {
+                // 0x00e0: Clear screen
+                // This should do it, though is not tested yet
+                // unlikely to change from any change in SDL details
+                // really that'd be the point
+#if QUIRK_XO
+                // Only the selected planes
+                ext_clear(state);
+#else
+                memset(state->gfx, 0, sizeof(state->gfx));
+#if QUIRK_SCHIP
+                if (state->hires)
+                    memset(state->hgfx, 0, sizeof(state->hgfx));
+#endif
+                state->draw_flag = 1;
+#endif
+            }
+            else if (opcode == 0x00ee)
+            {
+                // 0x00ee: Return from subroutine
+                state->pc = MASKED(state->stack[MASKED(state->sp, 0xf)],
+                        OPS_MASK);
+                state->sp = MASKED(state->sp + 1, 0xf);
+            }
+#if QUIRK_SCHIP
+            else if ((opcode & 0xfff0) == 0x00c0 ||
+                    (QUIRK_XO && (opcode & 0xfff0) == 0x00d0) ||
+                    (opcode >= 0x00fb && opcode <= 0x00ff))
+                // Scrolls, exit, lores/hires: see chip8core.c
+                ext_system(state, pc, opcode);
+#endif
+            else
+                // 0x0NNN Call RCA 1802 program (probably don't need)
+                halt_vm(state, pc, HALT_UNIMPLEMENTED);
+            break;
+        case 0x1:
+            // 1NNN: GOTO NNN
+            state->pc = opcode & 0xfff;
+            break;
+        case 0x2:
+            // 2NNN: Call subroutine
+            state->sp = MASKED(state->sp - 1, 0xf);
+            state->stack[state->sp] = state->pc;
+            state->pc = opcode & 0xfff;
+            break;
+        case 0x3:
+            // 0x3XNN: Skip next instruction if VX == NN
+            vx  = state->v[x];
+            if (vx == (opcode & 0xff))
+                SKIP(state);
+            break;
+        case 0x4:
+            // 0x4XNN: Skip next instruction if VX != NN
+            vx  = state->v[x];
+            if (vx != (opcode & 0xff))
+                SKIP(state);
+            break;
+        case 0x5:
+#if QUIRK_XO
+            // 0x5XY2/0x5XY3: Save/load VX to VY (either way round) at I,
+            // leaving I alone
+            if ((opcode & 0xe) == 0x2)
+            {
+                int step = x <= y ? 1 : -1;
+                for (int i = 0; i <= (x - y) * -step; i++)
+                {
+                    if (opcode & 1)
+                        state->v[x + i * step] = MEM(state->index_reg + i);
+                    else
+                        MEM(state->index_reg + i) = state->v[x + i * step];
+                }
+                break;
+            }
+#endif
+            // 0x5XY0: Skip next instruction if VX == VY
+            // opcode must end in 0 or isn't valid
+            if ((opcode & 0xf) != 0)
+            {
+                halt_vm(state, pc, HALT_INVALID);
+                break;
+            }
+            vx  = state->v[x];
+            vy  = state->v[y];
+            if (vx == vy)
+                SKIP(state);
+            break;
+        case 0x6:
+            // 0x6XNN: Sets VX to NN
+            state->v[x] = (opcode & 0xff);
+            break;
+        case 0x7:
+            // 0x7XNN: Increment VX by NN
+            vx = state->v[x];
+            state->v[x] = (vx + (opcode & 0xff)) & 0xff;
+            break;
+        case 0x8:
+            // 0x8*** is messier than the neat categories so far.
+            // operates on VX and VY depending on last hex digit
+            switch (opcode & 0xf)
+            {
+                case 0x0:
+                    // 0x8XY0: Assign VX to value in VY
+                    vy = state->v[y];
+                    state->v[x] = vy;
+                    break;
+                case 0x1:
+                    // 0x8XY1: OR: VX = VX | VY
+                    vx = state->v[x];
+                    vy = state->v[y];
+                    state->v[x] = (vx | vy);
+                    VF_RESET(state);
+                    break;
+                case 0x2:
+                    // 0x8XY2: AND: VX = VX & VY
+                    vx = state->v[x];
+                    vy = state->v[y];
+                    state->v[x] = (vx & vy);
+                    VF_RESET(state);
+                    break;
+                case 0x3:
+                    // 0x8XY3: XOR: VX = VX ^ VY
+                    vx = state->v[x];
+                    vy = state->v[y];
+                    state->v[x] = (vx ^ vy);
+                    VF_RESET(state);
+                    break;
+                case 0x4:
+                    // 0x8XY4: Increment VX by VY
+                    vx = state->v[x];
+                    vy = state->v[y];
+                    state->v[x] = (vx + vy) & 0xff;
+                    break;
+                case 0x5:
+                    // 0x8XY5: Decrement VX by VY
+                    vx = state->v[x];
+                    vy = state->v[y];
+                    state->v[x] = (vx - vy) & 0xff;
+                    break;
+                case 0x6:
+                    // 0x8XY6: Shift VY right by one and set into VX
+                    // Set VF to VY's pre shift LSB
+                    // This behavior changed in 48 and Super: they shift
+                    // VX in place (QUIRK_SHIFT_VX)
+                    // (VY read once, it may be VF)
+                    vy = state->v[SHIFT_SRC];
+                    state->v[0xf] = vy & 1;
+                    state->v[x] = vy >> 1;
+                    break;
+                case 0x7:
+                    // 0x8XY7: LESS: VX = VY - VX
+                    vx = state->v[x];
+                    vy = state->v[y];
+                    state->v[x] = (vy - vx) & 0xff;
+                    break;
+                // No 0x8XY8 - 0x8XYd, or *f
+                case 0xe:
+                    // 0x8XYe: Shifts VY left by one and stores in VX
+                    // SET VF to VY's pre shift MSB
+                    // Like 0x8XY6, was patched in -48 and Super
+                    vy = state->v[SHIFT_SRC];
+                    state->v[0xf] = (vy & 0x80) >> 7;
+                    state->v[x] = (vy << 1) & 0xff;
+                    break;
+                default:
+                    halt_vm(state, pc, HALT_INVALID);
+            }
+            break;
+        // (Back to first nibble decoding)
+        case 0x9:
+            // 0x9XY0: Skip next instruction if VX != VY
+            // opcode must end in 0 or isn't valid
+            if ((opcode & 0xf) != 0)
+            {
+                halt_vm(state, pc, HALT_INVALID);
+                break;
+            }
+            vx  = state->v[x];
+            vy  = state->v[y];
+            if (vx != vy)
+                SKIP(state);
+            break;
+        case 0xa:
+            // 0xaNNN: Set index register (I) to adress NNN
+            state->index_reg = opcode & 0xfff;
+            break;
+        case 0xb:
+            // 0xbNNN: Jump PC to address V0 + NNN
+            // (-48 and Super read it as BXNN: VX + XNN)
+            vx = state->v[JUMP_REG];
+            state->pc = (vx + (opcode & 0xfff)) & OPS_MASK;
+            break;
+        case 0xc:
+            // 0xcXNN: Set VX to random number between 0 and 255,
+            // bitmasked by AND with NN
+            // xorshift32 kept in the state, so runs are reproducible
+            // and vms on different threads don't share rand()'s lock
+            state->rng ^= state->rng << 13;
+            state->rng ^= state->rng >> 17;
+            state->rng ^= state->rng << 5;
+            state->v[x] = (state->rng >> 24) & (opcode & 0xff);
+            break;
+        case 0xd:
+            // 0xdXYN:
+            // Draw sprite of N height at address in I
+            // to coords VX, VY (all sprites are 8 bits wide)
+            // Start coords wrap around the screen, the sprite itself is
+            // clipped at the right and bottom edges (like the VIP), or
+            // wraps too with QUIRK_WRAP_SPRITES (XO-CHIP).
+#if QUIRK_SCHIP
+            // Hires, and 16x16 sprites in either mode (and all XO-CHIP
+            // drawing, being on planes)
+            if (QUIRK_XO || state->hires || (opcode & 0xf) == 0)
+            {
+                state->v[0xf] = ext_draw(state, state->v[x], state->v[y],
+                        opcode & 0xf, QUIRK_WRAP_SPRITES, OPS_MASK);
+                state->draw_flag = 1;
+                break;
+            }
+#endif
+            vx = state->v[x] & (GFX_W - 1);
+            vy = state->v[y] & (GFX_H - 1);
+            uint64_t row, hit = 0;
+#if QUIRK_WRAP_SPRITES
+            for (int i = 0; i < (opcode & 0xf); i++)
+            {
+                // Rotate instead of shift, so the right edge comes back
+                // in on the left
+                row = (uint64_t)MEM(state->index_reg + i) << 56;
+                row = vx ? row >> vx | row << (64 - vx) : row;
+                int r = (vy + i) & (GFX_H - 1);
+                hit |= state->gfx[r] & row;
+                state->gfx[r] ^= row;
+                PROF_SPRITE(state, state->index_reg + i, 1);
+            }
+#else
+            for (int i = 0; i < (opcode & 0xf) && vy + i < GFX_H; i++)
+            {
+                // Line the sprite byte up with the top of the word, then
+                // shift it over to x. Anything past the edge falls off.
+                row = ((uint64_t)MEM(state->index_reg + i) << 56) >> vx;
+                // Any bit on in both means a flip from 1 to 0
+                hit |= state->gfx[vy + i] & row;
+                state->gfx[vy + i] ^= row;
+                PROF_SPRITE(state, state->index_reg + i, 1);
+            }
+#endif
+            state->v[0xf] = hit != 0;
+            state->draw_flag = 1;
+            break;
+        case 0xe:
+            // recall: state->key[_vx_value_] = 0 if up, else 1
+            // 0xeX9e: Skip next instruction if key stored in VX is pressed:
+            vx = state->v[x];
+            if ((opcode & 0xff) == 0x9e)
+            {
+                if (state->key[vx & 0xf] != 0)
+                    SKIP(state);
+            }
+            // 0xeXa1: Skip next instruction if key NOT pressed:
+            else if ((opcode & 0xff) == 0xa1)
+            {
+                if (state->key[vx & 0xf] == 0)
+                    SKIP(state);
+            }
+            else
+                halt_vm(state, pc, HALT_INVALID);
+            break;
+        case 0xf:
+            // Another messy one, depends on last 2 digits
+            switch (opcode & 0xff)
+            {
+#if QUIRK_XO
+                case 0x00:
+                    // 0xf000 NNNN: Set I to NNNN, the next word
+                    if (x != 0)
+                    {
+                        halt_vm(state, pc, HALT_INVALID);
+                        break;
+                    }
+                    state->index_reg = MEM(state->pc) << 8 |
+                        MEM(state->pc + 1);
+                    state->pc = (state->pc + 2) & OPS_MASK;
+                    break;
+                case 0x01:
+                    // 0xfN01: Draw to planes N (bit 0 plane 1, bit 1 plane 2)
+                    state->planes = x & 3;
+                    break;
+                case 0x02:
+                    // 0xf002: Load the 16 byte audio pattern from I
+                    if (x != 0)
+                    {
+                        halt_vm(state, pc, HALT_INVALID);
+                        break;
+                    }
+                    for (int i = 0; i < 16; i++)
+                        state->pattern[i] = MEM(state->index_reg + i);
+                    break;
+                case 0x3a:
+                    // 0xfX3A: Pattern pitch to VX, played at
+                    // 4000 * 2^((VX - 64) / 48) samples a second
+                    state->pitch = state->v[x];
+                    break;
+#endif
+                case 0x07:
+                    // 0xfX07: Set VX to value of delay timer
+                    state->v[x] = state->delay_timer;
+                    break;
+                case 0x0a:
+                    // 0xfX0a: Wait for keypress, then store it in VX
+                    // Doesn't block: if nothing is down, rewind pc so this
+                    // opcode runs again next cycle, after keys are updated.
+                    state->key_flag = 0xff;
+                    for (int i=0x0; i<= 0xf; i++)
+                    {
+                        if (state->key[i] != 0)
+                        {
+                            state->v[x] = i;
+                            state->key_flag = i;
+                            break;
+                        }
+                    }
+                    if (state->key_flag == 0xff)
+                        state->pc = pc;
+                    break;
+                case 0x15:
+                    // 0xfX15: Set delay timer to VX
+                    state->delay_timer = state->v[x];
+                    break;
+                case 0x18:
+                    // 0xfX18: Set sound timer to VX
+                    state->sound_timer = state->v[x];
+                    break;
+                case 0x1e:
+                    // 0xfX1e: Add VX to I Set VF to if overflowed
+                    vx = state->v[x];
+#if QUIRK_XO
+                    // 16 bit I, and no VF
+                    state->index_reg = (state->index_reg + vx) & OPS_MASK;
+#else
+                    state->index_reg = state->index_reg + vx;
+                    // I > 0xfff iff overflow happened
+                    state->v[0xf] = state->index_reg > 0xfff ? 1 : 0;
+                    state->index_reg &= 0xfff;
+#endif
+                    break;
+                case 0x29:
+                    // 0xfX29: sets I to the built-in sprite address for the
+                    // character stored in VX
+                    // sprite for char 0xX starts at 0x50 + 0x5 * X
+                    state->index_reg = 0x50 + (0x5 * state->v[x]);
+                    break;
+#if QUIRK_SCHIP
+                case 0x30:
+                    // 0xfX30: I to the 8x10 digit for VX, 10 bytes each
+                    // from 0xa0
+                    state->index_reg = 0xa0 + 10 * (state->v[x] & 0xf);
+                    break;
+                case 0x75:
+                    // 0xfX75: Save V0 to VX in the RPL flags
+                    memcpy(state->rpl, state->v, x + 1);
+                    break;
+                case 0x85:
+                    // 0xfX85: And load them back
+                    memcpy(state->v, state->rpl, x + 1);
+                    break;
+#endif
+                case 0x33:
+                    // 0xfX33: Stores BCD of VX starting at I
+                    // eg, if opcode is 0xfa33, and VA holds 0xff
+                    // then put 0x2 in I, 0x5 in I+1, and 0x5 in I+2
+                    // VX itself is left alone
+                    vx = state->v[x];
+                    MEM(state->index_reg + 2) = vx % 10;
+                    MEM(state->index_reg + 1) = vx / 10 % 10;
+                    MEM(state->index_reg) = vx / 100;
+                    PROF_WRITE(state, state->index_reg, 3);
+                    break;
+                case 0x55:
+                    // 0xfX55: Stores registers V0 to & incl. VX into memory
+                    // Starting by storing V0 at address stored in I
+                    // then V[N] at I + N
+                    for (int i = 0; i <= x; i++)
+                    {
+                        MEM(state->index_reg + i) = state->v[i];
+                    }
+                    PROF_WRITE(state, state->index_reg, x + 1);
+                    LOADSTORE_STEP(state, x);
+                    break;
+                case 0x65:
+                    // 0xfX65: Loads registers v0 to & incl. VX from memory
+                    // Starting by loading V0 from address stored in I
+                    // then V[N] from I + N
+                    for (int i = 0; i <= x; i++)
+                    {
+                        state->v[i] = MEM(state->index_reg + i);
+                    }
+                    PROF_READ(state, state->index_reg, x + 1);
+                    LOADSTORE_STEP(state, x);
+                    break;
+                default:
+                    // Invalid opcode starting with 0xf
+                    halt_vm(state, pc, HALT_INVALID);
+            }
+            break;
+    }
+}
+
+
+// Fetch the opcode at pc, step pc past it, and emulate it
+OPS_LINKAGE void CYCLE_FN(chip8_state *state)
+{
+    // Everything that sets pc masks it, this is for states from outside
+    state->pc = MASKED(state->pc, OPS_MASK);
+    TRACE_BEGIN(state, tr);
+    state->opcode = MEM(state->pc) << 8 | MEM(state->pc + 1);
+    PROF_EXEC(state, state->pc, state->opcode);
+    state->pc = MASKED(state->pc + 2, OPS_MASK);
+    HOSTPERF_BEGIN(t);
+    OPCODE_FN(state);
+    HOSTPERF_END(t, op_class(state->opcode));
+    TRACE_END(state, tr);
+}
+
+// Run up to cycles instructions, stopping early if the vm halts.
+// Returns how many were run.
+OPS_LINKAGE long RUN_FN(chip8_state *state, long cycles)
+{
+    long n;
+    for (n = 0; n < cycles && !state->halted; n++)
+        CYCLE_FN(state);
+    return n;
+}
+
+#undef OPCODE_FN
+#undef CYCLE_FN
+#undef RUN_FN
+#undef OPS_LINKAGE
+#undef OPS_MASK
+#undef MASKED
+#undef MEM
+#undef SKIP
+#undef SHIFT_SRC
+#undef JUMP_REG
+#undef VF_RESET
+#undef LOADSTORE_STEP
+#undef QUIRK_SHIFT_VX
+#undef QUIRK_LOADSTORE
+#undef QUIRK_JUMP_VX
+#undef QUIRK_VF_RESET
+#undef QUIRK_WRAP_SPRITES
+#undef QUIRK_SCHIP
+#undef QUIRK_XO
+#undef UNCHECKED
+#undef PROFILE
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chip8prof.h"
+
+chip8_prof * prof_create(void)
+{
+    return calloc(1, sizeof(chip8_prof));
+}
+
+void prof_exec(chip8_prof *prof, unsigned short pc, unsigned short opcode)
+{
+    prof->total++;
+    prof->op_count[op_class(opcode)]++;
+    prof->pc_count[pc & 0xfff]++;
+}
+
+// n bytes from addr. Wraps at the end of memory rather than run off it.
+void prof_read(chip8_prof *prof, unsigned short addr, int n)
+{
+    for (int i = 0; i < n; i++)
+        prof->mem_reads[(addr + i) & 0xfff]++;
+}
+
+void prof_write(chip8_prof *prof, unsigned short addr, int n)
+{
+    for (int i = 0; i < n; i++)
+        prof->mem_writes[(addr + i) & 0xfff]++;
+}
+
+// DXYN's sprite fetches: reads, and sprite reads
+void prof_sprite(chip8_prof *prof, unsigned short addr, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        prof->mem_reads[(addr + i) & 0xfff]++;
+        prof->sprite_reads[(addr + i) & 0xfff]++;
+    }
+}
+
+// The opcode at pc, as memory holds it now
+static unsigned short opcode_at(const unsigned char *memory, int pc)
+{
+    return memory[pc] << 8 | memory[(pc + 1) & 0xfff];
+}
+
+// One table, told apart by the kind column:
+//   class,<pattern>,<count>,,,<mnemonic>
+//   pc,<addr>,<count>,,,<disassembly>
+//   mem,<addr>,,<reads>,<writes>,
+//   sprite,<addr>,<count>,,,       (reads of it by DXYN)
+// Only rows with something counted are written.
+void prof_save_csv(chip8_prof *prof, const unsigned char *memory, FILE *out)
+{
+    char text[MNEMONIC_LEN];
+    fprintf(out, "kind,key,count,reads,writes,text\n");
+    for (int c = 0; c < NUM_OP_CLASSES; c++)
+        if (prof->op_count[c] != 0)
+            fprintf(out, "class,%s,%llu,,,%s\n", op_class_pattern(c),
+                    prof->op_count[c], op_class_mnemonic(c));
+    for (int pc = 0; pc < 4096; pc++)
+    {
+        if (prof->pc_count[pc] == 0)
+            continue;
+        format_opcode(opcode_at(memory, pc), text);
+        fprintf(out, "pc,0x%03x,%llu,,,%s\n", pc, prof->pc_count[pc], text);
+    }
+    for (int a = 0; a < 4096; a++)
+        if (prof->mem_reads[a] != 0 || prof->mem_writes[a] != 0)
+            fprintf(out, "mem,0x%03x,,%llu,%llu,\n", a,
+                    prof->mem_reads[a], prof->mem_writes[a]);
+    for (int a = 0; a < 4096; a++)
+        if (prof->sprite_reads[a] != 0)
+            fprintf(out, "sprite,0x%03x,%llu,,,\n", a, prof->sprite_reads[a]);
+}
+
+void prof_save_json(chip8_prof *prof, const unsigned char *memory, FILE *out)
+{
+    char text[MNEMONIC_LEN];
+    const char *sep = "";
+    fprintf(out, "{\"total\": %llu,\n \"classes\": [", prof->total);
+    for (int c = 0; c < NUM_OP_CLASSES; c++)
+    {
+        if (prof->op_count[c] == 0)
+            continue;
+        fprintf(out, "%s\n  {\"pattern\": \"%s\", \"mnemonic\": \"%s\", "
+                "\"count\": %llu}", sep, op_class_pattern(c),
+                op_class_mnemonic(c), prof->op_count[c]);
+        sep = ",";
+    }
+    fprintf(out, "],\n \"pcs\": [");
+    sep = "";
+    for (int pc = 0; pc < 4096; pc++)
+    {
+        if (prof->pc_count[pc] == 0)
+            continue;
+        unsigned short opcode = opcode_at(memory, pc);
+        format_opcode(opcode, text);
+        fprintf(out, "%s\n  {\"addr\": %i, \"count\": %llu, "
+                "\"opcode\": \"%04x\", \"text\": \"%s\"}", sep, pc,
+                prof->pc_count[pc], opcode, text);
+        sep = ",";
+    }
+    fprintf(out, "],\n \"memory\": [");
+    sep = "";
+    for (int a = 0; a < 4096; a++)
+    {
+        if (prof->mem_reads[a] == 0 && prof->mem_writes[a] == 0)
+            continue;
+        fprintf(out, "%s\n  {\"addr\": %i, \"reads\": %llu, \"writes\": %llu, "
+                "\"sprite_reads\": %llu}", sep, a, prof->mem_reads[a],
+                prof->mem_writes[a], prof->sprite_reads[a]);
+        sep = ",";
+    }
+    fprintf(out, "]}\n");
+}
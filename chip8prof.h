@@ -0,0 +1,51 @@
+#ifndef CHIP8PROF_H_INC
+#define CHIP8PROF_H_INC
+
+#include <stdio.h>
+
+#include "chip8vm.h"
+#include "chip8dis.h"
+
+// Guest profiler: what the rom spends its instructions on. Counts runs
+// per instruction class and per pc, and reads/writes per memory byte
+// from 0xfX55, 0xfX65, 0xfX33 and 0xdXYN sprite fetches (sprite reads are
+// counted on their own too, so disasm -prof can tell sprites from tables).
+//
+// The hooks only exist in builds with CHIP8_PROFILE defined (make
+// chip8vm-prof); without it they compile to nothing. With it, they do
+// nothing until a profile is attached to state->prof.
+
+typedef struct chip8_prof {
+    unsigned long long total;
+    unsigned long long op_count[NUM_OP_CLASSES];
+    unsigned long long pc_count[4096];
+    unsigned long long mem_reads[4096];
+    unsigned long long mem_writes[4096];
+    unsigned long long sprite_reads[4096];
+} chip8_prof;
+
+chip8_prof * prof_create(void);
+void prof_exec(chip8_prof *prof, unsigned short pc, unsigned short opcode);
+void prof_read(chip8_prof *prof, unsigned short addr, int n);
+void prof_write(chip8_prof *prof, unsigned short addr, int n);
+void prof_sprite(chip8_prof *prof, unsigned short addr, int n);
+void prof_save_csv(chip8_prof *prof, const unsigned char *memory, FILE *out);
+void prof_save_json(chip8_prof *prof, const unsigned char *memory, FILE *out);
+
+#ifdef CHIP8_PROFILE
+#define PROF_EXEC(state, pc, opcode) \
+    do { if ((state)->prof) prof_exec((state)->prof, pc, opcode); } while (0)
+#define PROF_READ(state, addr, n) \
+    do { if ((state)->prof) prof_read((state)->prof, addr, n); } while (0)
+#define PROF_WRITE(state, addr, n) \
+    do { if ((state)->prof) prof_write((state)->prof, addr, n); } while (0)
+#define PROF_SPRITE(state, addr, n) \
+    do { if ((state)->prof) prof_sprite((state)->prof, addr, n); } while (0)
+#else
+#define PROF_EXEC(state, pc, opcode) ((void)0)
+#define PROF_READ(state, addr, n) ((void)0)
+#define PROF_WRITE(state, addr, n) ((void)0)
+#define PROF_SPRITE(state, addr, n) ((void)0)
+#endif
+
+#endif
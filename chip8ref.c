@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h> // for memset, memcmp
+
+#include "chip8ref.h"
+
+#define MEM(a) state->memory[(a) & 0xfff]
+
+// Run one instruction. Returns 1, or 0 if the vm is halted.
+int ref_step(chip8_state *state)
+{
+    if (state->halted)
+        return 0;
+
+    unsigned short at = state->pc & 0xfff;
+    unsigned short op = MEM(at) << 8 | MEM(at + 1);
+    state->opcode = op;
+
+    // Fields
+    int n1 = op >> 12, x = (op >> 8) & 0xf, y = (op >> 4) & 0xf;
+    int n = op & 0xf, nn = op & 0xff, nnn = op & 0xfff;
+    unsigned char vx = state->v[x], vy = state->v[y];
+
+    // Where we go next, unless the opcode says otherwise
+    unsigned short next = (at + 2) & 0xfff;
+    unsigned short skip = (at + 4) & 0xfff;
+    unsigned char halt = HALT_NONE;
+
+    if (op == 0x00e0)
+    {
+        memset(state->gfx, 0, sizeof(state->gfx));
+        state->draw_flag = 1;
+    }
+    else if (op == 0x00ee)
+    {
+        next = state->stack[state->sp & 0xf] & 0xfff;
+        state->sp = (state->sp + 1) & 0xf;
+    }
+    else if (n1 == 0x0)
+        halt = HALT_UNIMPLEMENTED;
+    else if (n1 == 0x1)
+        next = nnn;
+    else if (n1 == 0x2)
+    {
+        state->sp = (state->sp - 1) & 0xf;
+        state->stack[state->sp] = next;
+        next = nnn;
+    }
+    else if (n1 == 0x3)
+        next = vx == nn ? skip : next;
+    else if (n1 == 0x4)
+        next = vx != nn ? skip : next;
+    else if (n1 == 0x5 && n == 0)
+        next = vx == vy ? skip : next;
+    else if (n1 == 0x6)
+        state->v[x] = nn;
+    else if (n1 == 0x7)
+        state->v[x] = vx + nn;
+    else if (n1 == 0x8)
+    {
+        // Result first, then the flag (if any), then VX: so with X = F
+        // the result is what's left in VF
+        int result = 0, flag = -1;
+        switch (n)
+        {
+            case 0x0: result = vy; break;
+            case 0x1: result = vx | vy; break;
+            case 0x2: result = vx & vy; break;
+            case 0x3: result = vx ^ vy; break;
+            case 0x4: result = vx + vy; break;
+            case 0x5: result = vx - vy; break;
+            case 0x6: result = vy >> 1; flag = vy & 1; break;
+            case 0x7: result = vy - vx; break;
+            case 0xe: result = vy << 1; flag = vy >> 7; break;
+            default: halt = HALT_INVALID;
+        }
+        if (!halt)
+        {
+            if (flag >= 0)
+                state->v[0xf] = flag;
+            state->v[x] = result & 0xff;
+        }
+    }
+    else if (n1 == 0x9 && n == 0)
+        next = vx != vy ? skip : next;
+    else if (n1 == 0xa)
+        state->index_reg = nnn;
+    else if (n1 == 0xb)
+        next = (state->v[0] + nnn) & 0xfff;
+    else if (n1 == 0xc)
+    {
+        uint32_t r = state->rng;
+        r ^= r << 13;
+        r ^= r >> 17;
+        r ^= r << 5;
+        state->rng = r;
+        state->v[x] = (r >> 24) & nn;
+    }
+    else if (n1 == 0xd)
+    {
+        // Pixel by pixel: start wraps, the sprite clips
+        int x0 = vx % GFX_W, y0 = vy % GFX_H, hit = 0;
+        for (int row = 0; row < n && y0 + row < GFX_H; row++)
+        {
+            unsigned char bits = MEM(state->index_reg + row);
+            for (int col = 0; col < 8 && x0 + col < GFX_W; col++)
+            {
+                if (!(bits & (0x80 >> col)))
+                    continue;
+                uint64_t pixel = (uint64_t)1 << (GFX_W - 1 - (x0 + col));
+                if (state->gfx[y0 + row] & pixel)
+                    hit = 1;
+                state->gfx[y0 + row] ^= pixel;
+            }
+        }
+        state->v[0xf] = hit;
+        state->draw_flag = 1;
+    }
+    else if (n1 == 0xe && nn == 0x9e)
+        next = state->key[vx & 0xf] ? skip : next;
+    else if (n1 == 0xe && nn == 0xa1)
+        next = !state->key[vx & 0xf] ? skip : next;
+    else if (n1 == 0xf && nn == 0x07)
+        state->v[x] = state->delay_timer;
+    else if (n1 == 0xf && nn == 0x0a)
+    {
+        // Lowest key down, or run this again
+        state->key_flag = 0xff;
+        for (int k = 15; k >= 0; k--)
+            if (state->key[k])
+                state->key_flag = k;
+        if (state->key_flag == 0xff)
+            next = at;
+        else
+            state->v[x] = state->key_flag;
+    }
+    else if (n1 == 0xf && nn == 0x15)
+        state->delay_timer = vx;
+    else if (n1 == 0xf && nn == 0x18)
+        state->sound_timer = vx;
+    else if (n1 == 0xf && nn == 0x1e)
+    {
+        int sum = state->index_reg + vx;
+        state->v[0xf] = sum > 0xfff;
+        state->index_reg = sum & 0xfff;
+    }
+    else if (n1 == 0xf && nn == 0x29)
+        state->index_reg = (0x50 + 5 * vx) & 0xfff;
+    else if (n1 == 0xf && nn == 0x33)
+    {
+        MEM(state->index_reg) = vx / 100;
+        MEM(state->index_reg + 1) = vx / 10 % 10;
+        MEM(state->index_reg + 2) = vx % 10;
+    }
+    else if (n1 == 0xf && nn == 0x55)
+        for (int i = 0; i <= x; i++)
+            MEM(state->index_reg + i) = state->v[i];
+    else if (n1 == 0xf && nn == 0x65)
+        for (int i = 0; i <= x; i++)
+            state->v[i] = MEM(state->index_reg + i);
+    else
+        halt = HALT_INVALID;
+
+    if (halt)
+    {
+        state->halted = halt;
+        next = at;
+    }
+    state->pc = next;
+    return 1;
+}
+
+long ref_run_cycles(chip8_state *state, long cycles)
+{
+    long n;
+    for (n = 0; n < cycles && ref_step(state); n++)
+        ;
+    return n;
+}
+
+// Name of the first field that differs (and both values) into what.
+// full also checks memory and gfx. Returns 0 if they're the same.
+int ref_diff(const chip8_state *a, const chip8_state *b, int full,
+        char *what)
+{
+#define DIFF(cond, ...) \
+    do { if (cond) { snprintf(what, REF_DIFF_LEN, __VA_ARGS__); \
+        return 1; } } while (0)
+    DIFF(a->halted != b->halted, "halted %i vs %i", a->halted, b->halted);
+    DIFF(a->pc != b->pc, "pc %03x vs %03x", a->pc, b->pc);
+    for (int i = 0; i < 16; i++)
+        DIFF(a->v[i] != b->v[i], "V%X %02x vs %02x", i, a->v[i], b->v[i]);
+    DIFF(a->index_reg != b->index_reg, "I %03x vs %03x", a->index_reg,
+            b->index_reg);
+    DIFF(a->sp != b->sp, "sp %x vs %x", a->sp, b->sp);
+    DIFF(a->delay_timer != b->delay_timer, "delay timer %02x vs %02x",
+            a->delay_timer, b->delay_timer);
+    DIFF(a->sound_timer != b->sound_timer, "sound timer %02x vs %02x",
+            a->sound_timer, b->sound_timer);
+    DIFF(a->rng != b->rng, "rng %08x vs %08x", a->rng, b->rng);
+    DIFF(a->key_flag != b->key_flag, "key flag %02x vs %02x", a->key_flag,
+            b->key_flag);
+    if (!full)
+        return 0;
+    if (memcmp(a->stack, b->stack, sizeof(a->stack)) == 0 &&
+            memcmp(a->memory, b->memory, sizeof(a->memory)) == 0 &&
+            memcmp(a->gfx, b->gfx, sizeof(a->gfx)) == 0 &&
+            a->draw_flag == b->draw_flag)
+        return 0;
+    for (int i = 0; i < 16; i++)
+        DIFF(a->stack[i] != b->stack[i], "stack[%i] %03x vs %03x", i,
+                a->stack[i], b->stack[i]);
+    for (int i = 0; i < 4096; i++)
+        DIFF(a->memory[i] != b->memory[i], "memory[%03x] %02x vs %02x", i,
+                a->memory[i], b->memory[i]);
+    for (int y = 0; y < GFX_H; y++)
+        DIFF(a->gfx[y] != b->gfx[y], "gfx row %i", y);
+    DIFF(a->draw_flag != b->draw_flag, "draw flag %i vs %i", a->draw_flag,
+            b->draw_flag);
+    return 0;
+#undef DIFF
+}
+
+const chip8_engine ref_engine = {"ref", ref_run_cycles};
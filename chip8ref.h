@@ -0,0 +1,25 @@
+#ifndef CHIP8REF_H_INC
+#define CHIP8REF_H_INC
+
+#include "chip8vm.h"
+
+// Reference model: a second, plain CHIP-8 written apart from
+// emulate_opcode(), to check the real engines against (fuzzer, property
+// tests). It is meant to be obviously right rather than fast: it works
+// out every opcode from its fields and writes the results at the end.
+//
+// It follows the core's documented behaviour (see chip8core.c), and
+// keeps every access in range: addresses wrap at 0xfff, key numbers
+// at 0xf.
+
+// Room for ref_diff()'s description
+#define REF_DIFF_LEN 64
+
+int ref_step(chip8_state *state);
+long ref_run_cycles(chip8_state *state, long cycles);
+int ref_diff(const chip8_state *a, const chip8_state *b, int full,
+        char *what);
+
+extern const chip8_engine ref_engine;
+
+#endif
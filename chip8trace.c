@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memcpy
+
+#include "chip8trace.h"
+
+// Open a trace file. Returns NULL if it can't be created.
+chip8_trace * trace_open(const char *filename)
+{
+    chip8_trace *trace = malloc(sizeof(chip8_trace));
+    if (trace == NULL)
+        return NULL;
+    trace->out = fopen(filename, "wb");
+    if (trace->out == NULL)
+    {
+        free(trace);
+        return NULL;
+    }
+    // Chunks are already big, stdio buffering would only add a copy
+    setvbuf(trace->out, NULL, _IONBF, 0);
+    trace->cycle = 0;
+    trace->chunk_cycle = 0;
+    trace->chunk_pc = trace->last_pc = 0x200 - 2;
+    trace->records = 0;
+    trace->len = 0;
+    return trace;
+}
+
+static unsigned char * put_varint(unsigned char *p, uint32_t n)
+{
+    while (n >= 0x80)
+    {
+        *p++ = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    *p++ = n;
+    return p;
+}
+
+static void put_le(unsigned char *p, uint64_t n, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        p[i] = n >> (8 * i);
+}
+
+// Append one instruction: pc it ran at, and registers before and after
+void trace_record(chip8_trace *trace, unsigned short pc,
+        unsigned short opcode, const unsigned char *v_before,
+        const unsigned char *v_after)
+{
+    if (trace->len > TRACE_CHUNK - TRACE_HEADER_LEN - TRACE_MAX_RECORD)
+        trace_flush(trace);
+
+    // Records go after room for the chunk header
+    unsigned char *p = trace->buf + TRACE_HEADER_LEN + trace->len;
+    int delta = (int)pc - (trace->last_pc + 2);
+    p = put_varint(p, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+    *p++ = opcode >> 8;
+    *p++ = opcode & 0xff;
+
+    unsigned int mask = 0;
+    for (int i = 0; i < 16; i++)
+        if (v_before[i] != v_after[i])
+            mask |= 1 << i;
+    p = put_varint(p, mask);
+    for (int i = 0; mask != 0; i++, mask >>= 1)
+        if (mask & 1)
+            *p++ = v_after[i];
+
+    trace->len = p - (trace->buf + TRACE_HEADER_LEN);
+    trace->last_pc = pc;
+    trace->records++;
+    trace->cycle++;
+}
+
+// Write out what's buffered as one chunk, in one write
+void trace_flush(chip8_trace *trace)
+{
+    if (trace->records == 0)
+        return;
+    unsigned char *header = trace->buf;
+    memcpy(header, TRACE_MAGIC, 4);
+    put_le(header + 4, trace->len, 4);
+    put_le(header + 8, trace->records, 4);
+    put_le(header + 12, trace->chunk_cycle, 8);
+    put_le(header + 20, trace->chunk_pc, 2);
+    fwrite(trace->buf, 1, TRACE_HEADER_LEN + trace->len, trace->out);
+
+    trace->chunk_cycle = trace->cycle;
+    trace->chunk_pc = trace->last_pc;
+    trace->records = 0;
+    trace->len = 0;
+}
+
+void trace_close(chip8_trace *trace)
+{
+    if (trace == NULL)
+        return;
+    trace_flush(trace);
+    fclose(trace->out);
+    free(trace);
+}
@@ -0,0 +1,60 @@
+#ifndef CHIP8TRACE_H_INC
+#define CHIP8TRACE_H_INC
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "chip8vm.h"
+
+// Binary execution trace: one record per instruction, packed into a big
+// buffer and written out a chunk at a time. A trace belongs to one vm
+// (state->trace), and a vm only ever runs on one thread at a time, so
+// records go in with no locking. Decode with tracedump.
+//
+// File: chunks, each a header and then len bytes of records.
+//   header: "C8TR", u32 len, u32 records, u64 first cycle, u16 pc before
+//           (little endian)
+//   record: varint zigzag(pc - (last pc + 2)), opcode (2 bytes, big
+//           endian), varint mask of registers changed, then the new value
+//           of each changed register, lowest first.
+// So a straight line instruction that sets one register is 5 bytes.
+// Chunks decode on their own: the pc delta restarts from the header.
+
+#define TRACE_MAGIC "C8TR"
+#define TRACE_HEADER_LEN 22
+#define TRACE_CHUNK (1 << 20)
+// Worst case record: 3 + 2 + 3 + 16
+#define TRACE_MAX_RECORD 24
+
+typedef struct chip8_trace {
+    FILE *out;
+    uint64_t cycle;         // instructions traced so far
+    uint64_t chunk_cycle;   // cycle of the chunk's first record
+    unsigned short chunk_pc;
+    unsigned short last_pc;
+    uint32_t records;
+    size_t len;             // bytes of records in buf
+    unsigned char buf[TRACE_CHUNK]; // chunk header, then the records
+} chip8_trace;
+
+chip8_trace * trace_open(const char *filename);
+void trace_record(chip8_trace *trace, unsigned short pc,
+        unsigned short opcode, const unsigned char *v_before,
+        const unsigned char *v_after);
+void trace_flush(chip8_trace *trace);
+void trace_close(chip8_trace *trace);
+
+// Around one instruction: keeps its pc and the registers before it in t
+#ifdef CHIP8_TRACE
+#define TRACE_BEGIN(state, t) \
+    unsigned short t##_pc = (state)->pc; unsigned char t[16]; \
+    if ((state)->trace) memcpy(t, (state)->v, 16)
+#define TRACE_END(state, t) \
+    do { if ((state)->trace) trace_record((state)->trace, t##_pc, \
+        (state)->opcode, t, (state)->v); } while (0)
+#else
+#define TRACE_BEGIN(state, t) ((void)0)
+#define TRACE_END(state, t) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,416 @@
+#include <stdio.h> // for vsnprintf
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "chip8vm.h"
+#include "chip8dis.h"
+#include "chip8verify.h"
+
+// A range of values I may have at an instruction, [lo, hi]. lo > hi
+// means nothing has got there yet.
+typedef struct {
+    int lo, hi;
+} irange;
+
+#define I_NONE ((irange){1, 0})
+// Before anything sets it, I is whatever create_state() left there
+#define I_ANY ((irange){0, 0xffff})
+// Ranges that keep growing (FX1E in a loop) give up after this many
+#define MAX_WIDENS 16
+
+// Subroutine entries, as they're walked
+#define SUB_NEW 0
+#define SUB_WALKING 1
+#define SUB_DONE 2
+
+// One place a RET can return to
+typedef struct {
+    unsigned short to;
+    int next;   // the same RET's next one, or -1
+} ret_edge;
+
+typedef struct {
+    const chip8_flow *flow;
+    const unsigned char *memory;
+    chip8_verify *out;
+    unsigned char sub[4096];    // SUB_*, by entry
+    unsigned char depth[4096];  // calls nested below an entry, once done
+    // RETs each entry can reach (without going into what it calls)
+    unsigned short *rets, *ret_sub;
+    int num_rets;
+    // Where each RET can go back to, listed from first[addr]
+    ret_edge *edges;
+    int num_edges;
+    int first[4096];
+    irange i[4096];             // I going into each instruction
+    // Instructions whose I changed, still to pass it on
+    unsigned short todo[4096];
+    int num_todo;
+    unsigned char queued[4096];
+    unsigned char widens[4096];
+} verifier;
+
+static unsigned short opcode_at(const unsigned char *memory, int addr)
+{
+    return memory[addr] << 8 | memory[addr + 1];
+}
+
+// It's the plain machine that runs unchecked, so opcodes as it has them
+static int plain_class(unsigned short op)
+{
+    return op_class_isa(op, ISA_CHIP8);
+}
+
+// Record why it failed (the first reason only) and return -1
+static int fail(verifier *v, int addr, const char *fmt, ...)
+{
+    if (v->out->why[0] != '\0')
+        return -1;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(v->out->why, sizeof(v->out->why), fmt, ap);
+    va_end(ap);
+    v->out->addr = addr;
+    return -1;
+}
+
+// Where control goes after pc without leaving its subroutine: a CALL
+// comes back to the next instruction, a RET goes nowhere from here
+static int next_pcs(int pc, unsigned short op, int cls, int *next)
+{
+    switch (cls)
+    {
+        case OP_GOTO:
+            next[0] = op & 0xfff;
+            return 1;
+        case OP_RET:
+        case OP_CALLPROG:
+        case OP_JMPOFF:
+        case OP_INVALID:
+            return 0;
+        case OP_TEQ_I:
+        case OP_TNE_I:
+        case OP_TEQ:
+        case OP_TNE:
+        case OP_TKEY:
+        case OP_TNKEY:
+            next[0] = pc + 2;
+            next[1] = pc + 4;
+            return 2;
+        default:
+            next[0] = pc + 2;
+            return 1;
+    }
+}
+
+// Walk the subroutine at entry, then everything it calls, for how deep
+// calls nest below it and which RETs it has. level is how many calls
+// deep it is itself. Returns its depth, or -1.
+static int walk_sub(verifier *v, int entry, int level)
+{
+    if (v->sub[entry] == SUB_DONE)
+        return v->depth[entry];
+    if (v->sub[entry] == SUB_WALKING)
+        return fail(v, entry, "recursive call to %03x", entry);
+    if (level > VERIFY_MAX_DEPTH)
+        return fail(v, entry, "calls nest more than %i deep",
+                VERIFY_MAX_DEPTH);
+    v->sub[entry] = SUB_WALKING;
+
+    // Its own code first, noting what it calls, then those
+    unsigned char *seen = calloc(4096, 1);
+    unsigned short *todo = malloc(4096 * sizeof(unsigned short));
+    unsigned short *calls = malloc(4096 * sizeof(unsigned short));
+    int n = 0, num_calls = 0, bad = 0, next[2];
+    seen[entry] = 1;
+    todo[n++] = entry;
+    while (n > 0 && !bad)
+    {
+        int pc = todo[--n];
+        unsigned short op = opcode_at(v->memory, pc);
+        int cls = plain_class(op);
+        if (cls == OP_CALL)
+            calls[num_calls++] = op & 0xfff;
+        else if (cls == OP_RET)
+        {
+            if (entry == v->flow->start)
+            {
+                bad = fail(v, pc, "RET with nothing called");
+                break;
+            }
+            v->rets = realloc(v->rets, (v->num_rets + 1) *
+                    sizeof(unsigned short));
+            v->ret_sub = realloc(v->ret_sub, (v->num_rets + 1) *
+                    sizeof(unsigned short));
+            v->rets[v->num_rets] = pc;
+            v->ret_sub[v->num_rets++] = entry;
+        }
+        for (int i = next_pcs(pc, op, cls, next) - 1; i >= 0; i--)
+            if (!seen[next[i]])
+            {
+                seen[next[i]] = 1;
+                todo[n++] = next[i];
+            }
+    }
+
+    int depth = bad ? -1 : 0;
+    for (int c = 0; c < num_calls && depth >= 0; c++)
+    {
+        int below = walk_sub(v, calls[c], level + 1);
+        if (below < 0)
+            depth = -1;
+        else if (below + 1 > depth)
+            depth = below + 1;
+    }
+    free(seen);
+    free(todo);
+    free(calls);
+    if (depth < 0)
+        return -1;
+    v->sub[entry] = SUB_DONE;
+    v->depth[entry] = depth;
+    return depth;
+}
+
+// Every RET of each called subroutine goes back to after each call to it
+static void find_returns(verifier *v)
+{
+    for (int a = 0; a < 4096; a++)
+        v->first[a] = -1;
+    for (int pc = v->flow->start; pc < v->flow->end; pc++)
+    {
+        if (!(v->flow->flags[pc] & FLOW_INSN))
+            continue;
+        unsigned short op = opcode_at(v->memory, pc);
+        if (plain_class(op) != OP_CALL)
+            continue;
+        for (int r = 0; r < v->num_rets; r++)
+        {
+            if (v->ret_sub[r] != (op & 0xfff))
+                continue;
+            v->edges = realloc(v->edges, (v->num_edges + 1) *
+                    sizeof(ret_edge));
+            v->edges[v->num_edges] = (ret_edge){pc + 2,
+                v->first[v->rets[r]]};
+            v->first[v->rets[r]] = v->num_edges++;
+        }
+    }
+}
+
+// What an instruction does to I
+static irange i_after(unsigned short op, irange in)
+{
+    switch (plain_class(op))
+    {
+        case OP_INDEX:
+            return (irange){op & 0xfff, op & 0xfff};
+        case OP_IADD:
+            // Up to 255 on, masked back to 12 bits if it goes over
+            if (in.hi + 255 > 0xfff)
+                return (irange){0, 0xfff};
+            return (irange){in.lo, in.hi + 255};
+        case OP_FONT:
+            return (irange){0x50, 0x50 + 5 * 255};
+        default:
+            return in;
+    }
+}
+
+// Widen r to take in add; 1 if it changed
+static int join(irange *r, irange add)
+{
+    if (add.lo > add.hi)
+        return 0;
+    if (r->lo > r->hi)
+    {
+        *r = add;
+        return 1;
+    }
+    if (add.lo >= r->lo && add.hi <= r->hi)
+        return 0;
+    r->lo = add.lo < r->lo ? add.lo : r->lo;
+    r->hi = add.hi > r->hi ? add.hi : r->hi;
+    return 1;
+}
+
+// I goes on to instruction to with range r: queue it if that's news
+static void i_flows(verifier *v, int to, irange r)
+{
+    if (!join(&v->i[to], r))
+        return;
+    if (++v->widens[to] > MAX_WIDENS)
+    {
+        v->i[to].lo = 0;
+        v->i[to].hi = v->i[to].hi > 0xfff ? 0xffff : 0xfff;
+    }
+    if (!v->queued[to])
+    {
+        v->queued[to] = 1;
+        v->todo[v->num_todo++] = to;
+    }
+}
+
+// The range of I at every instruction, from the entry's I_ANY, through
+// calls into subroutines and out of their RETs
+static void track_i(verifier *v)
+{
+    int next[2];
+    for (int a = 0; a < 4096; a++)
+        v->i[a] = I_NONE;
+    i_flows(v, v->flow->start, I_ANY);
+    while (v->num_todo > 0)
+    {
+        int pc = v->todo[--v->num_todo];
+        v->queued[pc] = 0;
+        unsigned short op = opcode_at(v->memory, pc);
+        int cls = plain_class(op);
+        irange out = i_after(op, v->i[pc]);
+
+        if (cls == OP_CALL)
+            i_flows(v, op & 0xfff, out);
+        else if (cls == OP_RET)
+            for (int e = v->first[pc]; e >= 0; e = v->edges[e].next)
+                i_flows(v, v->edges[e].to, out);
+        else
+            for (int k = next_pcs(pc, op, cls, next) - 1; k >= 0; k--)
+                i_flows(v, next[k], out);
+    }
+}
+
+// 1 if any of [lo, hi] is code
+static int hits_code(const chip8_flow *flow, int lo, int hi)
+{
+    for (int a = lo; a <= hi; a++)
+        if (flow_is_code(flow, a))
+            return 1;
+    return 0;
+}
+
+// With I known at each instruction, check what it reads and writes
+static int check_memory(verifier *v)
+{
+    const chip8_flow *flow = v->flow;
+    for (int pc = flow->start; pc < flow->end; pc++)
+    {
+        irange r = v->i[pc];
+        if (!(flow->flags[pc] & FLOW_INSN) || r.lo > r.hi)
+            continue;
+        unsigned short op = opcode_at(v->memory, pc);
+        int x = (op >> 8) & 0xf, len, writes = 0;
+        switch (plain_class(op))
+        {
+            case OP_STORE:
+                len = x + 1;
+                writes = 1;
+                break;
+            case OP_BCD:
+                len = 3;
+                writes = 1;
+                break;
+            case OP_LOAD:
+                len = x + 1;
+                break;
+            case OP_DRAW:
+                len = op & 0xf;
+                break;
+            default:
+                len = 0;
+        }
+        if (len == 0)
+            continue;
+        if (r.hi + len - 1 > 0xfff)
+            return fail(v, pc, "%i byte(s) at I, which may be up to %03x",
+                    len, r.hi);
+        if (writes && hits_code(flow, r.lo, r.hi + len - 1))
+            return fail(v, pc, "may write over code (I %03x-%03x)", r.lo,
+                    r.hi);
+    }
+    return 0;
+}
+
+int flow_verify(const chip8_flow *flow, const unsigned char *memory,
+        chip8_verify *out)
+{
+    out->depth = 0;
+    out->addr = -1;
+    out->why[0] = '\0';
+    verifier *v = calloc(1, sizeof(verifier));
+    if (v == NULL)
+    {
+        snprintf(out->why, sizeof(out->why), "out of memory");
+        return -1;
+    }
+    v->flow = flow;
+    v->memory = memory;
+    v->out = out;
+
+    // Where the code goes has to be known before anything else can be
+    int ok = 0;
+    if (!(flow->flags[flow->start] & FLOW_INSN))
+        ok = fail(v, flow->start, "no code at the entry");
+    for (int pc = flow->start; pc < flow->end && ok == 0; pc++)
+    {
+        if (!(flow->flags[pc] & FLOW_INSN))
+            continue;
+        int cls = flow_class(flow, memory, pc);
+        if (!(op_class_isas(cls) & ISA_CHIP8))
+            ok = fail(v, pc, "%s, which the plain machine doesn't have",
+                    op_class_mnemonic(cls));
+        else if (cls == OP_JMPOFF)
+            ok = fail(v, pc, "BNNN, which could go anywhere");
+    }
+    if (ok == 0 && flow->seeded > 0)
+        ok = fail(v, -1, "code only found by running it");
+    if (ok == 0 && flow->outside > 0)
+        ok = fail(v, -1, "%i jump(s) or call(s) leave the rom",
+                flow->outside);
+
+    if (ok == 0 && (out->depth = walk_sub(v, flow->start, 0)) < 0)
+        ok = -1;
+    // (walk_sub only stops runaway nesting, paths to a subroutine already
+    // walked are added up here)
+    else if (ok == 0 && out->depth > VERIFY_MAX_DEPTH)
+        ok = fail(v, -1, "calls nest %i deep, more than %i", out->depth,
+                VERIFY_MAX_DEPTH);
+    if (ok == 0)
+    {
+        find_returns(v);
+        track_i(v);
+        ok = check_memory(v);
+    }
+    if (ok < 0)
+        out->depth = 0;
+    free(v->rets);
+    free(v->ret_sub);
+    free(v->edges);
+    free(v);
+    return ok;
+}
+
+int verify_state(chip8_state *state, chip8_verify *out)
+{
+    chip8_verify tmp;
+    if (out == NULL)
+        out = &tmp;
+    state->verified = 0;
+    if (state->pc != 0x200 || state->sp != 0xf)
+    {
+        out->depth = 0;
+        out->addr = state->pc;
+        snprintf(out->why, sizeof(out->why), "not a freshly loaded vm");
+        return -1;
+    }
+    chip8_flow *flow = flow_analyze(state->memory, 0x200, 4096, NULL,
+            ISA_CHIP8);
+    if (flow == NULL)
+    {
+        out->depth = 0;
+        out->addr = -1;
+        snprintf(out->why, sizeof(out->why), "out of memory");
+        return -1;
+    }
+    int ok = flow_verify(flow, state->memory, out);
+    flow_free(flow);
+    state->verified = ok == 0;
+    return ok;
+}
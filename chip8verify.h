@@ -0,0 +1,47 @@
+#ifndef CHIP8VERIFY_H_INC
+#define CHIP8VERIFY_H_INC
+
+#include "chip8flow.h"
+
+// Static checks on a rom, from chip8flow's picture of its code, that let
+// it run without the interpreter's safety masks. A rom passes if, from
+// its entry, on the plain machine (the switch engine, no quirks):
+//
+//   - every instruction reached is a plain CHIP-8 one (a flow read as
+//     SUPER-CHIP or XO-CHIP fails on their extras)
+//   - every jump, call, skip and fallthrough stays in the rom, and there
+//     is no BNNN (the analysis can't say where it goes)
+//   - calls never nest more than VERIFY_MAX_DEPTH deep, there's no
+//     recursion, and the entry never RETs with nothing to return to
+//   - I is provably in memory for every FX55/FX65/FX33/DXYN, all of what
+//     they touch included
+//   - nothing FX55/FX33 store can land on code, so the code that was
+//     checked is the code that runs
+//
+// I is tracked as a range of values per instruction, across calls and
+// returns. Anything it can't prove fails: the rom still runs, just on the
+// checked interpreter.
+
+// sp starts at 0xf and each call takes one off, so 15 calls reach 0
+#define VERIFY_MAX_DEPTH 15
+
+typedef struct {
+    int depth;      // deepest call nesting from the entry
+    int addr;       // the instruction it failed at, or -1
+    char why[96];   // why it failed, "" if it passed
+} chip8_verify;
+
+// Verify the code flow found in memory. Returns 0 if it passed, else -1
+// with out saying why.
+int flow_verify(const chip8_flow *flow, const unsigned char *memory,
+        chip8_verify *out);
+
+// Verify the rom loaded into a fresh state (pc at 0x200, nothing called
+// yet) and set state->verified if it passed, so the "verified" engine
+// runs it unchecked. Returns 0 if it passed. out may be NULL. For the
+// emulator's side, which has chip8vm.h (disasm only has the above).
+#ifdef CHIP8VM_H_INC
+int verify_state(chip8_state *state, chip8_verify *out);
+#endif
+
+#endif
@@ -1,29 +1,48 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h> // for memset, memcpy
-#include <time.h> // for seeding rand
-#include <unistd.h> // for usleep
+#include <string.h> // for strcmp, memcmp, memcpy
+#include <unistd.h> // for usleep, sysconf
 
 #include <SDL2/SDL.h>
 
 #include "chip8vm.h"
+#include "chip8prof.h"
+#include "chip8hostperf.h"
+#include "chip8trace.h"
+#include "chip8verify.h"
+#ifdef CHIP8_AOT
+#include "chip8aot.h"
+#endif
 #include "testingsys.h"
+#include "regress.h"
 
 // version: 1.0
 // author: rjk
 
 // CONSTS
-unsigned int FRAME_DELAY = 3333; // microseconds for usleep
+unsigned int FRAME_DELAY = 16667; // microseconds for usleep, ~1/60 second
 int PIX_SIZE = 10;
-unsigned char on = 0xff;
+int MAX_RUNAHEAD = 4;
 
 SDL_Window * create_window(void);
+void save_profile(chip8_state *state, char *filename);
+void load_rpl(chip8_state *state, char *filename);
+void save_rpl(chip8_state *state, char *filename);
 
 int main(int argc, char *argv[]){
     // Ensure that we're being used with what we'll assume is a romfile
     if (argc < 2)
     {
-        printf("Usage: chip8vm <romfile>\n");
+        printf("Usage: chip8vm [-runahead N] [-prof out.csv|out.json] [-hostperf]\n");
+        printf("               [-trace out.c8tr] [-quirks vip|chip48|schip|xochip]\n");
+        printf("               [-aot rom.so] <romfile>\n");
+        printf("       chip8vm -t [1]\n");
+        printf("       chip8vm -regress <dir> [-frames N] [-every N] "
+                "[-threads N]\n");
+        printf("               [-engine name] [-update]\n");
+        printf("       chip8vm-prof -cover <romfile> <out.csv> [-frames N] "
+                "[-keys file]\n");
+        printf("               [-engine name]\n");
         exit(1);
     }
 
@@ -43,6 +62,166 @@ int main(int argc, char *argv[]){
         return 0;
     }
 
+    // Regression farm, see regress.h. No window.
+    if (strcmp(argv[1], "-regress") == 0 && argc >= 3)
+    {
+        regress_opts opts = {chip8_engines, 600, 60,
+            sysconf(_SC_NPROCESSORS_ONLN), 0};
+        for (int i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+                opts.frames = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-every") == 0 && i + 1 < argc)
+                opts.every = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+                opts.threads = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc)
+            {
+                opts.engine = find_engine(argv[++i]);
+                if (opts.engine == NULL)
+                {
+                    printf("No engine called %s\n", argv[i]);
+                    exit(1);
+                }
+            }
+            else if (strcmp(argv[i], "-update") == 0)
+                opts.update = 1;
+            else
+            {
+                printf("Unknown option: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        if (opts.frames < 1 || opts.every < 1 || opts.threads < 1)
+        {
+            printf("-frames, -every and -threads must be positive\n");
+            exit(1);
+        }
+        return regress_dir(argv[2], &opts) != 0;
+    }
+
+    // Coverage for disasm -prof, headless too
+    if (strcmp(argv[1], "-cover") == 0 && argc >= 4)
+    {
+        const chip8_engine *engine = chip8_engines;
+        const char *keys = NULL;
+        int frames = 600;
+        for (int i = 4; i < argc; i++)
+        {
+            if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+                frames = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-keys") == 0 && i + 1 < argc)
+                keys = argv[++i];
+            else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc)
+            {
+                engine = find_engine(argv[++i]);
+                if (engine == NULL)
+                {
+                    printf("No engine called %s\n", argv[i]);
+                    exit(1);
+                }
+            }
+            else
+            {
+                printf("Unknown option: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        return cover_rom(argv[2], keys, frames, engine, argv[3]);
+    }
+
+    // Options come before the romfile
+    // -runahead N: show the frame N frames ahead, to hide input lag
+    // -prof file: write a guest profile there on exit (CHIP8_PROFILE builds)
+    // -hostperf: print host cost per opcode etc on exit (CHIP8_HOSTPERF)
+    // -trace file: binary execution trace, see tracedump (CHIP8_TRACE)
+    // -quirks profile: run as that machine would (any engine name works)
+    // -aot file: run the rom compiled by chip8aot (CHIP8_AOT)
+    int runahead = 0;
+    const chip8_engine *engine = chip8_engines;
+    char *prof_file = NULL;
+#ifdef CHIP8_AOT
+    char *aot_file = NULL;
+#endif
+#ifdef CHIP8_HOSTPERF
+    int hostperf = 0;
+#endif
+    int arg = 1;
+    while (arg < argc - 1 && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-runahead") == 0 && arg + 2 < argc)
+        {
+            runahead = atoi(argv[arg + 1]);
+            if (runahead < 0 || runahead > MAX_RUNAHEAD)
+            {
+                printf("runahead must be 0 to %i\n", MAX_RUNAHEAD);
+                exit(1);
+            }
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-prof") == 0 && arg + 2 < argc)
+        {
+#ifdef CHIP8_PROFILE
+            prof_file = argv[arg + 1];
+            state->prof = prof_create();
+            arg += 2;
+#else
+            printf("-prof needs a profiling build (make chip8vm-prof)\n");
+            exit(1);
+#endif
+        }
+        else if (strcmp(argv[arg], "-hostperf") == 0)
+        {
+#ifdef CHIP8_HOSTPERF
+            hostperf = 1;
+            arg++;
+#else
+            printf("-hostperf needs a build with it (make chip8vm-hostperf)\n");
+            exit(1);
+#endif
+        }
+        else if (strcmp(argv[arg], "-trace") == 0 && arg + 2 < argc)
+        {
+#ifdef CHIP8_TRACE
+            state->trace = trace_open(argv[arg + 1]);
+            if (state->trace == NULL)
+            {
+                printf("Could not create %s\n", argv[arg + 1]);
+                exit(1);
+            }
+            arg += 2;
+#else
+            printf("-trace needs a tracing build (make chip8vm-trace)\n");
+            exit(1);
+#endif
+        }
+        else if (strcmp(argv[arg], "-aot") == 0 && arg + 2 < argc)
+        {
+#ifdef CHIP8_AOT
+            aot_file = argv[arg + 1];
+            arg += 2;
+#else
+            printf("-aot needs a build with it (make chip8vm-aot)\n");
+            exit(1);
+#endif
+        }
+        else if (strcmp(argv[arg], "-quirks") == 0 && arg + 2 < argc)
+        {
+            engine = find_engine(argv[arg + 1]);
+            if (engine == NULL)
+            {
+                printf("No quirk profile called %s\n", argv[arg + 1]);
+                exit(1);
+            }
+            arg += 2;
+        }
+        else
+        {
+            printf("Unknown option: %s\n", argv[arg]);
+            exit(1);
+        }
+    }
+
     // Initialize SDL
     if(SDL_Init(SDL_INIT_VIDEO) < 0)
     {
@@ -61,11 +240,18 @@ int main(int argc, char *argv[]){
         return -1;
     }
 
-    // define bg & fg colors
+    // define bg & fg colors, by get_pixel() value: plane 2 and both
+    // planes are only for XO-CHIP
     Uint32 bg_fill = SDL_MapRGB(window_surface->format, 0, 0, 0);
-    Uint32 fg_fill = SDL_MapRGB(window_surface->format, 255, 255, 255);
+    Uint32 palette[4] = {
+        bg_fill,
+        SDL_MapRGB(window_surface->format, 255, 255, 255),
+        SDL_MapRGB(window_surface->format, 170, 170, 170),
+        SDL_MapRGB(window_surface->format, 85, 85, 85),
+    };
 
-    // Create our virtual pixels
+    // Create our virtual pixels, for lores and hires (same window, half
+    // the pixel size)
     SDL_Rect pixels[2048]; // 64 * 32
     for (int i = 0; i < 2048; i++)
     {
@@ -76,14 +262,58 @@ int main(int argc, char *argv[]){
         pixels[i].w = PIX_SIZE;
         pixels[i].h = PIX_SIZE;
     }
+    SDL_Rect hpixels[8192]; // 128 * 64
+    for (int i = 0; i < 8192; i++)
+    {
+        hpixels[i].x = i % 128 * PIX_SIZE / 2;
+        hpixels[i].y = i / 128 * PIX_SIZE / 2;
+        hpixels[i].w = PIX_SIZE / 2;
+        hpixels[i].h = PIX_SIZE / 2;
+    }
 
-    // Load given romfile into VM memory
-    load_rom(argv[1], state);
+    // Load given romfile into VM memory, and any RPL flags it saved
+    load_rom(argv[arg], state);
+    char rpl_file[1024];
+    snprintf(rpl_file, sizeof(rpl_file), "%s.rpl", argv[arg]);
+    load_rpl(state, rpl_file);
+#ifdef CHIP8_AOT
+    // Compiled code is for the plain machine only
+    if (aot_file != NULL)
+    {
+        if (engine != chip8_engines)
+        {
+            printf("-aot can't be used with -quirks\n");
+            exit(1);
+        }
+        if (aot_load(aot_file, state) != 0)
+            exit(1);
+        engine = &aot_engine;
+    }
+#endif
+    // The plain machine runs unchecked if the rom can be proven not to
+    // need it, see chip8verify.h
+    if (engine == chip8_engines && verify_state(state, NULL) == 0)
+        engine = find_engine("verified");
     // dump_memory(state);
 
+    // Run-ahead: ahead is state run on by `runahead` frames, holding the
+    // keys as they are now, and it's what gets drawn. While the keys stay
+    // the same it stays valid, so it just steps along with state. When
+    // they change, roll it back to state and run it ahead again.
+    chip8_state *ahead = runahead > 0 ? create_state() : NULL;
+    chip8_state *shown = state;
+    unsigned char ahead_keys[16];
+    int ahead_valid = 0;
+
+#ifdef CHIP8_HOSTPERF
+    if (hostperf)
+        hostperf_start();
+#endif
+
     int keep_window_open = 1;
     while(keep_window_open)
     {
+        HOSTPERF_BEGIN(t_events);
         // Create an event type variable
         SDL_Event e;
         // Will == 0 if no event occurred
@@ -93,23 +323,71 @@ int main(int argc, char *argv[]){
             {
                 // only one event tracked right now: the quit (x) button
                 case SDL_QUIT:
-                    // Destroy the state
-                    free(state);
                     keep_window_open = 0;
                     break;
             }
         }
+        HOSTPERF_END(t_events, HP_EVENTS);
         
+        HOSTPERF_BEGIN(t_keys);
         update_keys(state);
+        HOSTPERF_END(t_keys, HP_KEYS);
 
-        state->opcode = state->memory[state->pc] << 8 | state->memory[state->pc + 1];
-        emulate_opcode(state);
-        state->pc += 2;
+        // One frame: a batch of instructions, then the 60Hz timer tick
+        engine->run(state, CYCLES_PER_FRAME);
         // printf("%x\n", state->pc);
+        if (state->halted == HALT_EXIT)
+            // 00FD: leave the loop, the teardown after it does the rest
+            keep_window_open = 0;
+        else if (state->halted)
+        {
+            // A bad opcode exits from here, so save what we have first
+            if (prof_file != NULL)
+                save_profile(state, prof_file);
+#ifdef CHIP8_HOSTPERF
+            if (hostperf)
+                hostperf_report(stdout);
+#endif
+#ifdef CHIP8_TRACE
+            trace_close(state->trace);
+#endif
+            if (state->halted == HALT_INVALID)
+                invalid_opcode(state->pc, state->opcode);
+            else
+                unimplemented_opcode_err(state->pc, state->opcode);
+        }
+        tick_timers(state);
+
+        if (ahead != NULL)
+        {
+            if (ahead_valid && memcmp(ahead_keys, state->key, 16) == 0)
+            {
+                // Same keys as the guess was made with: still good
+                engine->run(ahead, CYCLES_PER_FRAME);
+                tick_timers(ahead);
+            }
+            else
+            {
+                // Roll back and guess again with the new keys
+                copy_state(ahead, state);
+                // Guesses aren't what ran: keep them out of the profile
+                // and the trace
+                ahead->prof = NULL;
+                ahead->trace = NULL;
+                for (int f = 0; f < runahead; f++)
+                {
+                    engine->run(ahead, CYCLES_PER_FRAME);
+                    tick_timers(ahead);
+                }
+                memcpy(ahead_keys, state->key, 16);
+                ahead_valid = 1;
+            }
+            // A guess that hits a bad opcode isn't worth showing, the
+            // real state will report it when it gets there
+            shown = ahead->halted ? state : ahead;
+        }
         // timing
-        usleep(FRAME_DELAY); // ~1/30 second
-        state->delay_timer == 0 ? state->delay_timer = 0 : state->delay_timer--;
-        state->sound_timer == 0 ? state->sound_timer = 0 : state->sound_timer--;
+        usleep(FRAME_DELAY);
         /* seems sound is difficult in sdl
          * if (state->sound_timer == 0)
          *  beep();
@@ -118,68 +396,46 @@ int main(int argc, char *argv[]){
         // NOTE: the reason for the extra indent is that there's an
         // intention of only drawing when the draw flag is set to 1
         // but, wrapping this into a if (state->draw_flag == 1) breaks it
+            HOSTPERF_BEGIN(t_render);
             // Fill in whole window with background color
             // Wanted to replace SDL_MapRGB call but ??????
             SDL_FillRect(window_surface, NULL, bg_fill);
 
             // draw rects to window surface
-            for (int i = 0; i < 2048; i++)
+            int w = shown->hires ? HGFX_W : GFX_W;
+            int h = shown->hires ? HGFX_H : GFX_H;
+            SDL_Rect *rects = shown->hires ? hpixels : pixels;
+            for (int i = 0; i < w * h; i++)
             {
-                SDL_Rect px = pixels[i];
+                SDL_Rect px = rects[i];
                 Uint32 color;
-                color = state->gfx[i] == on ? fg_fill : bg_fill;
+                color = palette[get_pixel(shown, i % w, i / w)];
                 SDL_FillRect(window_surface, &px, color);
             }
 
             // Update our window to match our "back work canvas"
             SDL_UpdateWindowSurface(win);
+            HOSTPERF_END(t_render, HP_RENDER);
             // unset draw flag (to be set by next 00e0 or dXYN call)
             state->draw_flag = 0;
         
     }
+    if (prof_file != NULL)
+        save_profile(state, prof_file);
+#ifdef CHIP8_HOSTPERF
+    if (hostperf)
+        hostperf_report(stdout);
+#endif
+#ifdef CHIP8_TRACE
+    trace_close(state->trace);
+#endif
+    save_rpl(state, rpl_file);
+    // Destroy the state
+    free(ahead);
+    free(state);
 }
 
 
-chip8_state * create_state(void)
-{
-    srand(time(0));
-    //  Create a pointer to a state, so we can modify it in functions
-    chip8_state *state = malloc(sizeof(chip8_state));
-    // Initialize important fields
-    // It's not important for say, registers to be cleared
-    memset(state->memory, 0, sizeof(state->memory));
-    // hardcode memory values:
-    unsigned char font_set[] = {
-        0xf0, 0x90, 0x90, 0x90, 0xf0, // 0 @ 0x050
-        0x20, 0x60, 0x20, 0x20, 0x70, // 1 @ 0x055
-        0xf0, 0x10, 0xf0, 0x80, 0xf0, // 2 @ 0x05a
-        0xf0, 0x10, 0xf0, 0x10, 0xf0, // 3 @ 0x05f
-        0x90, 0x90, 0xf0, 0x10, 0x10, // 4 @ 0x064
-        0xf0, 0x80, 0xf0, 0x10, 0xf0, // 5 @ 0x069
-        0xf0, 0x80, 0xf0, 0x10, 0xf0, // 6 @ 0x06e
-        0xf0, 0x10, 0x20, 0x20, 0x40, // 7 @ 0x073
-        0xf0, 0x90, 0xf0, 0x90, 0xf0, // 8 @ 0x078
-        0xf0, 0x90, 0xf0, 0x10, 0xf0, // 9 @ 0x07d
-        0xf0, 0x90, 0xf0, 0x90, 0x90, // a @ 0x082
-        0xe0, 0x90, 0xe0, 0x90, 0xe0, // b @ 0x087
-        0xf0, 0x80, 0x80, 0x80, 0xf0, // c @ 0x08c
-        0xe0, 0x90, 0x90, 0x90, 0xe0, // d @ 0x087
-        0xf0, 0x80, 0xf0, 0x80, 0xf0, // e @ 0x096
-        0xf0, 0x80, 0xf0, 0x80, 0x80, // f @ 0x09b
-    };
-    // 5 bytes each for 16 hexadecimal chars
-    memcpy(&state->memory[0x50], &font_set, 5 * 16);
-    memset(state->gfx, 0, sizeof(state->gfx));
-    state->pc = 0x200;
-    state->sp = 0xf;
-    // Set all keys to "up" state
-    memset(state->key, 0, sizeof(state->key));
-    // Set draw and key flags
-    state->draw_flag = 1;
-    state->key_flag = 0xff;
-    return state;
-}
-
 // Create a window
 SDL_Window * create_window(void)
 {
@@ -200,346 +456,6 @@ SDL_Window * create_window(void)
     return window;
 }
 
-// Load a rom into vm memory
-void load_rom(char *romfilename, chip8_state *state)
-{
-    // Open a romfile
-    FILE *romfile = fopen(romfilename, "r");
-    if (romfile == NULL)
-    {
-        printf("Could not open file: %s\n", romfilename);
-        exit(1);
-    }
-
-    // Fill our memory with program data, starting at 0x200
-    // 0x1000 total memory - 0x200 reserved = 0xe00 for rom 
-    fread(state->memory + 0x200, 1, 0xe00, romfile);
-}
-
-// Temporary while still adding.
-// No plan to add 0x0NNN (Call RCA program) but when that's the only
-// one left, this error handling will move there, since it won't be
-// (at that point) repeated any longer.
-void unimplemented_opcode_err(unsigned short pc, unsigned short opcode)
-{
-    printf("ERROR!\nUnimplemented Opcode: %04x\n", opcode);
-    printf("Opcode at 0x%04x (in memory)\n", pc);
-    exit(1);
-}
-
-// Handles any opcodes that aren't valid by reporting them & their address
-void invalid_opcode(unsigned short pc, unsigned short opcode)
-{
-    printf("Invalid opcode at 0x%04x (in memory)\n", pc);
-    printf("Opcode: %04x\n", opcode);
-    exit(1);
-}
-
-
-// Decode & emulate opcode. Mainly grouped by first nibble.
-void emulate_opcode(chip8_state *state)
-{
-    unsigned short pc = state->pc;
-    unsigned short opcode = state->opcode;
-
-    // Getting X & Y from opcodes is tricky and having a var to hold them
-    // is very nice, so we declare those up here.
-    // vx & vy are the values, set vx = 7 if register vx is holding 7.
-    // x & y are the indices. set x = 7 to mean register 7
-    unsigned char vx, vy;
-    unsigned char x = (opcode & 0xf00) >> 8;
-    unsigned char y = (opcode & 0x0f0) >> 4;
-
-    // NN & NNN are just masks w/o shifts so having vars isnt needed.
-
-    // Get just first nibble and switch on that.
-    // Shifts are 4 * nibbles moved bc 4 bits to a nibble
-    // (ie, this first shifts 0xa000 to 0xa by shifting 3*4 = 12)
-    switch ((opcode & 0xf000) >> 12)
-    {
-        case 0x0:
-            if (opcode == 0x00e0)
-            {
-                // 0x00e0: Clear screen
-                // This should do it, though is not tested yet
-                // unlikely to change from any change in SDL details
-                // really that'd be the point
-                memset(state->gfx, 0, sizeof(state->gfx));
-                state->draw_flag = 1;
-            }
-            else if (opcode == 0x00ee)
-            {
-                // 0x00ee: Return from subroutine
-                state->pc = state->stack[state->sp]; // REVERT +2
-                state->sp == 0xf ? state->sp = 0x0 : state->sp++;
-            }
-            else
-                // 0x0NNN Call RCA 1802 program (probably don't need)
-                unimplemented_opcode_err(pc, opcode);
-            break;
-        case 0x1:
-            // 1NNN: GOTO NNN
-            state->pc = (opcode & 0xfff) - 2; // REVERT +2
-            break;
-        case 0x2:
-            // 2NNN: Call subroutine
-            state->sp == 0 ? state->sp = 0xf : state->sp--;
-            state->stack[state->sp] = state->pc;
-            state->pc = (opcode & 0xfff) - 2; // REVERT +2
-            break;
-        case 0x3:
-            // 0x3XNN: Skip next instruction if VX == NN
-            vx  = state->v[x];
-            if (vx == (opcode & 0xff))
-                state->pc += 2;
-            break;
-        case 0x4:
-            // 0x4XNN: Skip next instruction if VX != NN
-            vx  = state->v[x];
-            if (vx != (opcode & 0xff))
-                state->pc += 2;
-            break;
-        case 0x5:
-            // 0x5XY0: Skip next instruction if VX == VY
-            // opcode must end in 0 or isn't valid
-            if ((opcode & 0xf) != 0)
-                invalid_opcode(pc, opcode);
-            // else
-            vx  = state->v[x];
-            vy  = state->v[y];
-            if (vx == vy)
-                state->pc += 2;
-            break;
-        case 0x6:
-            // 0x6XNN: Sets VX to NN
-            state->v[x] = (opcode & 0xff);
-            break;
-        case 0x7:
-            // 0x7XNN: Increment VX by NN
-            vx = state->v[x];
-            state->v[x] = (vx + (opcode & 0xff)) & 0xff;
-            break;
-        case 0x8:
-            // 0x8*** is messier than the neat categories so far.
-            // operates on VX and VY depending on last hex digit
-            switch (opcode & 0xf)
-            {
-                case 0x0:
-                    // 0x8XY0: Assign VX to value in VY
-                    vy = state->v[y];
-                    state->v[x] = vy;
-                    break;
-                case 0x1:
-                    // 0x8XY1: OR: VX = VX | VY
-                    vx = state->v[x];
-                    vy = state->v[y];
-                    state->v[x] = (vx | vy);
-                    break;
-                case 0x2:
-                    // 0x8XY2: AND: VX = VX & VY
-                    vx = state->v[x];
-                    vy = state->v[y];
-                    state->v[x] = (vx & vy);
-                    break;
-                case 0x3:
-                    // 0x8XY3: XOR: VX = VX ^ VY
-                    vx = state->v[x];
-                    vy = state->v[y];
-                    state->v[x] = (vx ^ vy);
-                    break;
-                case 0x4:
-                    // 0x8XY4: Increment VX by VY
-                    vx = state->v[x];
-                    vy = state->v[y];
-                    state->v[x] = (vx + vy) & 0xff;
-                    break;
-                case 0x5:
-                    // 0x8XY5: Decrement VX by VY
-                    vx = state->v[x];
-                    vy = state->v[y];
-                    state->v[x] = (vx - vy) & 0xff;
-                    break;
-                case 0x6:
-                    // 0x8XY6: Shift VY right by one and set into VX
-                    // Set VF to VY's pre shift LSB
-                    // This behavior changed in 48 and Super
-                    state->v[0xf] = state->v[y] & 1;
-                    state->v[x] = (state->v[y] >> 1);
-                    break;
-                case 0x7:
-                    // 0x8XY7: LESS: VX = VY - VX
-                    vx = state->v[x];
-                    vy = state->v[y];
-                    state->v[x] = (vy - vx) & 0xff;
-                    break;
-                // No 0x8XY8 - 0x8XYd, or *f
-                case 0xe:
-                    // 0x8XYe: Shifts VY left by one and stores in VX
-                    // SET VF to VY's pre shift MSB
-                    // Like 0x8XY6, was patched in -48 and Super
-                    state->v[0xf] = (state->v[y] & 0x80) >> 7;
-                    state->v[x] = (state->v[y] << 1) & 0xff;
-                    break;
-                default:
-                    invalid_opcode(pc, opcode);
-            }
-            break;
-        // (Back to first nibble decoding)
-        case 0x9:
-            // 0x9XY0: Skip next instruction if VX != VY
-            // opcode must end in 0 or isn't valid
-            if ((opcode & 0xf) != 0)
-                invalid_opcode(pc, opcode);
-            // else
-            vx  = state->v[x];
-            vy  = state->v[y];
-            if (vx != vy)
-                state->pc += 2;
-            break;
-        case 0xa:
-            // 0xaNNN: Set index register (I) to adress NNN
-            state->index_reg = opcode & 0xfff;
-            break;
-        case 0xb:
-            // 0xbNNN: Jump PC to address V0 + NNN
-            vx = state->v[0];
-            // REVERT +2
-            state->pc = ((vx + (opcode & 0xfff)) & 0xfff) - 2;
-            break;
-        case 0xc:
-            // 0xcXNN: Set VX to random number between 0 and 255,
-            // bitmasked by AND with NN
-            state->v[x] = (rand() % 256) & (opcode & 0xff);
-            break;
-        case 0xd:
-            // 0xdXYN:
-            // Draw sprite of N height at address in I
-            // to coords VX, VY (all sprites are 8 bits wide)
-            vx = state->v[x];
-            vy = state->v[y];
-            state->v[0xf] = 0;
-            unsigned char bit;
-            unsigned int place;
-            for (int i = 0; i < (opcode & 0xf); i++)
-            {
-                for (int b = 0; b < 8; b++)
-                {
-                    bit = (state->memory[(state->index_reg + i)] >> b) & 0x1;
-                    place = ((vy + i) * 64) + vx + (7-b);
-                    // Set VF flag to 1 if there'll be a flip from 1 to 0
-                    if (state->v[0xf] == 0 && state->gfx[place] && bit)
-                        state->v[0xf] = 1;
-                    if (state->gfx[place] == 0)
-                        state->gfx[place] = bit * 0xff;
-                    else
-                        state->gfx[place] = (1-bit) * 0xff;
-                }
-            }
-            state->draw_flag = 1;
-            break;
-        case 0xe:
-            // recall: state->key[_vx_value_] = 0 if up, else 1
-            // 0xeX9e: Skip next instruction if key stored in VX is pressed:
-            vx = state->v[x];
-            if ((opcode & 0xff) == 0x9e)
-            {
-                if (state->key[vx] != 0)
-                    state->pc += 2;
-            }
-            // 0xeXa1: Skip next instruction if key NOT pressed:
-            else if ((opcode & 0xff) == 0xa1)
-            {
-                if (state->key[vx] == 0)
-                    state->pc += 2;
-            }
-            else
-                invalid_opcode(pc, opcode);
-            break;
-        case 0xf:
-            // Another messy one, depends on last 2 digits
-            switch (opcode & 0xff)
-            {
-                case 0x07:
-                    // 0xfX07: Set VX to value of delay timer
-                    state->v[x] = state->delay_timer;
-                    break;
-                case 0x0a:
-                    // 0xfX0a: Wait for keypress, then store it in VX
-                    // Blocking operation. hacky?
-                    state->key_flag = 0xff;
-                    while (state->key_flag == 0xff)
-                    {
-                        SDL_PumpEvents();
-                        update_keys(state);
-                        for (int i=0x0; i<= 0xf; i++)
-                        {
-                            if (state->key[i] == 1)
-                            {
-                                state->v[x] = i;
-                                state->key_flag = i;
-                                break;
-                            }
-                        }
-                    }
-                    break;
-                case 0x15:
-                    // 0xfX15: Set delay timer to VX
-                    state->delay_timer = state->v[x];
-                    break;
-                case 0x18:
-                    // 0xfX18: Set sound timer to VX
-                    state->sound_timer = state->v[x];
-                    break;
-                case 0x1e:
-                    // 0xfX1e: Add VX to I Set VF to if overflowed
-                    vx = state->v[x];
-                    state->index_reg = state->index_reg + vx;
-                    // I > 0xfff iff overflow happened
-                    state->v[0xf] = state->index_reg > 0xfff ? 1 : 0;
-                    state->index_reg &= 0xfff;
-                    break;
-                case 0x29:
-                    // 0xfX29: sets I to the built-in sprite address for the
-                    // character stored in VX
-                    // sprite for char 0xX starts at 0x50 + 0x5 * X
-                    state->index_reg = 0x50 + (0x5 * state->v[x]);
-                    break;
-                case 0x33:
-                    // 0xfX33: Stores BCD of VX starting at I
-                    // eg, if opcode is 0xfa33, and VA holds 0xff
-                    // then put 0x2 in I, 0x5 in I+1, and 0x5 in I+2
-                    state->memory[state->index_reg + 2] = state->v[x] % 10;
-                    state->v[x] /= 10;
-                    state->memory[state->index_reg + 1] = state->v[x] % 10;
-                    state->v[x] /= 10;
-                    state->memory[state->index_reg] = state->v[x];
-                    break;
-                case 0x55:
-                    // 0xfX55: Stores registers V0 to & incl. VX into memory
-                    // Starting by storing V0 at address stored in I
-                    // then V[N] at I + N
-                    for (int i = 0; i <= x; i++)
-                    {
-                        state->memory[state->index_reg + i] = state->v[i];
-                    }
-                    break;
-                case 0x65:
-                    // 0xfX65: Loads registers v0 to & incl. VX from memory
-                    // Starting by loading V0 from address stored in I
-                    // then V[N] from I + N
-                    for (int i = 0; i <= x; i++)
-                    {
-                        state->v[i] = state->memory[state->index_reg + i];
-                    }
-                    break;
-                default:
-                    // Invalid opcode starting with 0xf
-                    invalid_opcode(pc, opcode);
-            }
-            break;
-    }
-}
-
 void update_keys(chip8_state *state)
 {
     const Uint8* key_states = SDL_GetKeyboardState(NULL);
@@ -562,49 +478,49 @@ void update_keys(chip8_state *state)
     state->key[0xf] = key_states[SDL_SCANCODE_V]; 
 }
 
-
-
-// Dump memory contents to console.
-// Useful now as a display of results, later as debugging tool
-void dump_memory(chip8_state *state)
+// Write the guest profile as json if the name ends in .json, else csv
+void save_profile(chip8_state *state, char *filename)
 {
-    // For each 16 byte "block"
-    for (int i = 0; i < 256; i++)
+#ifdef CHIP8_PROFILE
+    FILE *out = fopen(filename, "w");
+    if (out == NULL)
     {
-        // Print the address of the first byte for this row
-        printf("%03x: ", i * 16);
-        // Possibility: check against previous line, if same, then
-        // do *** for one line, and pick back up when memory is different
-        for (int j = 0; j < 16; j++)
-        {
-            // Print the jth byte in this ith 16 byte block
-            printf("%02x ", state->memory[i * 16 + j]);
-        }
-        printf("\n");
+        printf("Could not create %s\n", filename);
+        return;
     }
-    printf("Memory dumped\n");
+    size_t len = strlen(filename);
+    if (len >= 5 && strcmp(filename + len - 5, ".json") == 0)
+        prof_save_json(state->prof, state->memory, out);
+    else
+        prof_save_csv(state->prof, state->memory, out);
+    fclose(out);
+#endif
 }
 
 
-// Dump most of the state variables
-// excludes: memory, gfx, key
-// key could be in this, it's short.
-void dump_state(chip8_state *state)
+// SUPER-CHIP RPL flags (FX75/FX85) last between runs, like on the HP48:
+// they're kept next to the rom as rom.ch8.rpl, 16 bytes
+void load_rpl(chip8_state *state, char *filename)
 {
-    printf("Curr Opcode: %04x\n", state->opcode);
-    printf("Registers:\n");
-    for (int i = 0; i < 16; i++)
-    {
-        printf("    V%i: %02x\n", i, state->v[i]);
-    }
-    printf("Index register: %04x\n", state->index_reg);
-    printf("PC: %04x\n", state->pc);
-    printf("Timers: Delay: %02x\n", state->delay_timer);
-    printf("        Sound: %02x\n", state->sound_timer);
-    printf("Stack:\n");
-    for (int i = 0; i < 16; i++)
+    FILE *in = fopen(filename, "rb");
+    if (in == NULL)
+        return;
+    fread(state->rpl, 1, sizeof(state->rpl), in);
+    fclose(in);
+}
+
+// Only written if the rom used them
+void save_rpl(chip8_state *state, char *filename)
+{
+    unsigned char none[sizeof(state->rpl)] = {0};
+    if (memcmp(state->rpl, none, sizeof(none)) == 0)
+        return;
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL)
     {
-        printf("    %02i:  %04x\n", i, state->stack[i]);
+        printf("Could not write %s\n", filename);
+        return;
     }
-    printf("SP: %i\n", state->sp);
+    fwrite(state->rpl, 1, sizeof(state->rpl), out);
+    fclose(out);
 }
@@ -1,13 +1,45 @@
 #ifndef CHIP8VM_H_INC
 #define CHIP8VM_H_INC
 
+#include <stdint.h>
+
+// Display is bitpacked: one 64 bit word per row, leftmost pixel in the MSB
+#define GFX_W 64
+#define GFX_H 32
+// SUPER-CHIP hires: two words per row, left half first
+#define HGFX_W 128
+#define HGFX_H 64
+
+// CHIP-8 addresses are 12 bits, masked with ADDR_MASK. XO-CHIP builds
+// (CHIP8_XO, make chip8vm-xo) have 64K of memory for the xochip engine,
+// which masks with XO_ADDR_MASK; the other engines still see 4K.
+#ifdef CHIP8_XO
+#define MEM_SIZE 0x10000
+#else
+#define MEM_SIZE 4096
+#endif
+#define ADDR_MASK 0xfff
+#define XO_ADDR_MASK 0xffff
+
+// Instructions run per 60Hz frame (timers tick once per frame)
+#define CYCLES_PER_FRAME 10
+
+// Reasons the vm stopped, kept in state->halted
+#define HALT_NONE 0
+#define HALT_INVALID 1       // invalid opcode, pc left on it
+#define HALT_UNIMPLEMENTED 2 // 0x0NNN, pc left on it
+#define HALT_EXIT 3          // 00FD, the rom asked to stop
+
+struct chip8_prof;
+struct chip8_trace;
+
 typedef struct {
     unsigned short opcode;
-    unsigned char memory[4096];
+    unsigned char memory[MEM_SIZE];
     unsigned char v[16];        // registers
     unsigned short index_reg;
     unsigned short pc;          // program counter
-    unsigned char gfx[64 * 32]; // VRAM
+    uint64_t gfx[GFX_H];        // VRAM, one word per row
     unsigned char delay_timer;
     unsigned char sound_timer;
     unsigned short stack[16];
@@ -17,14 +49,53 @@ typedef struct {
     // flags go here?
     unsigned char draw_flag;
     unsigned char key_flag;
+    unsigned char halted;       // HALT_* reason, 0 while running
+    unsigned char verified;     // rom passed verify_state(), see chip8verify.h
+    uint32_t rng;               // xorshift state for 0xcXNN
+    struct chip8_prof *prof;    // guest profiler, see chip8prof.h
+    struct chip8_trace *trace;  // execution trace, see chip8trace.h
+
+    // SUPER-CHIP. Only engines with it (schip) touch these, and hgfx is
+    // last so copy_state() can leave it out while it's not in use.
+    unsigned char hires;        // 1 in 128x64 mode, drawing to hgfx
+    unsigned char rpl[16];      // RPL user flags, FX75/FX85
+#ifdef CHIP8_XO
+    // XO-CHIP. gfx and hgfx are plane 1, these are plane 2: a sprite row
+    // is the same few word ops on each plane selected
+    unsigned char planes;       // FN01 plane mask, bit 0 is plane 1
+    unsigned char pitch;        // FX3A, playback rate of the pattern
+    unsigned char pattern[16];  // F002, 128 one bit samples
+    uint64_t gfx2[GFX_H];
+    uint64_t hgfx2[HGFX_H][2];
+#endif
+    uint64_t hgfx[HGFX_H][2];   // hires VRAM
 }
 chip8_state;
 
+// A way of running the vm. Engines for the same machine must give the
+// same results and only differ in speed (the quirk profiles are each
+// their own machine). run does up to cycles instructions, stopping if
+// the vm halts, and returns how many it did.
+typedef struct {
+    const char *name;
+    long (*run)(chip8_state *state, long cycles);
+} chip8_engine;
+
+// NULL name ends the list
+extern const chip8_engine chip8_engines[];
+
 chip8_state * create_state();
+void copy_state(chip8_state *dst, const chip8_state *src);
 void load_rom(char *romfilename, chip8_state *state);
+int load_rom_buffer(chip8_state *state, const unsigned char *rom, int len);
 void unimplemented_opcode_err(unsigned short pc, unsigned short opcode);
 void invalid_opcode(unsigned short pc, unsigned short opcode);
 void emulate_opcode(chip8_state *state);
+void emulate_cycle(chip8_state *state);
+long run_cycles(chip8_state *state, long cycles);
+const chip8_engine * find_engine(const char *name);
+void tick_timers(chip8_state *state);
+unsigned char get_pixel(chip8_state *state, int x, int y);
 void update_keys(chip8_state *state);
 void dump_memory(chip8_state *state);
 void dump_state(chip8_state *state);
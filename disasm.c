@@ -1,275 +1,558 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h> // for memset
+#include <stdarg.h>
+#include <string.h> // for memset, memcpy, strchr, strcmp, strrchr, strlen
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h> // for write, sysconf
+#include <pthread.h>
+
+#include "chip8dis.h"
+#include "chip8flow.h"
+#include "chip8verify.h"
+
+// Everything is formatted into one of these and written out in one go,
+// one per thread in -batch mode
+typedef struct {
+    char *data;
+    size_t len, cap;
+} outbuf;
 
 void invalid_opcode(int address, unsigned short opcode);
+int load(const char *filename, unsigned char *memory);
+void linear(outbuf *out, const unsigned char *memory, int offset,
+        int end_of_rom);
+void listing(outbuf *out, const unsigned char *memory,
+        const chip8_flow *flow);
+void print_cfg(outbuf *out, const chip8_flow *flow);
+void load_prof(const char *filename);
+int batch(char **roms, int num_roms, const char *outdir, int threads,
+        int cfg);
+
+// From a recorded run (disasm -prof, made by chip8vm-prof -cover): which
+// pcs ran, which bytes DXYN drew, which FX33/FX55 wrote
+static int have_prof;
+static unsigned char ran[4096], sprite[4096], written[4096];
+// Instruction set the rom is read as (-isa), everything by default
+static int isa = ISA_XO;
 
 int main(int argc, char *argv[]){
+    int cfg = 0, batch_mode = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *outdir = NULL;
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (strcmp(argv[1], "-cfg") == 0)
+            cfg = 1;
+        else if (strcmp(argv[1], "-batch") == 0)
+            batch_mode = 1;
+        else if (strcmp(argv[1], "-prof") == 0 && argc > 2)
+        {
+            load_prof(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (strcmp(argv[1], "-isa") == 0 && argc > 2)
+        {
+            if (strcmp(argv[2], "chip8") == 0)
+                isa = ISA_CHIP8;
+            else if (strcmp(argv[2], "schip") == 0)
+                isa = ISA_SCHIP;
+            else if (strcmp(argv[2], "xochip") == 0)
+                isa = ISA_XO;
+            else
+            {
+                printf("-isa is chip8, schip or xochip\n");
+                exit(1);
+            }
+            argv++;
+            argc--;
+        }
+        else if (strcmp(argv[1], "-threads") == 0 && argc > 2)
+        {
+            threads = atoi(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (strcmp(argv[1], "-o") == 0 && argc > 2)
+        {
+            outdir = argv[2];
+            argv++;
+            argc--;
+        }
+        else
+            break;
+        argv++;
+        argc--;
+    }
     if (argc < 2)
     {
-        printf("Usage: disasm <romfile> [offset]\n");
+        printf("Usage: disasm [-cfg] [-prof cover.csv] "
+                "[-isa chip8|schip|xochip] <romfile> [offset]\n");
+        printf("       disasm -batch [-cfg] [-isa ...] [-threads N] "
+                "[-o dir] <romfile>...\n");
         exit(1);
     }
 
+    // Many roms, each to romfile.dis (or dir/romfile.dis)
+    if (batch_mode)
+    {
+        if (have_prof)
+        {
+            printf("-prof is for one rom at a time\n");
+            exit(1);
+        }
+        return batch(argv + 1, argc - 1, outdir, threads > 0 ? threads : 1,
+                cfg) != 0;
+    }
+
     // able to start disassembling from different offset
     // helpful to begin disassembly again after finding data
-    int offset = 0;
+    int offset = -1;
     if (argc == 3)
     {
         sscanf(argv[2], "%x", &offset);
     }
 
-
     // create ram
     unsigned char memory[4096];
-    memset(memory, 0, sizeof(memory));
-
-    // Open a romfile
-    FILE *romfile = fopen(argv[1], "r");
-    if (romfile == NULL)
+    int end_of_rom = load(argv[1], memory);
+    if (end_of_rom < 0)
     {
         printf("Could not open file: %s\n", argv[1]);
         exit(1);
     }
-    // determine length of program data:
-    // add 0x200 for starting after reserved memory
-    fseek(romfile, 0L, SEEK_END);
-    int end_byte = ftell(romfile) + 0x200;
-    fseek(romfile, 0L, SEEK_SET);
 
-    // load into ram.
-    fread(memory + 0x200, 1, 0xe00, romfile);
+    outbuf out = {NULL, 0, 0};
+    // An offset means the old straight through listing from there
+    if (offset >= 0 && !cfg)
+        linear(&out, memory, offset, end_of_rom);
+    else
+    {
+        chip8_flow *flow = flow_analyze(memory, 0x200, end_of_rom,
+                have_prof ? ran : NULL, isa);
+        if (flow == NULL)
+        {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        if (cfg)
+            print_cfg(&out, flow);
+        else
+            listing(&out, memory, flow);
+        flow_free(flow);
+    }
+    fflush(stdout);
+    write(1, out.data, out.len);
+    free(out.data);
+}
+
+// Room for n more bytes
+static void reserve(outbuf *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return;
+    b->cap = b->cap ? b->cap * 2 : 1 << 16;
+    while (b->len + n > b->cap)
+        b->cap *= 2;
+    b->data = realloc(b->data, b->cap);
+}
+
+static void bputs(outbuf *b, const char *s)
+{
+    size_t n = strlen(s);
+    reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void bputc(outbuf *b, char c)
+{
+    reserve(b, 1);
+    b->data[b->len++] = c;
+}
 
+// digits hex digits of v, the common case, without going through printf
+static void bhex(outbuf *b, unsigned int v, int digits)
+{
+    static const char hex[] = "0123456789abcdef";
+    reserve(b, digits);
+    for (int i = digits - 1; i >= 0; i--)
+        b->data[b->len++] = hex[(v >> (4 * i)) & 0xf];
+}
+
+static void bprintf(outbuf *b, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    reserve(b, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+}
+
+// Rom into memory at 0x200. Returns the end of it, or -1 if it can't be
+// read.
+int load(const char *filename, unsigned char *memory)
+{
+    memset(memory, 0, 4096);
+    // Open a romfile
+    FILE *romfile = fopen(filename, "r");
+    if (romfile == NULL)
+        return -1;
+    // load into ram; what it read is how long it is
+    int len = fread(memory + 0x200, 1, 0xe00, romfile);
     fclose(romfile);
+    return 0x200 + len;
+}
 
+// Every word from 0x200 + offset on, as an instruction
+void linear(outbuf *out, const unsigned char *memory, int offset,
+        int end_of_rom)
+{
     // Dump our memory contents to the console
-    printf("0x000 - 0x1ff: intended to be reserved\n");
-    printf("Offset from 0x200 is: %3x\n", offset);
+    bputs(out, "0x000 - 0x1ff: intended to be reserved\n");
+    bprintf(out, "Offset from 0x200 is: %3x\n", offset);
     int pc = 0x200 + offset;
-    int end_of_rom = (end_byte < 4096) ? end_byte : 4096;
     while (pc < end_of_rom)
     {
         // Print address line
-        printf("%03x: ", pc);
+        bhex(out, pc, 3);
+        bputs(out, ": ");
 
-        // Decode opcode. Mainly grouped by first nibble.
+        // Decode opcode
         unsigned short opcode = memory[pc] << 8 | memory[pc + 1];
-        pc += 2;
+        int len = pc + 3 < 4096 ? op_class_len(op_class_isa(opcode, isa)) : 2;
+        pc += len;
+
+        char text[MNEMONIC_LEN];
+        if (format_insn(memory + pc - len, isa, text) != 0)
+        {
+            // What's listed so far, then the error
+            fflush(stdout);
+            write(1, out->data, out->len);
+            invalid_opcode(pc, opcode);
+        }
+        bputs(out, text);
+        bputc(out, '\n');
+    }
+}
+
+// The pc, mem and sprite rows of a profile (see chip8prof.c)
+void load_prof(const char *filename)
+{
+    FILE *in = fopen(filename, "r");
+    if (in == NULL)
+    {
+        printf("Could not open file: %s\n", filename);
+        exit(1);
+    }
+    char line[256];
+    unsigned int addr;
+    unsigned long long count, reads, writes;
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        if (sscanf(line, "pc,%x,%llu", &addr, &count) == 2)
+            ran[addr & 0xfff] = 1;
+        else if (sscanf(line, "mem,%x,,%llu,%llu", &addr, &reads,
+                    &writes) == 3)
+            written[addr & 0xfff] = writes != 0;
+        else if (sscanf(line, "sprite,%x,%llu", &addr, &count) == 2)
+            sprite[addr & 0xfff] = 1;
+    }
+    fclose(in);
+    have_prof = 1;
+}
+
+// What a data byte was used for, if a profile says: 's'prite,
+// 'w'ritten (FX33/FX55 scratch), or 0
+static int data_kind(int addr)
+{
+    if (addr < 0 || addr >= 4096)
+        return 0;
+    return sprite[addr] ? 's' : written[addr] ? 'w' : 0;
+}
+
+// Name for a labelled address, or NULL
+static const char * label_name(const chip8_flow *flow, int addr, char *buf)
+{
+    if (addr < 0 || addr >= 4096)
+        return NULL;
+    unsigned char f = flow->flags[addr];
+    if (addr == flow->start && (f & FLOW_INSN))
+        return "main";
+    if ((f & FLOW_SUB) && (f & FLOW_INSN))
+        sprintf(buf, "sub_%03x", addr);
+    else if ((f & FLOW_JUMP) && (f & FLOW_INSN))
+        sprintf(buf, "L%03x", addr);
+    else if ((f & FLOW_DATA) || (data_kind(addr) &&
+                !flow_is_code(flow, addr) && data_kind(addr - 1) !=
+                data_kind(addr)))
+        sprintf(buf, "%s_%03x", data_kind(addr) == 's' ? "sprite" :
+                data_kind(addr) == 'w' ? "scratch" : "data", addr);
+    else
+        return NULL;
+    return buf;
+}
+
+// Labelled lines: the address operand of jumps, calls and INDEX becomes
+// the label name, when there is one
+void listing(outbuf *out, const unsigned char *memory,
+        const chip8_flow *flow)
+{
+    char name[16], text[MNEMONIC_LEN];
+
+    bprintf(out, "%% %i instructions in %i blocks, %i subroutines, "
+            "%i data bytes\n", flow->num_insns, flow->num_blocks,
+            flow->num_subs, flow->data_bytes);
+    if (flow->indirect > 0)
+        bprintf(out, "%% %i indirect jump(s) (BNNN), some code may show as "
+                "data\n", flow->indirect);
+    if (flow->outside > 0)
+        bprintf(out, "%% %i jump(s) or call(s) leave the rom\n",
+                flow->outside);
+    chip8_verify ver;
+    if (flow_verify(flow, memory, &ver) == 0)
+        bprintf(out, "%% verified: calls at most %i deep, I always in "
+                "memory, no code written over (runs unchecked)\n",
+                ver.depth);
+    else if (ver.addr >= 0)
+        bprintf(out, "%% not verified: %s at %03x\n", ver.why, ver.addr);
+    else
+        bprintf(out, "%% not verified: %s\n", ver.why);
+    if (have_prof)
+    {
+        int runs = 0, sprites = 0, writes = 0;
+        for (int a = flow->start; a < flow->end; a++)
+        {
+            runs += ran[a];
+            sprites += sprite[a];
+            writes += written[a];
+        }
+        bprintf(out, "%% profile: %i pcs ran (%i only found by running), "
+                "%i sprite bytes, %i bytes written\n", runs, flow->seeded,
+                sprites, writes);
+    }
+    for (int s = 0; s < flow->num_subs; s++)
+    {
+        int printed = 0;
+        for (int c = 0; c < flow->num_calls; c++)
+        {
+            if (flow->calls[c].from != flow->subs[s])
+                continue;
+            if (!printed++)
+                bprintf(out, "%% %s ->",
+                        label_name(flow, flow->subs[s], name));
+            char to[16];
+            const char *l = label_name(flow, flow->calls[c].to, to);
+            if (l != NULL)
+                bprintf(out, " %s", l);
+            else
+                bprintf(out, " $%03x", flow->calls[c].to);
+        }
+        if (printed)
+            bputc(out, '\n');
+    }
+
+    int addr = flow->start;
+    while (addr < flow->end)
+    {
+        const char *l = label_name(flow, addr, name);
+        if (l != NULL)
+        {
+            bputs(out, l);
+            bputs(out, ":\n");
+        }
 
-        // Get just first nibble
-        // Shifts are 4 * nibbles moved bc 4 bits to a nibble
-        // (ie, this first shifts 0xa000 to 0xa by shifting 3*4 = 12)
-        switch ((opcode & 0xf000)>> 12)
+        if (flow->flags[addr] & FLOW_INSN)
         {
-            case 0x0:
-                if (opcode == 0x00e0)
-                    // Clear screen
-                    printf("CLRS\n");
-                else if (opcode == 0x00ee)
-                    // Return from subroutine
-                    printf("RET\n");
-                else
-                    printf("CALLPROG $%03x\n", opcode & 0xfff);
-                break;
-            case 0x1:
-                // calls RCA 1802 program at address. Unlikely to see in ROM
-                printf("GOTO $%03x\n", opcode & 0xfff);
-                break;
-            case 0x2:
-                // Call subroutine
-                printf("CALL $%03x\n", opcode & 0xfff);
-                break;
-            case 0x3:
-                // Skip next instruction if VX == NN
-                printf("TEQ.I V%x $%02x\n",
-                        (opcode & 0xf00) >> 8,
-                        opcode & 0xff);
-                break;
-            case 0x4:
-                // Skip next instruction if VX != NN
-                printf("TNE.I V%x $%02x\n",
-                        (opcode & 0xf00) >> 8,
-                        opcode & 0xff);
-                break;
-            case 0x5:
-                // Skip next instruction if VX == VY
-                // opcode must end in 0 or isn't valid
-                if ((opcode & 0xf) != 0)
-                    invalid_opcode(pc, opcode);
-                printf("TEQ V%x V%x\n",
-                        (opcode & 0xf00) >> 8,
-                        (opcode & 0xf0) >> 4);
-                break;
-            case 0x6:
-                // Sets VX to NN
-                printf("MOV.I V%x $%02x\n",
-                        (opcode & 0xf00) >> 8,
-                        opcode & 0xff);
-                break;
-            case 0x7:
-                // Increment VX by NN
-                printf("INC.I V%x $%02x\n",
-                        (opcode & 0xf00) >> 8,
-                        opcode & 0xff);
-                break;
-            case 0x8:
-                // 0x8??? gets messier than the very neat categories so far.
-                // and operate on VX and VY depending on last hex digit
-                switch (opcode & 0xf)
-                {
-                    case 0x0:
-                        // Assign VX value in VY
-                        printf("MOV.V V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x1:
-                        // VX = VX | VY
-                        printf("OR V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x2:
-                        // VX = VX & VY
-                        printf("AND V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x3:
-                        // VX = VX ^ VY
-                        printf("XOR V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x4:
-                        // Increment VX by VY
-                        printf("INC.V V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x5:
-                        // Decrement VX by VY
-                        printf("SUB V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x6:
-                        // Shift VY right by one and set into VX
-                        // This behavior changed in 48 and Super
-                        printf("SHR V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    case 0x7:
-                        // VX = VY - VX
-                        printf("LESS V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    // No 0x8XY8 - 0x8XYd, or *f
-                    case 0xe:
-                        // Shifts VY left by one and stores in VX
-                        // Like 0x8XY6, was patched in -48 and Super
-                        printf("SHL V%x V%x\n",
-                                (opcode & 0xf00) >> 8,
-                                (opcode & 0xf0) >> 4);
-                        break;
-                    default:
-                        invalid_opcode(pc, opcode);
-                }
-            // (Back to first nibble decoding)
-            case 0x9:
-                if ((opcode & 0xf) != 0)
-                {
-                    invalid_opcode(pc, opcode);
-                }
-                // Otherwise, 0x9XY0 is skip next instruction if VX != VY
-                printf("TNE V%x V%x\n",
-                        (opcode & 0xf00) >> 8,
-                        (opcode & 0xf0) >> 4);
-                break;
-            case 0xa:
-                // Set index register (I) to adress NNN
-                printf("INDEX $%03x\n", opcode & 0xfff);
-                break;
-            case 0xb:
-                // Jump PC to address V0 + NNN
-                printf("JMPOFF $%03x\n", opcode & 0xfff);
-                break;
-            case 0xc:
-                // Set VX to random number between 0 and 255,
-                // bitmasked with NN
-                printf("RAND V%x $%02x\n",
-                        (opcode & 0xf00) >> 8,
-                        opcode & 0xff);
-                break;
-            case 0xd:
-                // 0xdXYN
-                // Draw sprite of N height at address in I
-                // to coords VX, VY (all sprites are 8 bits wide)
-                printf("DRAW V%x V%x %x\n",
-                        (opcode & 0xf00) >> 8,
-                        (opcode & 0xf0) >> 4,
-                        opcode & 0xf);
-                break;
-            case 0xe:
-                // Skip next instruction if key stored in VX is pressed:
-                if ((opcode & 0xff) == 0x9e)
-                    printf("TKEY V%x\n", (opcode & 0xf00) >> 8);
-                // Skip next instruction if key NOT pressed:
-                else if ((opcode & 0xff) == 0xa1)
-                    printf("TNKEY V%x\n", (opcode & 0xf00) >> 8);
-                else
-                    invalid_opcode(pc, opcode);
-                break;
-            case 0xf:
-                // Another messy one, depends on last 2 digits
-                switch (opcode & 0xff)
-                {
-                    case 0x07:
-                        // Set VX to value of delay timer
-                        printf("SET.DT V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x0a:
-                        // Wait for keypress, then store it in VX
-                        // Blocking operation
-                        printf("GETKEY V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x15:
-                        // Set delay timer to VX
-                        printf("GET.DT V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x18:
-                        // Set sound timer to VX
-                        printf("SET.ST V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x1e:
-                        // Add VX to I Set VF to if overflowed
-                        printf("IADD V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x29:
-                        // sets I to the built-in sprite address for the
-                        // character stored in VX
-                        printf("FONT V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x33:
-                        // Stores BCD of VX starting at I
-                        printf("BCD V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x55:
-                        // Stores registers V0 to & incl. VX into memory
-                        printf("STORE V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    case 0x65:
-                        // Loads registers v0 to & incl. VX from memory
-                        printf("LOAD V%x\n", (opcode & 0xf00) >> 8);
-                        break;
-                    default:
-                        // Invalid opcode starting with 0xf
-                        invalid_opcode(pc, opcode);
-                }
+            unsigned short op = memory[addr] << 8 | memory[addr + 1];
+            int cls = flow_class(flow, memory, addr);
+            int len = flow->flags[addr] & FLOW_LONG ? 4 : 2;
+            // F000 NNNN's address is the NNNN
+            int to = len == 4 ? memory[addr + 2] << 8 | memory[addr + 3] :
+                op & 0xfff;
+            // Invalid ones as the word, so the listing still assembles
+            if (len == 2 && cls == OP_LONGI)
+                snprintf(text, sizeof(text), "DW $%04x", op);
+            else if (format_insn(memory + addr, flow->isa, text) < 0)
+                snprintf(text, sizeof(text), "DW $%04x", op);
+            char *dollar = strchr(text, '$');
+            char target[16];
+            bhex(out, addr, 3);
+            bputs(out, ": ");
+            if ((cls == OP_GOTO || cls == OP_CALL || cls == OP_JMPOFF ||
+                    cls == OP_INDEX || cls == OP_LONGI) && dollar != NULL &&
+                    to >= flow->start && to < flow->end &&
+                    label_name(flow, to, target) != NULL)
+            {
+                *dollar = '\0';
+                bputs(out, text);
+                bputs(out, target);
+            }
+            else
+                bputs(out, text);
+            if (flow->flags[addr] & FLOW_BAD)
+                bputs(out, "  % not valid CHIP-8");
+            int wrote = 0, overlap = 0;
+            for (int i = 0; i < len; i++)
+                wrote |= written[addr + i];
+            for (int i = 1; i < len && !overlap; i++)
+                if (flow->flags[addr + i] & FLOW_INSN)
+                    overlap = addr + i;
+            if (wrote)
+                bputs(out, "  % written at run time");
+            if (have_prof && !ran[addr])
+                bputs(out, "  % never ran");
+            if (overlap)
+                bprintf(out, "  %% overlaps code at %03x", overlap);
+            bputc(out, '\n');
+            addr += len;
+            continue;
         }
+
+        // Sprites a row a line, drawn
+        int kind = data_kind(addr);
+        if (kind == 's')
+        {
+            bhex(out, addr, 3);
+            bputs(out, ": DB $");
+            bhex(out, memory[addr], 2);
+            bputs(out, "  % ");
+            for (int b = 7; b >= 0; b--)
+                bputc(out, memory[addr] >> b & 1 ? '#' : '.');
+            bputc(out, '\n');
+            addr++;
+            continue;
+        }
+
+        // Data: up to 8 bytes a line, stopping at anything labelled
+        bhex(out, addr, 3);
+        bputs(out, ": DB");
+        int n = 0;
+        do
+        {
+            bputs(out, " $");
+            bhex(out, memory[addr++], 2);
+            n++;
+        } while (n < 8 && addr < flow->end &&
+                !flow_is_code(flow, addr) && data_kind(addr) == kind &&
+                label_name(flow, addr, name) == NULL);
+        if (kind == 'w')
+            bputs(out, "  % FX33/FX55 scratch");
+        // Bytes that are the tail of an instruction starting before them
+        // are code overlapping data; let the instruction line say so
+        while (addr < flow->end && !(flow->flags[addr] & FLOW_INSN) &&
+                flow_is_code(flow, addr))
+            addr++;
+        bputc(out, '\n');
+    }
+}
+
+// Blocks with where they go, then the call graph
+void print_cfg(outbuf *out, const chip8_flow *flow)
+{
+    char name[16];
+    for (int b = 0; b < flow->num_blocks; b++)
+    {
+        const flow_block *blk = &flow->blocks[b];
+        const char *l = label_name(flow, blk->start, name);
+        bprintf(out, "block %03x-%03x %-8s %-6s ->", blk->start,
+                blk->end - 2, l != NULL ? l : "",
+                op_class_mnemonic(blk->last_class));
+        for (int i = 0; i < blk->num_succ; i++)
+            bprintf(out, " %03x", blk->succ[i]);
+        if (blk->num_succ == 0)
+            bputs(out, " (none)");
+        bputc(out, '\n');
     }
+    for (int c = 0; c < flow->num_calls; c++)
+        bprintf(out, "call %03x -> %03x\n", flow->calls[c].from,
+                flow->calls[c].to);
+}
+
+typedef struct {
+    char **roms;
+    int num_roms;
+    const char *outdir;
+    int cfg;
+    int next;           // next rom to take, atomically
+    long insns;         // totals, atomically
+    int failed;
+} batch_job;
+
+static void * batch_worker(void *arg)
+{
+    batch_job *job = arg;
+    unsigned char memory[4096];
+    outbuf out = {NULL, 0, 0};
+    char path[1024];
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+            job->num_roms)
+    {
+        const char *rom = job->roms[i];
+        int end_of_rom = load(rom, memory);
+        chip8_flow *flow = end_of_rom < 0 ? NULL :
+            flow_analyze(memory, 0x200, end_of_rom, NULL, isa);
+        if (flow == NULL)
+        {
+            fprintf(stderr, "Could not read %s\n", rom);
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        out.len = 0;
+        if (job->cfg)
+            print_cfg(&out, flow);
+        else
+            listing(&out, memory, flow);
+        __atomic_fetch_add(&job->insns, flow->num_insns, __ATOMIC_RELAXED);
+        flow_free(flow);
+
+        if (job->outdir != NULL)
+        {
+            const char *base = strrchr(rom, '/');
+            snprintf(path, sizeof(path), "%s/%s.dis", job->outdir,
+                    base != NULL ? base + 1 : rom);
+        }
+        else
+            snprintf(path, sizeof(path), "%s.dis", rom);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, out.data, out.len) != (ssize_t)out.len)
+        {
+            fprintf(stderr, "Could not write %s\n", path);
+            __atomic_fetch_add(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    free(out.data);
+    return NULL;
+}
+
+// Disassemble every rom on threads threads, each to its own .dis file.
+// Returns how many couldn't be done.
+int batch(char **roms, int num_roms, const char *outdir, int threads,
+        int cfg)
+{
+    batch_job job = {roms, num_roms, outdir, cfg, 0, 0, 0};
+    if (threads > num_roms)
+        threads = num_roms > 0 ? num_roms : 1;
+    pthread_t tids[threads];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&tids[t], NULL, batch_worker, &job);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%i roms (%i failed), %li instructions on %i threads in %.2fs\n",
+            num_roms, job.failed, job.insns, threads,
+            t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    return job.failed;
 }
 
 // Handles printing error messages when encountering an invalid opcode
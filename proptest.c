@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strcmp
+#include <time.h>
+#include <unistd.h> // for sysconf
+#include <pthread.h>
+
+#include "chip8vm.h"
+#include "chip8ref.h"
+
+// Property tests: for every opcode, lots of random states, each run for
+// one instruction on an engine and on the reference model (chip8ref.c).
+// The two have to agree on the whole state afterwards. The first failing
+// state for an opcode is shrunk (fields zeroed while it still fails) and
+// printed, with the seed to get it back.
+//
+// Usage: chip8prop [-n cases per opcode] [-threads N] [-seed N]
+//                  [-engine name]
+
+typedef struct {
+    const char *name;
+    unsigned short base;
+    unsigned short operands;    // bits filled in at random
+} prop_op;
+
+static const prop_op ops[] = {
+    {"00E0", 0x00e0, 0x0000},
+    {"00EE", 0x00ee, 0x0000},
+    {"0NNN", 0x0000, 0x0fff},
+    {"1NNN", 0x1000, 0x0fff},
+    {"2NNN", 0x2000, 0x0fff},
+    {"3XNN", 0x3000, 0x0fff},
+    {"4XNN", 0x4000, 0x0fff},
+    {"5XYN", 0x5000, 0x0fff},
+    {"6XNN", 0x6000, 0x0fff},
+    {"7XNN", 0x7000, 0x0fff},
+    {"8XY0", 0x8000, 0x0ff0},
+    {"8XY1", 0x8001, 0x0ff0},
+    {"8XY2", 0x8002, 0x0ff0},
+    {"8XY3", 0x8003, 0x0ff0},
+    {"8XY4", 0x8004, 0x0ff0},
+    {"8XY5", 0x8005, 0x0ff0},
+    {"8XY6", 0x8006, 0x0ff0},
+    {"8XY7", 0x8007, 0x0ff0},
+    {"8XYE", 0x800e, 0x0ff0},
+    {"8XYN", 0x8000, 0x0fff},
+    {"9XYN", 0x9000, 0x0fff},
+    {"ANNN", 0xa000, 0x0fff},
+    {"BNNN", 0xb000, 0x0fff},
+    {"CXNN", 0xc000, 0x0fff},
+    {"DXYN", 0xd000, 0x0fff},
+    {"EX9E", 0xe09e, 0x0f00},
+    {"EXA1", 0xe0a1, 0x0f00},
+    {"EXNN", 0xe000, 0x0fff},
+    {"FX07", 0xf007, 0x0f00},
+    {"FX0A", 0xf00a, 0x0f00},
+    {"FX15", 0xf015, 0x0f00},
+    {"FX18", 0xf018, 0x0f00},
+    {"FX1E", 0xf01e, 0x0f00},
+    {"FX29", 0xf029, 0x0f00},
+    {"FX33", 0xf033, 0x0f00},
+    {"FX55", 0xf055, 0x0f00},
+    {"FX65", 0xf065, 0x0f00},
+    {"FXNN", 0xf000, 0x0fff},
+};
+#define NUM_OPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+// Cases handed out to a thread at a time
+#define CHUNK (1 << 16)
+
+static const chip8_engine *engine;
+static long cases = 1000000;
+static uint64_t seed;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long next_job = 0;
+static long failures[NUM_OPS];
+static int shown[NUM_OPS];
+
+static uint64_t next_rand(uint64_t *r)
+{
+    *r ^= *r << 13;
+    *r ^= *r >> 7;
+    *r ^= *r << 17;
+    return *r;
+}
+
+// A random state with op's opcode at pc. memory is only partly redone:
+// the bytes at I, which is all the opcodes read.
+static void random_state(chip8_state *s, const prop_op *op, uint64_t *r)
+{
+    uint64_t n = next_rand(r);
+    unsigned short opcode = op->base | (n & op->operands);
+    int x = (opcode >> 8) & 0xf, y = (opcode >> 4) & 0xf;
+
+    for (int i = 0; i < 16; i += 8)
+    {
+        uint64_t bytes = next_rand(r);
+        for (int j = 0; j < 8; j++)
+            s->v[i + j] = bytes >> (8 * j);
+    }
+    // Equal values now and then, or skips would almost never be taken
+    n = next_rand(r);
+    if (n % 4 == 0)
+        s->v[x] = opcode & 0xff;
+    else if (n % 4 == 1)
+        s->v[y] = s->v[x];
+
+    n = next_rand(r);
+    // Anywhere at all: I + 15, skips and key numbers all wrap
+    s->index_reg = n & 0xfff;
+    s->pc = (n >> 16) & 0xfff;
+    s->sp = (n >> 32) & 0xf;
+    s->delay_timer = n >> 40;
+    s->sound_timer = n >> 48;
+    s->key_flag = n >> 56;
+
+    n = next_rand(r);
+    for (int i = 0; i < 16; i++)
+        s->key[i] = (n >> i) & 1;
+    for (int i = 0; i < 16; i++)
+        s->stack[i] = (n >> (16 + 2 * i)) & 0xfff;
+    s->draw_flag = (n >> 63) & 1;
+    s->rng = next_rand(r) | 1;
+    for (int i = 0; i < GFX_H; i++)
+        s->gfx[i] = next_rand(r);
+    for (int i = 0; i < 16; i += 8)
+    {
+        uint64_t bytes = next_rand(r);
+        for (int j = 0; j < 8; j++)
+            s->memory[(s->index_reg + i + j) & 0xfff] = bytes >> (8 * j);
+    }
+
+    s->halted = HALT_NONE;
+    s->opcode = 0;
+    s->memory[s->pc] = opcode >> 8;
+    s->memory[(s->pc + 1) & 0xfff] = opcode & 0xff;
+}
+
+// Run pre on the engine (into a) and the reference (into b). Returns 1,
+// and what differs, if they disagree.
+static int check(const chip8_state *pre, chip8_state *a, chip8_state *b,
+        char *what)
+{
+    copy_state(a, pre);
+    copy_state(b, pre);
+    engine->run(a, 1);
+    ref_step(b);
+    return ref_diff(a, b, 1, what);
+}
+
+// Zero what can be zeroed while pre still fails
+static void shrink(chip8_state *pre, chip8_state *a, chip8_state *b)
+{
+    char what[REF_DIFF_LEN];
+#define TRY(field, value) \
+    do { __typeof__(field) old_ = (field); (field) = (value); \
+        if (!check(pre, a, b, what)) (field) = old_; else changed = 1; \
+    } while (0)
+    int changed = 1;
+    for (int pass = 0; changed && pass < 8; pass++)
+    {
+        changed = 0;
+        for (int i = 0; i < 16; i++)
+            TRY(pre->v[i], 0);
+        TRY(pre->index_reg, 0);
+        TRY(pre->sp, 0);
+        for (int i = 0; i < 16; i++)
+            TRY(pre->stack[i], 0);
+        TRY(pre->delay_timer, 0);
+        TRY(pre->sound_timer, 0);
+        for (int i = 0; i < 16; i++)
+            TRY(pre->key[i], 0);
+        TRY(pre->key_flag, 0);
+        TRY(pre->draw_flag, 0);
+        TRY(pre->rng, 1);
+        for (int i = 0; i < GFX_H; i++)
+            TRY(pre->gfx[i], 0);
+
+        // Memory in halving chunks, leaving the opcode be
+        unsigned char saved[4096];
+        for (int size = 2048; size >= 1; size /= 2)
+            for (int start = 0; start < 4096; start += size)
+            {
+                int op2 = (pre->pc + 1) & 0xfff;
+                if ((start <= pre->pc && pre->pc < start + size) ||
+                        (start <= op2 && op2 < start + size))
+                    continue;
+                int nonzero = 0;
+                for (int i = start; i < start + size; i++)
+                    nonzero |= pre->memory[i];
+                if (!nonzero)
+                    continue;
+                memcpy(saved, pre->memory + start, size);
+                memset(pre->memory + start, 0, size);
+                if (check(pre, a, b, what))
+                    changed = 1;
+                else
+                    memcpy(pre->memory + start, saved, size);
+            }
+    }
+#undef TRY
+}
+
+// Everything left non zero in a shrunk state
+static void print_state(const chip8_state *s)
+{
+    int op2 = (s->pc + 1) & 0xfff;
+    printf("    pc %03x: %02x%02x", s->pc, s->memory[s->pc], s->memory[op2]);
+    for (int i = 0; i < 16; i++)
+        if (s->v[i])
+            printf("  V%X=%02x", i, s->v[i]);
+    if (s->index_reg)
+        printf("  I=%03x", s->index_reg);
+    if (s->sp)
+        printf("  sp=%x", s->sp);
+    for (int i = 0; i < 16; i++)
+        if (s->stack[i])
+            printf("  stack[%i]=%03x", i, s->stack[i]);
+    if (s->delay_timer)
+        printf("  DT=%02x", s->delay_timer);
+    if (s->sound_timer)
+        printf("  ST=%02x", s->sound_timer);
+    for (int i = 0; i < 16; i++)
+        if (s->key[i])
+            printf("  key %X down", i);
+    if (s->key_flag)
+        printf("  key_flag=%02x", s->key_flag);
+    if (s->rng != 1)
+        printf("  rng=%08x", s->rng);
+    printf("\n");
+    int shown_bytes = 0;
+    for (int i = 0; i < 4096; i++)
+        if (s->memory[i] && i != s->pc && i != op2 && shown_bytes++ < 16)
+            printf("    memory[%03x]=%02x\n", i, s->memory[i]);
+    for (int i = 0; i < GFX_H; i++)
+        if (s->gfx[i])
+            printf("    gfx row %i=%016llx\n", i, (unsigned long long)s->gfx[i]);
+}
+
+static void * worker(void *arg)
+{
+    (void)arg;
+    chip8_state *pre = create_state();
+    chip8_state *a = malloc(sizeof(chip8_state));
+    chip8_state *b = malloc(sizeof(chip8_state));
+    char what[REF_DIFF_LEN];
+    long chunks = (cases + CHUNK - 1) / CHUNK;
+
+    for (;;)
+    {
+        long job = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if (job >= NUM_OPS * chunks)
+            break;
+        int o = job / chunks;
+        long first = (job % chunks) * CHUNK;
+        long last = first + CHUNK < cases ? first + CHUNK : cases;
+
+        // Every chunk has its own seed, so any case can be found again
+        // whatever thread ran it
+        uint64_t r = (seed ^ (uint64_t)job * 0x9e3779b97f4a7c15ULL) | 1;
+        for (int i = 0; i < 4096; i += 8)
+        {
+            uint64_t bytes = next_rand(&r);
+            for (int j = 0; j < 8; j++)
+                pre->memory[i + j] = bytes >> (8 * j);
+        }
+        long failed = 0;
+        for (long c = first; c < last; c++)
+        {
+            random_state(pre, &ops[o], &r);
+            if (!check(pre, a, b, what))
+                continue;
+            if (failed++ > 0)
+                continue;
+
+            pthread_mutex_lock(&lock);
+            if (!shown[o])
+            {
+                shown[o] = 1;
+                printf("FAIL %s, case %li: %s\n", ops[o].name, c, what);
+                shrink(pre, a, b);
+                check(pre, a, b, what);
+                printf("  shrunk: %s\n", what);
+                print_state(pre);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+        __atomic_fetch_add(&failures[o], failed, __ATOMIC_RELAXED);
+    }
+    free(pre);
+    free(a);
+    free(b);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *name = "switch";
+    seed = time(0);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            cases = atol(argv[++i]);
+        else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+            seed = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc)
+            name = argv[++i];
+        else
+        {
+            printf("Usage: chip8prop [-n cases per opcode] [-threads N] "
+                    "[-seed N]\n");
+            printf("                 [-engine name]\n");
+            exit(1);
+        }
+    }
+    engine = find_engine(name);
+    if (engine == NULL)
+    {
+        printf("ERROR: no engine called %s\n", name);
+        exit(1);
+    }
+    if (cases < 1 || threads < 1)
+    {
+        printf("ERROR: -n and -threads must be positive\n");
+        exit(1);
+    }
+
+    printf("%s against the reference model: %li cases per opcode, "
+            "%i threads, seed %llu\n", engine->name, cases, threads,
+            (unsigned long long)seed);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_t tids[threads];
+    for (int t = 0; t < threads; t++)
+        pthread_create(&tids[t], NULL, worker, NULL);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    int failed_ops = 0;
+    for (int o = 0; o < NUM_OPS; o++)
+    {
+        if (failures[o] == 0)
+            continue;
+        printf("%s: %li of %li failed\n", ops[o].name, failures[o], cases);
+        failed_ops++;
+    }
+    printf("%i opcodes, %li cases in %.2fs (%.1fM/s): %i failing\n", NUM_OPS,
+            NUM_OPS * cases, secs, NUM_OPS * cases / secs / 1e6, failed_ops);
+    return failed_ops != 0;
+}
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strcmp, strlen, memset
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "chip8vm.h"
+#include "chip8prof.h"
+#include "chip8verify.h"
+#include "regress.h"
+
+#define R_PASS 0
+#define R_FAIL 1
+#define R_NEW 2     // no golden file yet, wrote one
+#define R_UPDATED 3
+
+// Key log changes kept per rom
+#define MAX_KEY_EVENTS 4096
+
+typedef struct {
+    char name[256];
+    int status;
+    char why[128];      // for R_FAIL
+    int checkpoints;
+    long instrs;
+    double secs;
+    int halted_frame;   // -1 if it never halted
+    unsigned short halted_pc;
+} regress_rom;
+
+typedef struct {
+    const char *dir;
+    const regress_opts *opts;
+    const chip8_state *fresh;
+    regress_rom *roms;
+    int num_roms;
+    int next;           // next rom to take, atomically
+} regress_job;
+
+// A row at a time: multiply, then fold the top down, so the left hand
+// pixels (high bits) can't cancel out between rows
+static uint64_t hash_gfx(const chip8_state *state)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int y = 0; y < GFX_H; y++)
+    {
+        h = (h ^ state->gfx[y]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    // SUPER-CHIP hires screen too, if that's what's showing (lores
+    // hashes stay as they were)
+    for (int y = 0; state->hires && y < HGFX_H; y++)
+        for (int i = 0; i < 2; i++)
+        {
+            h = (h ^ state->hgfx[y][i]) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 29;
+        }
+#ifdef CHIP8_XO
+    // XO-CHIP plane 2, rows with anything on only, so plane 1 only
+    // screens hash the same as in other builds
+    for (int y = 0; y < HGFX_H; y++)
+        for (int i = 0; i < 3; i++)
+        {
+            uint64_t row = i == 2 ? (y < GFX_H ? state->gfx2[y] : 0) :
+                state->hgfx2[y][i];
+            if (row)
+            {
+                h = (h ^ row ^ (uint64_t)(y * 3 + i) << 56) *
+                    0x9e3779b97f4a7c15ULL;
+                h ^= h >> 29;
+            }
+        }
+#endif
+    return h;
+}
+
+// Key log into frames[]/masks[]. Returns how many, 0 if there's no log.
+static int read_keys(const char *path, int *frames, unsigned short *masks)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+        return 0;
+    char line[128];
+    int n = 0;
+    unsigned int frame, mask;
+    while (n < MAX_KEY_EVENTS && fgets(line, sizeof(line), in) != NULL)
+    {
+        if (line[0] == '#' || sscanf(line, "%u %x", &frame, &mask) != 2)
+            continue;
+        frames[n] = frame;
+        masks[n] = mask;
+        n++;
+    }
+    fclose(in);
+    return n;
+}
+
+static void run_rom(regress_job *job, regress_rom *rom, chip8_state *state)
+{
+    const regress_opts *opts = job->opts;
+    char path[1024];
+    int key_frames[MAX_KEY_EVENTS];
+    unsigned short key_masks[MAX_KEY_EVENTS];
+
+    copy_state(state, job->fresh);
+    snprintf(path, sizeof(path), "%s/%s", job->dir, rom->name);
+    load_rom(path, state);
+    // For the verified engine: unchecked if the rom passes
+    verify_state(state, NULL);
+    snprintf(path, sizeof(path), "%s/%s.keys", job->dir, rom->name);
+    int num_keys = read_keys(path, key_frames, key_masks);
+
+    int max_checks = opts->frames / opts->every;
+    uint64_t *hashes = malloc((max_checks + 1) * sizeof(uint64_t));
+    rom->checkpoints = 0;
+    rom->instrs = 0;
+    rom->halted_frame = -1;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int k = 0;
+    for (int f = 0; f < opts->frames; f++)
+    {
+        for (; k < num_keys && key_frames[k] <= f; k++)
+            for (int i = 0; i < 16; i++)
+                state->key[i] = (key_masks[k] >> i) & 1;
+        rom->instrs += opts->engine->run(state, CYCLES_PER_FRAME);
+        if (state->halted && rom->halted_frame < 0)
+        {
+            rom->halted_frame = f;
+            rom->halted_pc = state->pc;
+        }
+        tick_timers(state);
+        if ((f + 1) % opts->every == 0)
+            hashes[rom->checkpoints++] = hash_gfx(state);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    rom->secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    snprintf(path, sizeof(path), "%s/%s.golden", job->dir, rom->name);
+    FILE *golden = opts->update ? NULL : fopen(path, "r");
+    if (golden != NULL)
+    {
+        // Check every golden checkpoint we have a hash for the frame of
+        rom->status = R_PASS;
+        char line[128];
+        int frame, checked = 0;
+        unsigned long long want;
+        while (fgets(line, sizeof(line), golden) != NULL)
+        {
+            if (sscanf(line, "%i %llx", &frame, &want) != 2)
+                continue;
+            int c = frame / opts->every - 1;
+            if (frame % opts->every != 0 || c < 0 || c >= rom->checkpoints)
+            {
+                rom->status = R_FAIL;
+                snprintf(rom->why, sizeof(rom->why), "no checkpoint at "
+                        "frame %i (-frames or -every changed?)", frame);
+                break;
+            }
+            if (hashes[c] != want)
+            {
+                rom->status = R_FAIL;
+                snprintf(rom->why, sizeof(rom->why), "frame %i: expected "
+                        "%016llx, got %016llx", frame, want,
+                        (unsigned long long)hashes[c]);
+                break;
+            }
+            checked++;
+        }
+        fclose(golden);
+        // An empty or cut short golden file would otherwise pass on
+        // whatever it did have
+        if (rom->status == R_PASS && checked < rom->checkpoints)
+        {
+            rom->status = R_FAIL;
+            snprintf(rom->why, sizeof(rom->why), "golden file has %i of %i "
+                    "checkpoints (truncated? -update rewrites it)", checked,
+                    rom->checkpoints);
+        }
+    }
+    else
+    {
+        rom->status = opts->update ? R_UPDATED : R_NEW;
+        FILE *out = fopen(path, "w");
+        if (out == NULL)
+        {
+            rom->status = R_FAIL;
+            snprintf(rom->why, sizeof(rom->why),
+                    "could not write %.100s.golden", rom->name);
+        }
+        else
+        {
+            for (int c = 0; c < rom->checkpoints; c++)
+                fprintf(out, "%i %016llx\n", (c + 1) * opts->every,
+                        (unsigned long long)hashes[c]);
+            fclose(out);
+        }
+    }
+    free(hashes);
+}
+
+static void * worker(void *arg)
+{
+    regress_job *job = arg;
+    chip8_state *state = malloc(sizeof(chip8_state));
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+            job->num_roms)
+        run_rom(job, &job->roms[i], state);
+    free(state);
+    return NULL;
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(((const regress_rom *)a)->name,
+            ((const regress_rom *)b)->name);
+}
+
+// Run every .ch8 in dir. Returns how many failed.
+int regress_dir(const char *dir, const regress_opts *opts)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        printf("Could not open directory: %s\n", dir);
+        exit(1);
+    }
+    int cap = 64, n = 0;
+    regress_rom *roms = malloc(cap * sizeof(regress_rom));
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        if (len < 5 || len >= sizeof(roms->name) ||
+                strcmp(ent->d_name + len - 4, ".ch8") != 0)
+            continue;
+        if (n == cap)
+        {
+            cap *= 2;
+            roms = realloc(roms, cap * sizeof(regress_rom));
+        }
+        memset(&roms[n], 0, sizeof(regress_rom));
+        strcpy(roms[n].name, ent->d_name);
+        n++;
+    }
+    closedir(d);
+    qsort(roms, n, sizeof(regress_rom), by_name);
+
+    // Same start, rng included, every time
+    chip8_state *fresh = create_state();
+    fresh->rng = 0x2545f491;
+
+    regress_job job = {dir, opts, fresh, roms, n, 0};
+    int threads = opts->threads < n ? opts->threads : n;
+    pthread_t tids[threads > 0 ? threads : 1];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int t = 0; t < threads; t++)
+        pthread_create(&tids[t], NULL, worker, &job);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    static const char *status_names[] = {"PASS", "FAIL", "NEW", "UPDATED"};
+    int counts[4] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        regress_rom *r = &roms[i];
+        counts[r->status]++;
+        printf("%-7s %-32s %8.1fms %8.2f MIPS", status_names[r->status],
+                r->name, r->secs * 1000,
+                r->secs > 0 ? r->instrs / r->secs / 1e6 : 0.0);
+        if (r->halted_frame >= 0)
+            printf("  (halted at %03x, frame %i)", r->halted_pc,
+                    r->halted_frame);
+        printf("\n");
+        if (r->status == R_FAIL)
+            printf("        %s\n", r->why);
+    }
+    printf("%i roms, %i frames each, checkpoint every %i, %s engine: "
+            "%i passed, %i failed, %i new, %i updated in %.2fs\n", n,
+            opts->frames, opts->every, opts->engine->name, counts[R_PASS],
+            counts[R_FAIL], counts[R_NEW], counts[R_UPDATED],
+            t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    free(fresh);
+    free(roms);
+    return counts[R_FAIL];
+}
+
+// One rom headless for frames frames, with the keys from keyfile (rom.ch8.keys
+// if NULL), profiled into out for disasm -prof: every pc run, every byte
+// DXYN drew from, every byte FX33/FX55 wrote. The profiler hooks are all
+// it costs, so this needs a CHIP8_PROFILE build.
+int cover_rom(const char *romfile, const char *keyfile, int frames,
+        const chip8_engine *engine, const char *out)
+{
+#ifdef CHIP8_PROFILE
+    char path[1024];
+    int key_frames[MAX_KEY_EVENTS];
+    unsigned short key_masks[MAX_KEY_EVENTS];
+    if (keyfile == NULL)
+    {
+        snprintf(path, sizeof(path), "%s.keys", romfile);
+        keyfile = path;
+    }
+    int num_keys = read_keys(keyfile, key_frames, key_masks);
+
+    chip8_state *state = create_state();
+    state->rng = 0x2545f491;
+    load_rom((char *)romfile, state);
+    state->prof = prof_create();
+
+    int k = 0, f;
+    for (f = 0; f < frames && !state->halted; f++)
+    {
+        for (; k < num_keys && key_frames[k] <= f; k++)
+            for (int i = 0; i < 16; i++)
+                state->key[i] = (key_masks[k] >> i) & 1;
+        engine->run(state, CYCLES_PER_FRAME);
+        tick_timers(state);
+    }
+
+    FILE *csv = fopen(out, "w");
+    if (csv == NULL)
+    {
+        printf("Could not create %s\n", out);
+        exit(1);
+    }
+    prof_save_csv(state->prof, state->memory, csv);
+    fclose(csv);
+    int pcs = 0;
+    for (int a = 0; a < 4096; a++)
+        pcs += state->prof->pc_count[a] != 0;
+    printf("%s: %i frames, %llu instructions, %i distinct pcs, %i key "
+            "changes%s\n", romfile, f, state->prof->total, pcs, num_keys,
+            state->halted ? " (halted)" : "");
+    free(state->prof);
+    free(state);
+    return 0;
+#else
+    printf("-cover needs a profiling build (make chip8vm-prof)\n");
+    return 1;
+#endif
+}
@@ -0,0 +1,29 @@
+#ifndef REGRESS_H_INC
+#define REGRESS_H_INC
+
+#include "chip8vm.h"
+
+// ROM regression farm: every rom in a directory is run headless and its
+// screen hashed at checkpoints, against hashes stored next to it.
+//
+// For rom.ch8 the directory can also have:
+//   rom.ch8.keys    input log, lines of "frame mask": from that frame on
+//                   the keys in the (hex) mask are down. # comments.
+//   rom.ch8.golden  "frame hash" lines, written on the first run (or any
+//                   run with update set) and checked against after that.
+
+typedef struct {
+    const chip8_engine *engine;
+    int frames;     // frames each rom runs
+    int every;      // frames between checkpoints
+    int threads;
+    int update;     // rewrite the golden files instead of checking
+} regress_opts;
+
+int regress_dir(const char *dir, const regress_opts *opts);
+
+// Coverage run for disasm -prof, see regress.c
+int cover_rom(const char *romfile, const char *keyfile, int frames,
+        const chip8_engine *engine, const char *out);
+
+#endif
@@ -1,7 +1,18 @@
 #include <stdio.h>
+#include <stdlib.h> // for free
+#include <string.h> // for memset, memcmp
 
 #include "chip8vm.h"
 #include "testingsys.h"
+#include "chip8dis.h"
+#include "chip8asm.h"
+#include "chip8verify.h"
+#include "chip8env.h"
+#include "chip8obs.h"
+#ifdef CHIP8_TRACE
+#include <unistd.h> // for close, unlink
+#include "chip8trace.h"
+#endif
 
 // Reporting test results
 int test_op(chip8_state *state,
@@ -29,6 +40,35 @@ int test_op(chip8_state *state,
 
 
 
+// Assemble src and load it into a new vm. NULL if it didn't assemble.
+static chip8_state * load_source(const char *src, int optimize)
+{
+    chip8_asm a;
+    if (chip8_assemble(src, optimize, &a) < 0)
+    {
+        printf("\nline %i: %s\n", a.error_line, a.error);
+        chip8_asm_free(&a);
+        return NULL;
+    }
+    chip8_state *vm = create_state();
+    load_rom_buffer(vm, a.rom, a.rom_len);
+    chip8_asm_free(&a);
+    return vm;
+}
+
+// Same, then run it until it halts (or a million cycles), counting them
+static chip8_state * run_source(const char *src, int optimize, long *cycles)
+{
+    chip8_state *vm = load_source(src, optimize);
+    if (vm == NULL)
+        return NULL;
+    for (*cycles = 0; !vm->halted && *cycles < 1000000; (*cycles)++)
+        emulate_cycle(vm);
+    return vm;
+}
+
+
+
 // Just a big battery of tests in sequence. 
 // Set important values & opcode, emulate, test result
 // dump: whether to dump memory & state on failed test, 0 or 1
@@ -403,6 +443,12 @@ int test_suite(chip8_state *state, unsigned char dump)
     errors += test_op(state, tested, 0x7f, dump);
     tested = state->v[0xf];
     errors += test_op(state, tested, 0x01, dump);
+    // VY is VF: shifts the old VF, not the new flag
+    state->opcode = 0x81f6;
+    state->v[0xf] = 0xdb;
+    emulate_opcode(state);
+    tested = state->v[1];
+    errors += test_op(state, tested, 0x6d, dump);
 
 
     // 0x8XY7: Set VX to VY - VX
@@ -539,7 +585,46 @@ int test_suite(chip8_state *state, unsigned char dump)
 
 
    
-    // 0xdXYN: Display // Not covered here
+    // 0xdXYN: Display
+    // gfx is one 64 bit word per row, so check whole rows
+    printf("\n0xdXYN: ");
+    // font "0" at top left
+    state->opcode = 0xd015;
+    memset(state->gfx, 0, sizeof(state->gfx));
+    state->v[0] = 0;
+    state->v[1] = 0;
+    state->index_reg = 0x50;
+    emulate_opcode(state);
+    tested = state->gfx[0] >> 48;
+    errors += test_op(state, tested, 0xf000, dump);
+    tested = state->gfx[1] >> 48;
+    errors += test_op(state, tested, 0x9000, dump);
+    tested = state->v[0xf];
+    errors += test_op(state, tested, 0x0, dump);
+    // same again erases it, with collision
+    emulate_opcode(state);
+    tested = state->gfx[0] >> 48;
+    errors += test_op(state, tested, 0x0, dump);
+    tested = state->v[0xf];
+    errors += test_op(state, tested, 0x1, dump);
+    // clipped at the right edge: only the left 4 px show
+    state->v[0] = 60;
+    emulate_opcode(state);
+    tested = state->gfx[0] & 0xffff;
+    errors += test_op(state, tested, 0xf, dump);
+    tested = state->gfx[1] & 0xffff;
+    errors += test_op(state, tested, 0x9, dump);
+    // start coords wrap: x 64 + 8 is x 8, y 32 + 30 is y 30 and
+    // the sprite is clipped at the bottom after 2 rows
+    state->v[0] = 72;
+    state->v[1] = 62;
+    emulate_opcode(state);
+    tested = (state->gfx[30] >> 48) & 0xff;
+    errors += test_op(state, tested, 0xf0, dump);
+    tested = (state->gfx[31] >> 48) & 0xff;
+    errors += test_op(state, tested, 0x90, dump);
+    tested = (state->gfx[0] >> 48) & 0xff;
+    errors += test_op(state, tested, 0x0, dump);
     
     // 0xeX9e: skip next instruction if key stored in VX is pressed
     printf("\n0xeX9e: ");
@@ -666,6 +751,9 @@ int test_suite(chip8_state *state, unsigned char dump)
     errors += test_op(state, tested, 0x3, dump);
     tested = state->memory[state->index_reg + 2];
     errors += test_op(state, tested, 0x2, dump);
+    // VX unchanged
+    tested = state->v[0xa];
+    errors += test_op(state, tested, 0x84, dump);
     // zeroes in value
     state->opcode = 0xfb33;
     state->v[0xb] = 0x19; // 25 in decimal
@@ -806,7 +894,789 @@ int test_suite(chip8_state *state, unsigned char dump)
     errors += test_op(state, tested, 0xdd, dump);
 
 
+    // Quirk profiles: these are whole engines, so put the opcode in
+    // memory and run one cycle of it
+    printf("\nQuirks: ");
+#define RUN_QUIRK(name, op) do { \
+        state->memory[0x300] = (op) >> 8; \
+        state->memory[0x301] = (op) & 0xff; \
+        state->opcode = (op); \
+        state->pc = 0x300; \
+        state->halted = 0; \
+        find_engine(name)->run(state, 1); \
+    } while (0)
+    // schip shifts VX, not VY
+    state->v[1] = 0x81;
+    state->v[2] = 0x10;
+    RUN_QUIRK("schip", 0x8126);
+    tested = state->v[1];
+    errors += test_op(state, tested, 0x40, dump);
+    tested = state->v[0xf];
+    errors += test_op(state, tested, 0x01, dump);
+    // vip moves I past what it stored, and logic ops clear VF
+    state->index_reg = 0x400;
+    RUN_QUIRK("vip", 0xf255);
+    tested = state->index_reg;
+    errors += test_op(state, tested, 0x403, dump);
+    state->v[0xf] = 0x01;
+    RUN_QUIRK("vip", 0x8121);
+    tested = state->v[0xf];
+    errors += test_op(state, tested, 0x00, dump);
+    // chip48 moves I by X, and jumps to XNN + VX
+    state->index_reg = 0x400;
+    RUN_QUIRK("chip48", 0xf265);
+    tested = state->index_reg;
+    errors += test_op(state, tested, 0x402, dump);
+    state->v[0] = 0x00;
+    state->v[3] = 0x10;
+    RUN_QUIRK("chip48", 0xb320);
+    tested = state->pc;
+    errors += test_op(state, tested, 0x330, dump);
+    // xochip wraps sprites round the right edge
+    memset(state->gfx, 0, sizeof(state->gfx));
+    state->memory[0x400] = 0xff;
+    state->index_reg = 0x400;
+    state->v[0] = 60;
+    state->v[1] = 0;
+    RUN_QUIRK("xochip", 0xd011);
+    tested = state->gfx[0] >> 60 | (state->gfx[0] & 0xf) << 4;
+    errors += test_op(state, tested, 0xff, dump);
+    // schip hires: 16x16 sprite across the middle of a row, scrolled
+    // right over into the right hand word
+    RUN_QUIRK("schip", 0x00ff);
+    tested = state->hires;
+    errors += test_op(state, tested, 1, dump);
+    memset(&state->memory[0x400], 0, 32);
+    state->memory[0x400] = 0xff;
+    state->memory[0x401] = 0xff;
+    state->index_reg = 0x400;
+    state->v[0] = 56;
+    state->v[1] = 5;
+    RUN_QUIRK("schip", 0xd010);
+    tested = (state->hgfx[5][0] & 0xff) << 8 | state->hgfx[5][1] >> 56;
+    errors += test_op(state, tested, 0xffff, dump);
+    RUN_QUIRK("schip", 0xd010);
+    tested = state->v[0xf];
+    errors += test_op(state, tested, 1, dump);
+    RUN_QUIRK("schip", 0xd010);
+    RUN_QUIRK("schip", 0x00fb);
+    tested = (state->hgfx[5][0] & 0xff) << 8 | state->hgfx[5][1] >> 56;
+    errors += test_op(state, tested, 0x0fff, dump);
+    // 00CN scrolls down whole rows
+    RUN_QUIRK("schip", 0x00c3);
+    tested = state->hgfx[8][1] >> 52 | state->hgfx[5][1];
+    errors += test_op(state, tested, 0x0fff, dump);
+    RUN_QUIRK("schip", 0x00fe);
+    tested = state->hires;
+    errors += test_op(state, tested, 0, dump);
+    // RPL flags round trip
+    state->v[0] = 0x12;
+    state->v[1] = 0x34;
+    RUN_QUIRK("schip", 0xf175);
+    state->v[0] = 0;
+    state->v[1] = 0;
+    RUN_QUIRK("schip", 0xf185);
+    tested = state->v[0] << 8 | state->v[1];
+    errors += test_op(state, tested, 0x1234, dump);
+    // 00FD stops the vm
+    RUN_QUIRK("schip", 0x00fd);
+    tested = state->halted;
+    errors += test_op(state, tested, HALT_EXIT, dump);
+    // ... which plain CHIP-8 doesn't know
+    RUN_QUIRK("switch", 0x00fd);
+    tested = state->halted;
+    errors += test_op(state, tested, HALT_UNIMPLEMENTED, dump);
+#ifdef CHIP8_TRACE
+    // 00FD under the tracer: it's the last record, and the trace closes
+    // once (the frontend used to close it twice on 00FD)
+    {
+        char path[] = "/tmp/chip8traceXXXXXX";
+        int fd = mkstemp(path);
+        if (fd >= 0)
+            close(fd);
+        state->trace = fd >= 0 ? trace_open(path) : NULL;
+        state->memory[0x200] = 0x60;
+        state->memory[0x201] = 0x05;
+        state->memory[0x202] = 0x00;
+        state->memory[0x203] = 0xfd;
+        state->pc = 0x200;
+        state->halted = 0;
+        find_engine("schip")->run(state, 10);
+        trace_close(state->trace);
+        state->trace = NULL;
+        // 6005 is 5 bytes (delta, opcode, mask, V0), 00FD 4 (no mask bits)
+        unsigned char buf[64] = {0};
+        FILE *in = fd >= 0 ? fopen(path, "rb") : NULL;
+        size_t len = in != NULL ? fread(buf, 1, sizeof(buf), in) : 0;
+        if (in != NULL)
+            fclose(in);
+        unlink(path);
+        tested = len == TRACE_HEADER_LEN + 9 && buf[8] == 2 &&
+            buf[len - 3] == 0x00 && buf[len - 2] == 0xfd;
+        errors += test_op(state, tested, 1, dump);
+    }
+#endif
+#ifdef CHIP8_XO
+    // XO-CHIP: long I load, and skips hop over it
+    state->memory[0x302] = 0x12;
+    state->memory[0x303] = 0x34;
+    RUN_QUIRK("xochip", 0xf000);
+    tested = state->index_reg;
+    errors += test_op(state, tested, 0x1234, dump);
+    tested = state->pc;
+    errors += test_op(state, tested, 0x304, dump);
+    state->memory[0x302] = 0xf0;
+    state->memory[0x303] = 0x00;
+    state->v[0] = 0;
+    RUN_QUIRK("xochip", 0x3000);
+    tested = state->pc;
+    errors += test_op(state, tested, 0x306, dump);
+    // Past 4K
+    state->index_reg = 0xfff0;
+    state->v[0] = 0x5a;
+    RUN_QUIRK("xochip", 0xf055);
+    tested = state->memory[0xfff0];
+    errors += test_op(state, tested, 0x5a, dump);
+    tested = state->index_reg;
+    errors += test_op(state, tested, 0xfff1, dump);
+    // Both planes: the first row of sprite to plane 1, the next to 2
+    RUN_QUIRK("xochip", 0x00fe);
+    RUN_QUIRK("xochip", 0xf301);
+    state->memory[0x400] = 0xf0;
+    state->memory[0x401] = 0x0f;
+    state->index_reg = 0x400;
+    state->v[0] = 0;
+    state->v[1] = 0;
+    RUN_QUIRK("xochip", 0xd011);
+    tested = (state->gfx[0] >> 56) << 8 | state->gfx2[0] >> 56;
+    errors += test_op(state, tested, 0xf00f, dump);
+    tested = get_pixel(state, 0, 0) << 4 | get_pixel(state, 7, 0);
+    errors += test_op(state, tested, 0x12, dump);
+    // Plane 2 only: collides there, and plane 1 is left alone
+    RUN_QUIRK("xochip", 0xf201);
+    state->index_reg = 0x401;
+    RUN_QUIRK("xochip", 0xd011);
+    tested = state->v[0xf] << 8 | state->gfx2[0] >> 56;
+    errors += test_op(state, tested, 0x100, dump);
+    tested = state->gfx[0] >> 56;
+    errors += test_op(state, tested, 0xf0, dump);
+    // 5XY2 stores a range, 5XY3 loads it back the other way round
+    state->v[1] = 0x11;
+    state->v[2] = 0x22;
+    state->v[3] = 0x33;
+    state->index_reg = 0x500;
+    RUN_QUIRK("xochip", 0x5132);
+    tested = state->memory[0x500] << 8 | state->memory[0x502];
+    errors += test_op(state, tested, 0x1133, dump);
+    RUN_QUIRK("xochip", 0x5313);
+    tested = state->v[3] << 8 | state->v[1];
+    errors += test_op(state, tested, 0x1133, dump);
+    tested = state->index_reg;
+    errors += test_op(state, tested, 0x500, dump);
+    // Audio pattern and pitch
+    state->memory[0x50f] = 0xa5;
+    RUN_QUIRK("xochip", 0xf002);
+    tested = state->pattern[15];
+    errors += test_op(state, tested, 0xa5, dump);
+    state->v[4] = 0x70;
+    RUN_QUIRK("xochip", 0xf43a);
+    tested = state->pitch;
+    errors += test_op(state, tested, 0x70, dump);
+    RUN_QUIRK("xochip", 0xf301);
+#endif
+#undef RUN_QUIRK
+
+
+    // Addresses wrap at the end of memory rather than run off it
+    printf("\nWrapping: ");
+    state->opcode = 0xf033;
+    state->v[0] = 123;
+    state->index_reg = 0xfff;
+    emulate_opcode(state);
+    tested = state->memory[0xfff] << 8 | state->memory[0x000] << 4 |
+            state->memory[0x001];
+    errors += test_op(state, tested, 0x123, dump);
+    // Opcode split over the end, and a skip from the last one
+    state->memory[0xfff] = 0x30;
+    state->memory[0x000] = 0x07;
+    state->v[0] = 0x07;
+    state->pc = 0xfff;
+    emulate_cycle(state);
+    tested = state->pc;
+    errors += test_op(state, tested, 0x003, dump);
+    // Key numbers past F
+    state->opcode = 0xe09e;
+    state->key[0x3] = 1;
+    state->v[0] = 0xf3;
+    state->pc = 0x202;
+    emulate_opcode(state);
+    tested = state->pc;
+    errors += test_op(state, tested, 0x204, dump);
+
 
+    // The opcode table (chip8dis.h) that disasm and the assembler use
+    // against the interpreter: every opcode it halts on should be one
+    // the table calls invalid (or 0NNN), and nothing else
+    printf("\nOpcode table: ");
+    int disagree = 0;
+    for (int op = 0; op <= 0xffff; op++)
+    {
+        state->opcode = op;
+        state->pc = 0x202;
+        state->index_reg = 0x300;
+        state->halted = 0;
+        emulate_opcode(state);
+        int cls = op_class_isa(op, ISA_CHIP8);
+        int halts = state->halted == HALT_INVALID ||
+            state->halted == HALT_UNIMPLEMENTED;
+        if (halts != (cls == OP_INVALID || cls == OP_CALLPROG))
+            disagree++;
+    }
+    state->halted = 0;
+    errors += test_op(state, disagree, 0, dump);
+    // The same for schip and xochip with their sets' rows, and 00FD is
+    // the only exit. Anything that doesn't jump has to step pc on by its
+    // length, F000 NNNN's 4 included.
+    const char *isa_engines[] = {"schip", "xochip"};
+#ifdef CHIP8_XO
+    const int isas[] = {ISA_SCHIP, ISA_XO};
+#else
+    // xochip is the plain machine, with its quirks, without CHIP8_XO
+    const int isas[] = {ISA_SCHIP, ISA_CHIP8};
+#endif
+    chip8_state *ext = create_state();
+    for (int e = 0; e < 2; e++)
+    {
+        const chip8_engine *eng = find_engine(isa_engines[e]);
+        disagree = 0;
+        for (int op = 0; op <= 0xffff; op++)
+        {
+            ext->memory[0x200] = op >> 8;
+            ext->memory[0x201] = op & 0xff;
+            ext->pc = 0x200;
+            ext->index_reg = 0x400;
+            ext->halted = 0;
+            eng->run(ext, 1);
+            int cls = op_class_isa(op, isas[e]);
+            int halts = ext->halted == HALT_INVALID ||
+                ext->halted == HALT_UNIMPLEMENTED;
+            int jumps = cls == OP_GOTO || cls == OP_CALL || cls == OP_RET ||
+                cls == OP_JMPOFF || cls == OP_TEQ_I || cls == OP_TNE_I ||
+                cls == OP_TEQ || cls == OP_TNE || cls == OP_TKEY ||
+                cls == OP_TNKEY || cls == OP_GETKEY;
+            if (halts != (cls == OP_INVALID || cls == OP_CALLPROG) ||
+                    (ext->halted == HALT_EXIT) != (cls == OP_EXIT) ||
+                    (!ext->halted && !jumps &&
+                     ext->pc != 0x200 + op_class_len(cls)))
+                disagree++;
+        }
+        errors += test_op(ext, disagree, 0, dump);
+    }
+    free(ext);
+    // Text both ways: 00FF 6005 A20A D000 is HIRES to SUPER-CHIP, but a
+    // 0NNN to plain CHIP-8
+    const unsigned char hires[] = {0x00, 0xff, 0x60, 0x05, 0xa2, 0x0a, 0xd0,
+        0x00, 0xf0, 0x00, 0x12, 0x34};
+    const char *as_schip[] = {"HIRES", "MOV.I V0 $05", "INDEX $20a",
+        "DRAW16 V0 V0"};
+    char text[MNEMONIC_LEN];
+    int misread = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        format_insn(hires + 2 * i, ISA_SCHIP, text);
+        misread += strcmp(text, as_schip[i]) != 0;
+    }
+    format_insn(hires, ISA_CHIP8, text);
+    misread += strcmp(text, "CALLPROG $0ff") != 0;
+    format_insn(hires + 6, ISA_CHIP8, text);
+    misread += strcmp(text, "DRAW V0 V0 0") != 0;
+    format_insn(hires + 8, ISA_XO, text);
+    misread += strcmp(text, "LONGI $1234") != 0;
+    misread += format_insn(hires + 8, ISA_SCHIP, text) != -1;
+    tested = misread;
+    errors += test_op(state, tested, 0, dump);
+    chip8_asm hires_asm;
+    tested = chip8_assemble("        HIRES\n        MOV.I V0 $05\n"
+            "        INDEX $20a\n        DRAW16 V0 V0\n        LONGI $1234\n",
+            0, &hires_asm) == 0 && hires_asm.rom_len == sizeof(hires) &&
+        memcmp(hires_asm.rom, hires, sizeof(hires)) == 0;
+    chip8_asm_free(&hires_asm);
+    errors += test_op(state, tested, 1, dump);
+
+
+    // Assembled in memory and loaded straight in (chip8asm.h), no files
+    printf("\nAssembled: ");
+    const char *sum =
+        "% 10 + 9 + ... + 1 into V1, then I at a table from a call\n"
+        "        MOV.I V0 $0a\n"
+        "        MOV.I V1 $00\n"
+        "loop:   INC.V V1 V0\n"
+        "        INC.I V0 $ff\n"
+        "        TEQ.I V0 $00\n"
+        "        GOTO loop\n"
+        "        CALL setidx\n"
+        "        CALLPROG $000\n"
+        "setidx: INDEX table\n"
+        "        RET\n"
+        "table:  DB $12 $34\n";
+    long cycles;
+    chip8_state *vm = run_source(sum, 0, &cycles);
+    if (vm == NULL)
+        return errors + 1;
+    tested = vm->v[1];
+    errors += test_op(vm, tested, 55, dump);
+    tested = vm->index_reg;
+    errors += test_op(vm, tested, 0x214, dump);
+    tested = vm->memory[vm->index_reg];
+    errors += test_op(vm, tested, 0x12, dump);
+    tested = vm->halted;
+    errors += test_op(vm, tested, HALT_UNIMPLEMENTED, dump);
+    free(vm);
+    // -O ends the same, sooner (the INDEX after next: is jumped to, so
+    // stays)
+    const char *waste =
+        "        MOV.I V0 $01\n"
+        "        MOV.I V1 $02\n"
+        "        MOV.I V2 $10\n"
+        "        INC.I V2 $05\n"
+        "        INDEX data\n"
+        "        GOTO next\n"
+        "next:   INDEX data\n"
+        "        STORE V2\n"
+        "        LOAD V2\n"
+        "        CALLPROG $000\n"
+        "data:   DB $00 $00 $00\n";
+    long fewer;
+    vm = run_source(waste, 0, &cycles);
+    chip8_state *opt = run_source(waste, 1, &fewer);
+    if (vm == NULL || opt == NULL)
+        return errors + 1;
+    tested = memcmp(vm->v, opt->v, 3) == 0 &&
+        memcmp(vm->memory + vm->index_reg, opt->memory + opt->index_reg,
+                3) == 0;
+    errors += test_op(vm, tested, 1, dump);
+    tested = cycles - fewer;
+    errors += test_op(vm, tested, 3, dump);
+    // None of that was in a loop; the INC.I fold in here is, two deep
+    chip8_asm looping;
+    chip8_assemble(waste, 1, &looping);
+    tested = looping.in_loops;
+    chip8_asm_free(&looping);
+    errors += test_op(vm, tested, 0, dump);
+    chip8_assemble(
+        "outer:  MOV.I V0 $00\n"
+        "inner:  INC.I V0 $01\n"
+        "        INC.I V0 $01\n"
+        "        TEQ.I V0 $10\n"
+        "        GOTO inner\n"
+        "        GOTO outer\n", 1, &looping);
+    tested = looping.folded * 100 + looping.in_loops * 10 + looping.deepest;
+    chip8_asm_free(&looping);
+    errors += test_op(vm, tested, 112, dump);
+    free(vm);
+    free(opt);
+
+
+    // Control flow recovery (chip8flow.h) on roms with a known layout.
+    // A loop calling a sub, and the table it points I at:
+    //   200 MOV.I  202 loop: CALL  204 INC.I  206 TEQ.I  208 GOTO loop
+    //   20a CALLPROG  20c sub: INDEX  20e RET  210 table: DB DB
+    printf("\nFlow: ");
+    const char *looped =
+        "        MOV.I V0 $03\n"
+        "loop:   CALL sub\n"
+        "        INC.I V0 $ff\n"
+        "        TEQ.I V0 $00\n"
+        "        GOTO loop\n"
+        "        CALLPROG $000\n"
+        "sub:    INDEX table\n"
+        "        RET\n"
+        "table:  DB $12 $34\n";
+    vm = load_source(looped, 0);
+    if (vm == NULL)
+        return errors + 1;
+    chip8_flow *flow = flow_analyze(vm->memory, 0x200, 0x212, NULL,
+            ISA_CHIP8);
+    const unsigned short starts[] = {0x200, 0x202, 0x208, 0x20a, 0x20c};
+    const unsigned short ends[] = {0x202, 0x208, 0x20a, 0x20c, 0x210};
+    tested = flow->num_blocks;
+    errors += test_op(vm, tested, 5, dump);
+    int wrong = 0;
+    for (int b = 0; b < 5 && b < flow->num_blocks; b++)
+        wrong += flow->blocks[b].start != starts[b] ||
+            flow->blocks[b].end != ends[b];
+    tested = wrong;
+    errors += test_op(vm, tested, 0, dump);
+    // The MOV falls into loop, the TEQ goes either way, the GOTO back
+    tested = flow->blocks[0].num_succ == 1 && flow->blocks[0].succ[0] ==
+        0x202 && flow->blocks[1].num_succ == 2 && flow->blocks[1].succ[0] ==
+        0x208 && flow->blocks[1].succ[1] == 0x20a &&
+        flow->blocks[2].succ[0] == 0x202 && flow->blocks[3].num_succ == 0 &&
+        flow->blocks[4].num_succ == 0;
+    errors += test_op(vm, tested, 1, dump);
+    tested = flow->num_subs == 2 && flow->subs[0] == 0x200 &&
+        flow->subs[1] == 0x20c && flow->num_calls == 1 &&
+        flow->calls[0].from == 0x200 && flow->calls[0].to == 0x20c;
+    errors += test_op(vm, tested, 1, dump);
+    tested = flow->num_insns << 8 | flow->data_bytes;
+    errors += test_op(vm, tested, 8 << 8 | 2, dump);
+    tested = (flow->flags[0x202] & FLOW_JUMP) && (flow->flags[0x20c] &
+            FLOW_SUB) && (flow->flags[0x20a] & FLOW_BAD) &&
+        (flow->flags[0x210] & FLOW_DATA) && !flow_is_code(flow, 0x210) &&
+        flow_is_code(flow, 0x20f) && flow->indirect == 0 &&
+        flow->outside == 0;
+    errors += test_op(vm, tested, 1, dump);
+    flow_free(flow);
+    free(vm);
+    // A BNNN into a jump table, and a GOTO at 20a nothing static reaches:
+    //   200 JMPOFF tbl  202 tbl: GOTO a  204 GOTO b  206 a: CALLPROG
+    //   208 b: GOTO b  20a GOTO $20a (as data)
+    const char *table =
+        "        JMPOFF $202\n"
+        "        GOTO a\n"
+        "        GOTO b\n"
+        "a:      CALLPROG $000\n"
+        "b:      GOTO b\n"
+        "        DB $12 $0a\n";
+    vm = load_source(table, 0);
+    if (vm == NULL)
+        return errors + 1;
+    flow = flow_analyze(vm->memory, 0x200, 0x20c, NULL, ISA_CHIP8);
+    tested = flow->num_blocks << 8 | flow->indirect << 4 | flow->data_bytes;
+    errors += test_op(vm, tested, 5 << 8 | 1 << 4 | 2, dump);
+    tested = (flow->flags[0x204] & FLOW_JUMP) && (flow->flags[0x206] &
+            FLOW_JUMP) && (flow->flags[0x208] & FLOW_JUMP) &&
+        !flow_is_code(flow, 0x20a);
+    errors += test_op(vm, tested, 1, dump);
+    flow_free(flow);
+    // ... which a recorded run of 20a brings in as code
+    unsigned char ran[4096] = {0};
+    ran[0x20a] = 1;
+    flow = flow_analyze(vm->memory, 0x200, 0x20c, ran, ISA_CHIP8);
+    tested = flow->seeded << 8 | flow->num_blocks << 4 | flow->data_bytes;
+    errors += test_op(vm, tested, 1 << 8 | 6 << 4, dump);
+    flow_free(flow);
+    free(vm);
+    // Read as XO-CHIP, a skip hops all of F000 NNNN, and 00FD ends a
+    // block; as plain CHIP-8, F000 is bad and 1234 jumps out of the rom
+    //   200 TEQ.I  202 LONGI $1234  206 EXIT
+    vm = load_source("        TEQ.I V0 $00\n        LONGI $1234\n"
+            "        EXIT\n", 0);
+    if (vm == NULL)
+        return errors + 1;
+    flow = flow_analyze(vm->memory, 0x200, 0x208, NULL, ISA_XO);
+    tested = flow->num_blocks == 3 && flow->blocks[0].num_succ == 2 &&
+        flow->blocks[0].succ[1] == 0x206 && flow->blocks[1].end == 0x206 &&
+        flow->blocks[2].num_succ == 0 && (flow->flags[0x202] & FLOW_LONG) &&
+        flow_is_code(flow, 0x205) && flow->num_insns == 3 &&
+        flow->outside == 0;
+    errors += test_op(vm, tested, 1, dump);
+    flow_free(flow);
+    flow = flow_analyze(vm->memory, 0x200, 0x208, NULL, ISA_CHIP8);
+    tested = (flow->flags[0x202] & FLOW_BAD) && !(flow->flags[0x202] &
+            FLOW_LONG) && flow->outside == 1;
+    errors += test_op(vm, tested, 1, dump);
+    flow_free(flow);
+    free(vm);
+
+
+    // Static checks for running unchecked (chip8verify.h): roms that
+    // pass, and one of each way to fail
+    printf("\nVerifier: ");
+    const char *safe =
+        "        INDEX buf\n"
+        "        MOV.I V0 $07\n"
+        "        CALL save\n"
+        "        LOAD V0\n"
+        "        CALLPROG $000\n"
+        "save:   STORE V0\n"
+        "        BCD V0\n"
+        "        RET\n"
+        "buf:    DB $00 $00 $00\n";
+    const char *unsafe[] = {
+        // recursion
+        "        CALL sub\n        CALLPROG $000\nsub:    CALL sub\n"
+        "        RET\n",
+        // RET from the entry
+        "        RET\n",
+        // writing over code
+        "        INDEX $200\n        STORE V0\n        CALLPROG $000\n",
+        // off the end of memory
+        "        INDEX $ffe\n        LOAD V3\n        CALLPROG $000\n",
+        // I never set
+        "        STORE V0\n        CALLPROG $000\n",
+        // anywhere
+        "        JMPOFF $204\n        CALLPROG $000\n",
+        // I from a loop of FX1E, till it could be anything
+        "        INDEX buf\nloop:   IADD V0\n        STORE V0\n"
+        "        GOTO loop\nbuf:    DB $00\n",
+    };
+    chip8_verify ver;
+    const char *passes[] = {sum, waste, safe};
+    for (int i = 0; i < 3; i++)
+    {
+        vm = load_source(passes[i], 0);
+        if (vm == NULL)
+            return errors + 1;
+        tested = verify_state(vm, &ver) == 0 && vm->verified;
+        if (tested != 1)
+            printf("\n%s at %03x\n", ver.why, ver.addr);
+        errors += test_op(vm, tested, 1, dump);
+        free(vm);
+    }
+    for (int i = 0; i < (int)(sizeof(unsafe) / sizeof(unsafe[0])); i++)
+    {
+        vm = load_source(unsafe[i], 0);
+        if (vm == NULL)
+            return errors + 1;
+        tested = verify_state(vm, &ver) == 0 || vm->verified;
+        errors += test_op(vm, tested, 0, dump);
+        free(vm);
+    }
+    // Calls VERIFY_MAX_DEPTH deep are fine, one more isn't
+    for (int deep = VERIFY_MAX_DEPTH; deep <= VERIFY_MAX_DEPTH + 1; deep++)
+    {
+        char chain[2048];
+        int len = snprintf(chain, sizeof(chain),
+                "        CALL s1\n        CALLPROG $000\n");
+        for (int d = 1; d <= deep; d++)
+            len += snprintf(chain + len, sizeof(chain) - len,
+                    d < deep ? "s%i:     CALL s%i\n        RET\n" :
+                    "s%i:     RET\n", d, d + 1);
+        vm = load_source(chain, 0);
+        if (vm == NULL)
+            return errors + 1;
+        tested = verify_state(vm, &ver) == 0;
+        errors += test_op(vm, tested, deep <= VERIFY_MAX_DEPTH, dump);
+        tested = ver.depth;
+        if (deep <= VERIFY_MAX_DEPTH)
+            errors += test_op(vm, tested, deep, dump);
+        free(vm);
+    }
+    // Unchecked ends the same as checked, and an unverified rom on the
+    // verified engine is just run checked
+    const char *both[] = {safe, unsafe[2]};
+    for (int i = 0; i < 2; i++)
+    {
+        vm = load_source(both[i], 0);
+        opt = load_source(both[i], 0);
+        if (vm == NULL || opt == NULL)
+            return errors + 1;
+        opt->rng = vm->rng;
+        memcpy(opt->v, vm->v, sizeof(vm->v));
+        verify_state(opt, NULL);
+        tested = opt->verified;
+        errors += test_op(opt, tested, i == 0, dump);
+        find_engine("switch")->run(vm, 1000);
+        find_engine("verified")->run(opt, 1000);
+        tested = vm->halted == opt->halted && vm->pc == opt->pc &&
+            memcmp(vm->v, opt->v, sizeof(vm->v)) == 0 &&
+            memcmp(vm->memory, opt->memory, 4096) == 0;
+        errors += test_op(opt, tested, 1, dump);
+        free(vm);
+        free(opt);
+    }
+
+
+    // The batched env (chip8env.h): a rom that counts to 3 while key 1 is
+    // held, then halts. Rewards are the count going up, done is the halt.
+    printf("\nEnv: ");
+    const char *counter =
+        "        MOV.I V1 $01\n"
+        "        MOV.I V2 $00\n"
+        "        INDEX dot\n"
+        "        DRAW V2 V2 1\n"
+        "loop:   TKEY V1\n"
+        "        GOTO loop\n"
+        "        INDEX count\n"
+        "        LOAD V0\n"
+        "        INC.I V0 $01\n"
+        "        STORE V0\n"
+        "        TEQ.I V0 $03\n"
+        "        GOTO loop\n"
+        "        CALLPROG $000\n"
+        "count:  DB $00\n"
+        "dot:    DB $80\n";
+    vm = load_source(counter, 0);
+    if (vm == NULL)
+        return errors + 1;
+    int count_addr = 0x200 + 13 * 2; // after the 13 instructions
+    int steps_taken[2];
+    for (int skip = 1; skip <= 2; skip++)
+    {
+        chip8_env *env = env_create(vm, 4, 2, 1234);
+        if (env == NULL)
+            return errors + 1;
+        env_set_frame_skip(env, skip);
+        env_set_byte_obs(env, 1);
+        tested = env_add_reward_addr(env, count_addr, 2.0f);
+        errors += test_op(vm, tested, 0, dump);
+        // Anywhere in memory can be watched, nowhere past it
+        tested = env_add_reward_addr(env, MEM_SIZE - 1, 0.0f);
+        errors += test_op(vm, tested, 0, dump);
+#if MEM_SIZE <= 0xffff
+        tested = env_add_reward_addr(env, MEM_SIZE, 1.0f) == -1;
+        errors += test_op(vm, tested, 1, dump);
+#endif
+        // Key 1 held on the even envs only
+        unsigned short actions[4] = {0x2, 0, 0x2, 0};
+        float rewards[4], total[4] = {0, 0, 0, 0};
+        unsigned char dones[4];
+        int step, done_at[4] = {0, 0, 0, 0};
+        for (step = 1; step <= 50 && (!done_at[0] || !done_at[2]); step++)
+        {
+            env_step(env, actions, rewards, dones);
+            for (int i = 0; i < 4; i++)
+            {
+                if (done_at[i])
+                    continue;
+                total[i] += rewards[i];
+                if (dones[i])
+                    done_at[i] = step;
+            }
+            // The dot is drawn first thing, before anything can be done
+            if (step == 1)
+            {
+                const unsigned char *obs = env_byte_obs(env);
+                tested = 0;
+                for (int i = 0; i < 4; i++)
+                    tested += obs[i * GFX_H * GFX_W] == 0xff &&
+                        obs[i * GFX_H * GFX_W + 1] == 0;
+                errors += test_op(vm, tested, 4, dump);
+            }
+        }
+        tested = done_at[0] > 0 && done_at[0] == done_at[2] &&
+            !done_at[1] && !done_at[3];
+        errors += test_op(vm, tested, 1, dump);
+        tested = total[0] == 6.0f && total[2] == 6.0f && total[1] == 0 &&
+            total[3] == 0;
+        errors += test_op(vm, tested, 1, dump);
+        // Done envs start over straight away
+        tested = env_state(env, 0)->memory[count_addr];
+        errors += test_op(vm, tested, 0, dump);
+        steps_taken[skip - 1] = done_at[0];
+        env_destroy(env);
+    }
+    // Two frames a step gets there in fewer steps
+    tested = steps_taken[1] < steps_taken[0];
+    errors += test_op(vm, tested, 1, dump);
+    // max_frames ends episodes on its own, on every thread
+    chip8_env *env = env_create(vm, 3, 3, 1);
+    if (env == NULL)
+        return errors + 1;
+    env_set_max_frames(env, 3);
+    unsigned short idle[3] = {0, 0, 0};
+    unsigned char dones[3];
+    tested = 0;
+    for (int step = 1; step <= 3; step++)
+    {
+        env_step(env, idle, NULL, dones);
+        tested += (dones[0] + dones[1] + dones[2]) * step;
+    }
+    errors += test_op(vm, tested, 9, dump);
+    env_destroy(env);
+    free(vm);
+
+
+    // Observation kernels (chip8obs.h): the AVX2 ones against the plain C
+    // ones, on random screens, for each way a training loop strings them
+    // together: frame_skip frames, flicker max of the last two or not,
+    // downsampled or not, and the diff from the step before
+    printf("\nObservations: ");
+    uint32_t r = 0x2545f491;
+    unsigned char *got[2], *prev[2], frames[2][2][GFX_H * GFX_W];
+    unsigned char pool[GFX_H * GFX_W], down[GFX_H * GFX_W];
+    for (int k = 0; k < 2; k++)
+    {
+        got[k] = calloc(1, GFX_H * GFX_W);
+        prev[k] = calloc(1, GFX_H * GFX_W);
+    }
+    int mismatches = 0;
+    for (int skip = 1; skip <= 4; skip++)
+        for (int flicker = 0; flicker <= 1; flicker++)
+            for (int factor = 1; factor <= 4; factor *= 2)
+                for (int trial = 0; trial < 20; trial++)
+                {
+                    uint64_t screens[4][GFX_H];
+                    for (int f = 0; f < skip; f++)
+                        for (int y = 0; y < GFX_H; y++)
+                        {
+                            r ^= r << 13;
+                            r ^= r >> 17;
+                            r ^= r << 5;
+                            uint64_t hi = r;
+                            r ^= r << 13;
+                            r ^= r >> 17;
+                            r ^= r << 5;
+                            // Sparse some of the time, like real screens
+                            screens[f][y] = (hi << 32 | r) &
+                                (trial & 1 ? ~0ull : hi * 0x0101010101010101ull);
+                        }
+                    // k = 0 plain C, k = 1 AVX2 if there is any
+                    for (int k = 0; k < 2; k++)
+                    {
+                        obs_set_avx2(k);
+                        for (int f = 0; f < skip; f++)
+                            obs_unpack(screens[f], GFX_H, frames[k][f & 1]);
+                        const unsigned char *last = frames[k][(skip - 1) & 1];
+                        if (flicker && skip > 1)
+                        {
+                            obs_maxpool2(frames[k][0], frames[k][1], pool,
+                                    GFX_H * GFX_W);
+                            last = pool;
+                        }
+                        if (factor > 1)
+                        {
+                            obs_downsample(last, GFX_W, GFX_H, factor, down);
+                            last = down;
+                        }
+                        int n = GFX_H * GFX_W / (factor * factor);
+                        memcpy(prev[k], got[k], GFX_H * GFX_W);
+                        memcpy(got[k], last, n);
+                        obs_diff(got[k], prev[k], pool, GFX_H * GFX_W);
+                        memcpy(prev[k], pool, GFX_H * GFX_W);
+                    }
+                    mismatches += memcmp(got[0], got[1], GFX_H * GFX_W) != 0;
+                    mismatches += memcmp(prev[0], prev[1], GFX_H * GFX_W) != 0;
+                }
+    // Lengths that leave a tail for the plain C loop to finish, and a row
+    // width the vector downsample only does part of
+    for (int n = 1; n < 200; n += 13)
+    {
+        unsigned char a[200], b[200], out[2][200] = {{0}};
+        for (int i = 0; i < n; i++)
+        {
+            r ^= r << 13;
+            r ^= r >> 17;
+            r ^= r << 5;
+            a[i] = r;
+            b[i] = r >> 8;
+        }
+        for (int k = 0; k < 2; k++)
+        {
+            obs_set_avx2(k);
+            obs_maxpool2(a, b, out[k], n);
+            obs_diff(a, b, out[k] + 100, n < 100 ? n : 100);
+        }
+        mismatches += memcmp(out[0], out[1], 200) != 0;
+    }
+    unsigned char wide[96 * 4], small[2][48 * 2];
+    for (int i = 0; i < 96 * 4; i++)
+        wide[i] = i * 37;
+    for (int k = 0; k < 2; k++)
+    {
+        obs_set_avx2(k);
+        obs_downsample(wide, 96, 4, 2, small[k]);
+    }
+    mismatches += memcmp(small[0], small[1], sizeof(small[0])) != 0;
+    obs_set_avx2(1);
+    for (int k = 0; k < 2; k++)
+    {
+        free(got[k]);
+        free(prev[k]);
+    }
+    tested = mismatches;
+    errors += test_op(state, tested, 0, dump);
 
     printf("\n");
     return errors;
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memcmp
+
+#include "chip8dis.h"
+#include "chip8trace.h"
+
+// Decodes a trace written by chip8vm-trace -trace, one line per
+// instruction: cycle, pc, opcode, disassembly, then registers changed.
+
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t n = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        n = n << 8 | p[i];
+    return n;
+}
+
+// Read a varint at *p, not going past end. Returns -1 if cut short.
+static int get_varint(const unsigned char **p, const unsigned char *end,
+        uint32_t *n)
+{
+    *n = 0;
+    for (int shift = 0; *p < end && shift < 35; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+        *n |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static void corrupt(uint64_t cycle)
+{
+    printf("ERROR: trace corrupt near cycle %llu\n", (unsigned long long)cycle);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: tracedump <tracefile>\n");
+        exit(1);
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        printf("Could not open file: %s\n", argv[1]);
+        exit(1);
+    }
+    // Output is big, give stdout a real buffer
+    static char outbuf[1 << 16];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    unsigned char header[TRACE_HEADER_LEN];
+    unsigned char *chunk = malloc(TRACE_CHUNK);
+    char text[MNEMONIC_LEN];
+    while (fread(header, 1, TRACE_HEADER_LEN, in) == TRACE_HEADER_LEN)
+    {
+        if (memcmp(header, TRACE_MAGIC, 4) != 0)
+            corrupt(0);
+        uint32_t len = get_le(header + 4, 4);
+        uint32_t records = get_le(header + 8, 4);
+        uint64_t cycle = get_le(header + 12, 8);
+        unsigned short pc = get_le(header + 20, 2);
+        if (len > TRACE_CHUNK || fread(chunk, 1, len, in) != len)
+            corrupt(cycle);
+
+        const unsigned char *p = chunk, *end = chunk + len;
+        for (uint32_t r = 0; r < records; r++, cycle++)
+        {
+            uint32_t zz, mask;
+            if (get_varint(&p, end, &zz) != 0)
+                corrupt(cycle);
+            pc += 2 + (int)((zz >> 1) ^ -(zz & 1));
+            if (end - p < 2)
+                corrupt(cycle);
+            unsigned short opcode = p[0] << 8 | p[1];
+            p += 2;
+            if (get_varint(&p, end, &mask) != 0)
+                corrupt(cycle);
+
+            format_opcode(opcode, text);
+            printf("%10llu %03x: %04x  %-*s", (unsigned long long)cycle,
+                    pc, opcode, mask ? 16 : 0, text);
+            for (int i = 0; mask != 0; i++, mask >>= 1)
+            {
+                if (!(mask & 1))
+                    continue;
+                if (p >= end)
+                    corrupt(cycle);
+                printf(" V%x=%02x", i, *p++);
+            }
+            printf("\n");
+        }
+    }
+    free(chunk);
+    fclose(in);
+    return 0;
+}